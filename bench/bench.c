@@ -0,0 +1,334 @@
+/**
+ * @file bench.c
+ * @brief runs the benchmark workloads on a tree with myfind and GNU find
+ *
+ * Usage: bench <myfind> <tree> [results.json] [rounds]
+ * Every workload runs rounds times (default 5) per program with the output going to /dev/null.
+ * The fastest time counts, and the peak RSS is the maximum of all rounds. The syscalls are
+ * counted in one more run under ptrace, which includes the startup of the program. The results
+ * go to a JSON file (default bench.json) and to stdout.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * a workload, the arguments follow the tree
+ */
+typedef struct workload_s {
+  char *name;
+  char *args[4];
+} workload_t;
+
+/**
+ * the measurements of one program on one workload
+ */
+typedef struct result_s {
+  double seconds;     /* the fastest round */
+  long peak_rss;      /* in KiB, the maximum of the rounds */
+  double syscalls;    /* -1 if ptrace is not permitted */
+  int failed;
+} result_t;
+
+static workload_t workloads[] = {{"print", {"-print", NULL}},
+                                 {"ls", {"-ls", NULL}},
+                                 {"name", {"-name", "*.c", NULL}},
+                                 {"user", {"-user", "root", NULL}},
+                                 {NULL, {NULL}}};
+
+static unsigned long entries;
+
+/**
+ * @brief returns a monotonic timestamp in seconds
+ *
+ * @returns the timestamp
+ */
+static double do_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief counts an entry of the tree, called by nftw
+ *
+ * @returns 0 to continue
+ */
+static int do_count(const char *path, const struct stat *attr, int flag, struct FTW *ftw) {
+  (void)path;
+  (void)attr;
+  (void)flag;
+  (void)ftw;
+
+  entries++;
+
+  return 0;
+}
+
+/**
+ * @brief starts a program with the output going to /dev/null
+ *
+ * @param argv the program and its arguments
+ * @param trace stop the child for ptrace before the exec
+ *
+ * @returns the pid, -1 on errors
+ */
+static pid_t do_spawn(char **argv, int trace) {
+  pid_t pid = fork();
+  int fd;
+
+  if (pid != 0) {
+    if (pid < 0) {
+      fprintf(stderr, "bench: fork(): %s\n", strerror(errno));
+    }
+    return pid;
+  }
+
+  if ((fd = open("/dev/null", O_WRONLY)) < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+    _exit(127);
+  }
+
+  if (trace && (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0 || raise(SIGSTOP) != 0)) {
+    _exit(126);
+  }
+
+  execvp(argv[0], argv);
+  fprintf(stderr, "bench: execvp(%s): %s\n", argv[0], strerror(errno));
+  _exit(127);
+}
+
+/**
+ * @brief runs a program once and measures its time and peak RSS
+ *
+ * @param argv the program and its arguments
+ * @param result the result to update
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+static int do_measure(char **argv, result_t *result) {
+  struct rusage usage;
+  double start = do_now();
+  double seconds;
+  pid_t pid = do_spawn(argv, 0);
+  int status;
+
+  if (pid < 0 || wait4(pid, &status, 0, &usage) != pid) {
+    return EXIT_FAILURE;
+  }
+
+  seconds = do_now() - start;
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "bench: %s failed with status %d\n", argv[0], status);
+    return EXIT_FAILURE;
+  }
+
+  if (result->seconds == 0 || seconds < result->seconds) {
+    result->seconds = seconds;
+  }
+  if (usage.ru_maxrss > result->peak_rss) {
+    result->peak_rss = usage.ru_maxrss;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief runs a program under ptrace and counts the syscalls of all of its threads
+ *
+ * @param argv the program and its arguments
+ *
+ * @returns the number of syscalls, -1 if ptrace is not permitted
+ */
+static double do_count_syscalls(char **argv) {
+  pid_t pid = do_spawn(argv, 1);
+  unsigned long stops = 0;
+  int status;
+  pid_t tid;
+
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status)) {
+    return -1;
+  }
+
+  if (ptrace(PTRACE_SETOPTIONS, pid, NULL,
+             (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL)) !=
+          0 ||
+      ptrace(PTRACE_SYSCALL, pid, NULL, NULL) != 0) {
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    return -1;
+  }
+
+  /* every syscall stops the thread twice, on entry and on exit */
+  while ((tid = waitpid(-1, &status, __WALL)) > 0) {
+    int signal = 0;
+
+    if (!WIFSTOPPED(status)) {
+      continue; /* a thread or the process ended */
+    }
+
+    if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+      stops++;
+    } else if (WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP) {
+      signal = WSTOPSIG(status); /* a real signal is passed on */
+    }
+
+    ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)signal);
+  }
+
+  return (double)stops / 2;
+}
+
+/**
+ * @brief writes a JSON string
+ *
+ * @param out the JSON file
+ * @param string the string
+ */
+static void do_write_string(FILE *out, char *string) {
+
+  fputc('"', out);
+  for (; *string; string++) {
+    if (*string == '"' || *string == '\\') {
+      fputc('\\', out);
+    }
+    if ((unsigned char)*string < 0x20) {
+      fprintf(out, "\\u%04x", *string);
+    } else {
+      fputc(*string, out);
+    }
+  }
+  fputc('"', out);
+}
+
+/**
+ * @brief writes the measurements of one program as a JSON object
+ *
+ * @param out the JSON file
+ * @param result the measurements
+ */
+static void do_write_result(FILE *out, result_t *result) {
+
+  if (result->failed) {
+    fprintf(out, "null");
+    return;
+  }
+
+  fprintf(out, "{\"seconds\": %.6f, \"entries_per_second\": %.0f, \"peak_rss_kb\": %ld, ",
+          result->seconds, (double)entries / result->seconds, result->peak_rss);
+
+  if (result->syscalls < 0) {
+    fprintf(out, "\"syscalls_per_entry\": null}");
+  } else {
+    fprintf(out, "\"syscalls_per_entry\": %.3f}", result->syscalls / (double)entries);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  char *json = argc > 3 ? argv[3] : "bench.json";
+  int rounds = argc > 4 ? atoi(argv[4]) : 5;
+  char *programs[2];
+  result_t results[sizeof(workloads) / sizeof(workloads[0])][2];
+  FILE *out;
+  int w;
+  int p;
+  int r;
+
+  if (argc < 3 || rounds < 1) {
+    fprintf(stderr, "usage: bench <myfind> <tree> [results.json] [rounds]\n");
+    return EXIT_FAILURE;
+  }
+
+  programs[0] = argv[1];
+  programs[1] = "find";
+
+  if (nftw(argv[2], do_count, 64, FTW_PHYS) != 0) {
+    fprintf(stderr, "bench: nftw(%s): %s\n", argv[2], strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  memset(results, 0, sizeof(results));
+
+  printf("%-8s %-8s %10s %14s %10s %12s\n", "workload", "program", "seconds", "entries/s",
+         "rss KiB", "syscalls/ent");
+
+  for (w = 0; workloads[w].name; w++) {
+    for (p = 0; p < 2; p++) {
+      char *args[8] = {programs[p], argv[2]};
+      result_t *result = &results[w][p];
+      int i;
+
+      for (i = 0; workloads[w].args[i]; i++) {
+        args[i + 2] = workloads[w].args[i];
+      }
+
+      /* the fastest round counts, so a cold cache in the first one doesn't matter */
+      for (r = 0; r < rounds && !result->failed; r++) {
+        result->failed = do_measure(args, result) != EXIT_SUCCESS;
+      }
+
+      if (result->failed) {
+        printf("%-8s %-8s %10s\n", workloads[w].name, p ? "find" : "myfind", "failed");
+        continue;
+      }
+
+      result->syscalls = do_count_syscalls(args);
+
+      printf("%-8s %-8s %10.4f %14.0f %10ld %12.3f\n", workloads[w].name, p ? "find" : "myfind",
+             result->seconds, (double)entries / result->seconds, result->peak_rss,
+             result->syscalls < 0 ? -1 : result->syscalls / (double)entries);
+    }
+  }
+
+  if (!(out = fopen(json, "w"))) {
+    fprintf(stderr, "bench: fopen(%s): %s\n", json, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  fprintf(out, "{\n  \"tree\": ");
+  do_write_string(out, argv[2]);
+  fprintf(out, ",\n  \"entries\": %lu,\n  \"rounds\": %d,\n  \"time\": %ld,\n", entries, rounds,
+          (long)time(NULL));
+  fprintf(out, "  \"workloads\": [\n");
+
+  for (w = 0; workloads[w].name; w++) {
+    fprintf(out, "    {\"name\": \"%s\", \"myfind\": ", workloads[w].name);
+    do_write_result(out, &results[w][0]);
+    fprintf(out, ", \"find\": ");
+    do_write_result(out, &results[w][1]);
+
+    /* below 1 myfind is faster */
+    if (results[w][0].failed || results[w][1].failed) {
+      fprintf(out, ", \"time_ratio_to_find\": null}");
+    } else {
+      fprintf(out, ", \"time_ratio_to_find\": %.3f}",
+              results[w][0].seconds / results[w][1].seconds);
+    }
+    fprintf(out, "%s\n", workloads[w + 1].name ? "," : "");
+  }
+
+  fprintf(out, "  ]\n}\n");
+
+  if (fclose(out) != 0) {
+    fprintf(stderr, "bench: fclose(%s): %s\n", json, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  printf("bench: results written to %s\n", json);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,286 @@
+/**
+ * @file gen_tree.c
+ * @brief generates the deterministic directory tree of the benchmark
+ *
+ * Usage: gen_tree <directory> [scale]
+ * The tree has the same names, sizes, times, symlinks and (as root) owners on every run:
+ * wide/ one flat directory, deep/ a narrow chain, links/ symlinks to files, directories
+ * and nowhere, owners/ entries of several users and groups including unknown ones.
+ * An existing tree of the same scale is reused.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * the mtime of all entries is this plus a generated offset
+ */
+#define GEN_EPOCH 1500000000
+
+/**
+ * bumped whenever the generated tree changes, an older tree is not reused
+ */
+#define GEN_VERSION 1
+
+static char *suffixes[] = {".c", ".h", ".o", ".txt", "", ".tar.gz", ".md", NULL};
+static uid_t owners[] = {0, 1, 2, 65534, 4242}; /* 4242 is usually not in /etc/passwd */
+
+/**
+ * the state of the xorshift generator, the same seed gives the same tree
+ */
+static uint64_t seed = 88172645463325252ull;
+static int chown_entries;
+
+/**
+ * @brief returns the next pseudo-random number
+ *
+ * @returns the number
+ */
+static uint64_t do_random(void) {
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+
+  return seed;
+}
+
+/**
+ * @brief sets the generated mtime and, as root, the owner of an entry
+ *
+ * @param path the entry, symlinks are not followed
+ * @param owner an index into owners, -1 to keep the current user
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+static int do_settle(char *path, int owner) {
+  struct timespec times[2];
+
+  if (chown_entries && owner >= 0 &&
+      lchown(path, owners[owner], (gid_t)owners[(owner + 1) % 5]) != 0) {
+    fprintf(stderr, "gen_tree: lchown(%s): %s\n", path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  times[0].tv_sec = times[1].tv_sec = GEN_EPOCH + (time_t)(do_random() % 86400000);
+  times[0].tv_nsec = times[1].tv_nsec = 0;
+
+  if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) != 0) {
+    fprintf(stderr, "gen_tree: utimensat(%s): %s\n", path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief creates a sparse file with a generated name and size
+ *
+ * @param directory the parent directory
+ * @param number the number of the file within the directory
+ * @param owner an index into owners, -1 to keep the current user
+ * @param path the buffer for the path of the file, 4096 bytes
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+static int do_file(char *directory, unsigned long number, int owner, char *path) {
+  int fd;
+
+  snprintf(path, 4096, "%s/f%lu%s", directory, number, suffixes[do_random() % 7]);
+
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+    fprintf(stderr, "gen_tree: open(%s): %s\n", path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (ftruncate(fd, (off_t)(do_random() % 65536)) != 0) {
+    fprintf(stderr, "gen_tree: ftruncate(%s): %s\n", path, strerror(errno));
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  close(fd);
+
+  return do_settle(path, owner);
+}
+
+/**
+ * @brief creates a directory
+ *
+ * @param path the directory
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+static int do_mkdir(char *path) {
+
+  if (mkdir(path, 0755) != 0) {
+    fprintf(stderr, "gen_tree: mkdir(%s): %s\n", path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief creates the four shapes of the tree
+ *
+ * @param root the root directory, created
+ * @param scale multiplies the number of entries
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+static int do_generate(char *root, unsigned long scale) {
+  char directory[1024]; /* the longest is deep/ with 100 levels */
+  char path[4096];
+  char target[4096];
+  unsigned long i;
+  unsigned long j;
+  int depth;
+
+  if (do_mkdir(root) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  /* wide: a single directory with many files */
+  snprintf(directory, sizeof(directory), "%s/wide", root);
+  if (do_mkdir(directory) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < 20000 * scale; i++) {
+    if (do_file(directory, i, -1, path) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+  }
+  do_settle(directory, -1);
+
+  /* deep: a chain of directories with a few files each */
+  snprintf(directory, sizeof(directory), "%s/deep", root);
+  for (depth = 0; depth < 100; depth++) {
+    if (do_mkdir(directory) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+    for (i = 0; i < 10 * scale; i++) {
+      if (do_file(directory, i, -1, path) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+      }
+    }
+    strcat(directory, "/d");
+  }
+  /* the times of the chain from the bottom up, creating an entry changes the parent */
+  for (depth = 0; depth < 100; depth++) {
+    directory[strlen(directory) - 2] = '\0';
+    do_settle(directory, -1);
+  }
+
+  /* links: symlinks to files, to directories and to nowhere */
+  snprintf(directory, sizeof(directory), "%s/links", root);
+  if (do_mkdir(directory) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < 2000 * scale; i++) {
+    if (do_file(directory, i, -1, target) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+    snprintf(path, sizeof(path), "%s/l%lu", directory, i);
+    switch (i % 20) {
+    case 0:
+      snprintf(target, sizeof(target), "../deep/d/d");
+      break;
+    case 1:
+      snprintf(target, sizeof(target), "missing%lu", i);
+      break;
+    default:
+      memmove(target, target + strlen(directory) + 1, strlen(target + strlen(directory) + 1) + 1);
+    }
+    if (symlink(target, path) != 0) {
+      fprintf(stderr, "gen_tree: symlink(%s): %s\n", path, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    do_settle(path, -1);
+  }
+  do_settle(directory, -1);
+
+  /* owners: directories and files of several users and groups */
+  snprintf(path, sizeof(path), "%s/owners", root);
+  if (do_mkdir(path) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  for (j = 0; j < 20; j++) {
+    snprintf(directory, sizeof(directory), "%s/owners/u%lu", root, j);
+    if (do_mkdir(directory) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+    for (i = 0; i < 250 * scale; i++) {
+      if (do_file(directory, i, (int)((i + j) % 5), path) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+      }
+    }
+    do_settle(directory, (int)(j % 5));
+  }
+  snprintf(path, sizeof(path), "%s/owners", root);
+  do_settle(path, -1);
+  do_settle(root, -1);
+
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long scale = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+  char stamp[4096];
+  char expected[64];
+  char found[64] = "";
+  FILE *file;
+
+  if (argc < 2 || scale == 0) {
+    fprintf(stderr, "usage: gen_tree <directory> [scale]\n");
+    return EXIT_FAILURE;
+  }
+
+  snprintf(stamp, sizeof(stamp), "%s.stamp", argv[1]);
+  snprintf(expected, sizeof(expected), "gen_tree %d %lu\n", GEN_VERSION, scale);
+
+  /* the stamp is written last, so an interrupted run doesn't count */
+  if ((file = fopen(stamp, "r"))) {
+    if (!fgets(found, sizeof(found), file)) {
+      found[0] = '\0';
+    }
+    fclose(file);
+  }
+
+  if (strcmp(found, expected) == 0) {
+    printf("gen_tree: reusing %s\n", argv[1]);
+    return EXIT_SUCCESS;
+  }
+
+  if (access(argv[1], F_OK) == 0) {
+    fprintf(stderr, "gen_tree: %s exists but was not generated with scale %lu, remove it first\n",
+            argv[1], scale);
+    return EXIT_FAILURE;
+  }
+
+  /* the owners only differ when running as root */
+  chown_entries = geteuid() == 0;
+  if (!chown_entries) {
+    fprintf(stderr, "gen_tree: not root, all entries belong to the current user\n");
+  }
+
+  if (do_generate(argv[1], scale) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  if (!(file = fopen(stamp, "w")) || fputs(expected, file) == EOF || fclose(file) != 0) {
+    fprintf(stderr, "gen_tree: %s: %s\n", stamp, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  printf("gen_tree: generated %s\n", argv[1]);
+
+  return EXIT_SUCCESS;
+}
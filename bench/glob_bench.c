@@ -0,0 +1,193 @@
+/**
+ * @file glob_bench.c
+ * @brief compares the compiled patterns of -name/-path and the pattern sets of -name-from
+ * with fnmatch
+ *
+ * Usage: glob_bench [names] [rounds]
+ * The names are read line by line from a file (e.g. the output of `find / -printf '%f\n'`),
+ * otherwise a synthetic set of source tree names is generated.
+ */
+
+#define main myfind_main
+#include "../main.c"
+#undef main
+
+/**
+ * the patterns to compare, from the cheapest to the most expensive kind
+ */
+static char *patterns[] = {"Makefile", "lib*",      "*.c",          "*test*",   "*.[ch]",
+                           "?.o",      "*_[0-9]*.h", "[!.]*.tar.gz", "*a*b*c*d*", NULL};
+
+/**
+ * @brief returns a monotonic timestamp in seconds
+ *
+ * @returns the timestamp
+ */
+static double do_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief reads the names from a file or generates them
+ *
+ * @param file the file with one name per line, NULL to generate
+ * @param count the number of names read
+ *
+ * @returns the names, NULL on errors
+ */
+static char **do_load_names(char *file, size_t *count) {
+  static char *stems[] = {"main", "util", "test_parser", "libfoo", "README", "config", "x", NULL};
+  static char *suffixes[] = {".c", ".h", ".o", ".tar.gz", "", ".md", "_1.h", NULL};
+  size_t capacity = 1 << 16;
+  char **names = malloc(capacity * sizeof(*names));
+  char line[4096];
+  FILE *input;
+  size_t i;
+
+  *count = 0;
+
+  if (!names) {
+    return NULL;
+  }
+
+  if (!file) {
+    for (i = 0; i < capacity; i++) {
+      snprintf(line, sizeof(line), "%s%zu%s", stems[i % 7], i % 1000, suffixes[(i / 7) % 7]);
+      names[(*count)++] = strdup(line);
+    }
+    return names;
+  }
+
+  if (!(input = fopen(file, "r"))) {
+    fprintf(stderr, "glob_bench: fopen(%s): %s\n", file, strerror(errno));
+    free(names);
+    return NULL;
+  }
+
+  while (fgets(line, sizeof(line), input)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (*count == capacity) {
+      capacity *= 2;
+      names = realloc(names, capacity * sizeof(*names));
+    }
+    names[(*count)++] = strdup(line);
+  }
+
+  fclose(input);
+
+  return names;
+}
+
+int main(int argc, char *argv[]) {
+  size_t count;
+  char **names;
+  int rounds = argc > 2 ? atoi(argv[2]) : 20;
+  int status = EXIT_SUCCESS;
+  size_t i;
+  int p;
+
+  setlocale(LC_ALL, "");
+  program_name = argv[0];
+
+  if (!(names = do_load_names(argc > 1 ? argv[1] : NULL, &count))) {
+    return EXIT_FAILURE;
+  }
+
+  printf("%-14s %5s %10s %12s %12s %8s\n", "pattern", "kind", "matches", "fnmatch ns", "compiled ns",
+         "speedup");
+
+  for (p = 0; patterns[p]; p++) {
+    matcher_t *matcher = do_compile_pattern(patterns[p]);
+    size_t expected = 0;
+    size_t matches = 0;
+    double start;
+    double slow;
+    double fast;
+    int r;
+
+    start = do_now();
+    for (r = 0; r < rounds; r++) {
+      for (i = 0; i < count; i++) {
+        expected += fnmatch(patterns[p], names[i], 0) == 0;
+      }
+    }
+    slow = do_now() - start;
+
+    start = do_now();
+    for (r = 0; r < rounds; r++) {
+      for (i = 0; i < count; i++) {
+        matches += do_match(matcher, names[i], strlen(names[i])) == EXIT_SUCCESS;
+      }
+    }
+    fast = do_now() - start;
+
+    if (matches != expected) {
+      fprintf(stderr, "glob_bench: %s matched %zu names instead of %zu\n", patterns[p],
+              matches / rounds, expected / rounds);
+      status = EXIT_FAILURE;
+    }
+
+    printf("%-14s %5d %10zu %12.1f %12.1f %7.1fx\n", patterns[p], matcher->kind, matches / rounds,
+           slow * 1e9 / ((double)count * rounds), fast * 1e9 / ((double)count * rounds), slow / fast);
+
+    do_free_matcher(matcher);
+  }
+
+  /* all patterns at once, as -name-from compiles them */
+  {
+    patternset_t *set;
+    size_t expected = 0;
+    size_t matches = 0;
+    double start;
+    double slow;
+    double fast;
+    int r;
+
+    for (p = 0; patterns[p]; p++) {
+    }
+
+    if (!(set = do_compile_patterns(patterns, (size_t)p))) {
+      return EXIT_FAILURE;
+    }
+
+    start = do_now();
+    for (r = 0; r < rounds; r++) {
+      for (i = 0; i < count; i++) {
+        for (p = 0; patterns[p] && fnmatch(patterns[p], names[i], 0) != 0; p++) {
+        }
+        expected += patterns[p] != NULL;
+      }
+    }
+    slow = do_now() - start;
+
+    start = do_now();
+    for (r = 0; r < rounds; r++) {
+      for (i = 0; i < count; i++) {
+        matches += do_match_set(set, names[i], strlen(names[i])) == EXIT_SUCCESS;
+      }
+    }
+    fast = do_now() - start;
+
+    if (matches != expected) {
+      fprintf(stderr, "glob_bench: the set matched %zu names instead of %zu\n", matches / rounds,
+              expected / rounds);
+      status = EXIT_FAILURE;
+    }
+
+    printf("%-14s %5s %10zu %12.1f %12.1f %7.1fx\n", "(all of them)", "set", matches / rounds,
+           slow * 1e9 / ((double)count * rounds), fast * 1e9 / ((double)count * rounds), slow / fast);
+
+    do_free_patterns(set);
+  }
+
+  for (i = 0; i < count; i++) {
+    free(names[i]);
+  }
+  free(names);
+
+  return status;
+}
@@ -1,18 +1,124 @@
+#define _GNU_SOURCE /* O_PATH and open_by_handle_at for -watch */
+
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <fnmatch.h>
 #include <grp.h>
-#include <libgen.h>
 #include <limits.h>
 #include <locale.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef HAVE_SYS_FANOTIFY_H
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+#ifdef FAN_REPORT_DFID_NAME
+#define HAVE_FANOTIFY_NAMES /* events with the directory handle and the entry name, Linux 5.9 */
+#endif
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#endif
+
+/**
+ * a pattern for -name or -path, compiled once by do_compile_pattern
+ */
+typedef struct matcher_s {
+  int kind;                   /* one of the MATCH_* kinds */
+  char *pattern;              /* the original, used for fnmatch */
+  char *text;                 /* the unescaped text of the literal kinds */
+  size_t length;
+  int multibyte;              /* contains '?' or brackets, which match whole characters */
+  unsigned long long *table;  /* NFA: per byte, the states which advance on it */
+  unsigned long long loops;   /* NFA: the states preceded by a '*' */
+  unsigned long long accept;  /* NFA: the final state */
+  size_t count;               /* NFA: the number of characters, the minimal length */
+  size_t tail;                /* NFA: the characters after the last '*' */
+} matcher_t;
+
+/**
+ * the kinds of compiled patterns, from the cheapest to the most expensive
+ */
+enum {
+  MATCH_LITERAL,  /* abc */
+  MATCH_PREFIX,   /* abc* */
+  MATCH_SUFFIX,   /* *abc */
+  MATCH_CONTAINS, /* *abc* */
+  MATCH_NFA,      /* everything else with up to 63 characters, '?' or brackets */
+  MATCH_FNMATCH   /* character classes, collation dependent ranges or too long */
+};
+
+/**
+ * a literal, prefix or suffix text of a pattern set, looked up by its kind and bytes
+ */
+typedef struct textslot_s {
+  char *text; /* NULL for an empty slot */
+  size_t length;
+  int kind; /* MATCH_LITERAL, MATCH_PREFIX or MATCH_SUFFIX */
+} textslot_t;
+
+/**
+ * the patterns of -name-from or -path-from, matched in one pass per entry: literals,
+ * prefixes and suffixes with a hash lookup per distinct length, substrings with an
+ * Aho-Corasick automaton and the other patterns with a lazily built DFA of their combined NFA
+ */
+typedef struct patternset_s {
+  char *data;            /* the pattern file, the patterns point into it */
+  matcher_t **matchers;  /* all patterns, compiled by do_compile_pattern */
+  size_t count;
+  int all;               /* a pattern like "*" matches everything */
+  textslot_t *slots;     /* open addressing, a power of 2 */
+  size_t slot_capacity;
+  size_t *lengths[3];    /* the distinct lengths of the literals, prefixes and suffixes */
+  size_t length_count[3];
+  int *automaton;        /* Aho-Corasick: 256 transitions per node, node 0 is the root */
+  unsigned char *found;  /* Aho-Corasick: a substring ends at the node */
+  size_t nodes;
+  matcher_t **globs;     /* the MATCH_NFA patterns, packed into the combined NFA */
+  size_t glob_count;
+  int multibyte;         /* a glob matches whole characters, see do_match */
+  size_t words;          /* the 64-bit words of a combined NFA state */
+  unsigned long long *table; /* per byte and word, the states which advance on it */
+  unsigned long long *loops;
+  unsigned long long *accept;
+  unsigned long long *start;
+  unsigned long long *scratch; /* the next NFA state, computed while holding the write lock */
+  pthread_rwlock_t lock;     /* the DFA is extended by the threads while they match */
+  unsigned long long *keys;  /* DFA: the NFA state of each DFA state */
+  int *next;                 /* DFA: 256 transitions per state, -1 if not built yet */
+  unsigned char *accepting;
+  size_t states;
+  size_t state_capacity;
+  size_t state_limit;        /* the cache is flushed when it is full */
+  int *buckets;              /* DFA: the states by the hash of their key, -1 for none */
+  size_t bucket_capacity;
+  matcher_t **others;        /* MATCH_FNMATCH, checked one by one */
+  size_t other_count;
+} patternset_t;
+
+/**
+ * the DFA of a pattern set uses up to this many bytes before it is flushed
+ */
+#define DFA_MEMORY (8 << 20)
+
 /**
  * a linked list containing the parsed parameters
  */
@@ -20,33 +126,952 @@ typedef struct params_s {
   char *location;
   int help;
   int print;
+  int print0;
   int ls;
+  int dupes;
+  int prune;
   int nouser;
   char type;
   char *user;
   unsigned int userid;
   char *path;
+  matcher_t *path_matcher;
   char *name;
+  matcher_t *name_matcher;
+  patternset_t *patterns; /* -name-from or -path-from */
+  char *contains;         /* -contains */
+  size_t guard;           /* -contains: the position of its rarest byte, see do_search */
+  struct exec_s *exec; /* -exec or -execdir */
+  struct format_s *format; /* -printf */
+  int test;         /* -size, -mtime, -mmin, -newer, -perm, -name-from or -path-from: the OP_* */
+  char cmp;         /* '+' more, '-' less or 0 exactly; -perm: '-' all, '/' any or 0 */
+  long long number; /* -size: the units; -mtime, -mmin: the seconds of the window; -perm: the mode */
+  long long unit;   /* -size: the bytes of a unit */
+  struct timespec time; /* -mtime, -mmin, -newer: the reference time */
+  char op; /* an operator: 'a'nd, 'o'r, '!', '(' or ')' */
   struct params_s *next;
 } params_t;
 
+/**
+ * the tests, actions and operators of an expression
+ */
+enum {
+  OP_TRUE, /* options, which are always true and emit no code */
+  OP_TYPE,
+  OP_NAME,
+  OP_PATH,
+  OP_NAMES, /* -name-from */
+  OP_PATHS, /* -path-from */
+  OP_USER,
+  OP_NOUSER,
+  OP_SIZE,
+  OP_TIME, /* -mtime, -mmin and -newer */
+  OP_PERM,
+  OP_CONTAINS,
+  OP_PRINT,
+  OP_PRINT0,
+  OP_LS,
+  OP_PRINTF,
+  OP_DUPES,
+  OP_PRUNE,
+  OP_EXEC,
+  OP_NOT,
+  OP_AND,
+  OP_OR
+};
+
+/**
+ * the entry data an instruction needs, cheapest first
+ */
+enum {
+  NEED_NAME = 1,  /* the name and the path */
+  NEED_TYPE = 2,  /* d_type, the attributes only if it is unknown */
+  NEED_STAT = 4,  /* the attributes */
+  NEED_OWNER = 8  /* the attributes and a user lookup */
+};
+
+/**
+ * a node of the expression tree, only used while compiling;
+ * the operands of -a and -o are flattened into one list
+ */
+typedef struct node_s {
+  int op;
+  params_t *param; /* the parameter of a test or action */
+  struct node_s **children;
+  size_t count;
+  int pure;    /* no side effects inside, the node may be moved */
+  int action;  /* prints something, so no -print is added */
+  double cost; /* the estimated cost of an evaluation */
+  double rate; /* the estimated probability of being true */
+} node_t;
+
+/**
+ * an instruction of the compiled program; the next instruction depends
+ * on the result, so the program needs no stack and no operators
+ */
+typedef struct insn_s {
+  int op;
+  int needs;   /* the NEED_* flags */
+  int on_true; /* the index of the next instruction or PROGRAM_END */
+  int on_false;
+  char type;
+  unsigned int userid;
+  matcher_t *matcher;
+  patternset_t *patterns;
+  char *text; /* -contains: the string, its length and the position of its rarest byte */
+  size_t length;
+  size_t guard;
+  struct exec_s *exec;
+  struct format_s *format;
+  char cmp; /* the comparison, the number, the unit and the time of the metadata tests */
+  long long number;
+  long long unit;
+  struct timespec time;
+} insn_t;
+
+/**
+ * the compiled expression
+ */
+typedef struct program_s {
+  insn_t *code;
+  int count;
+  int start; /* the first instruction or PROGRAM_END */
+  int needs; /* the NEED_* flags of all instructions */
+} program_t;
+
+/**
+ * the target of the instructions which end the evaluation
+ */
+#define PROGRAM_END -1
+
+/**
+ * a growable path buffer; names are appended when descending
+ * and cut off again when returning, instead of allocating a path per entry;
+ * also used for the sections of an index while it is built
+ */
+typedef struct pathbuf_s {
+  char *buffer;
+  size_t length;
+  size_t capacity;
+} pathbuf_t;
+
+/**
+ * the command of -exec or -execdir; with '+' the entries are collected
+ * and the command runs with as many of them as fit into ARG_MAX
+ */
+typedef struct exec_s {
+  char **argv;  /* the command without the terminator, with '+' also without the last {} */
+  int argc;
+  int multiple; /* terminated by '+' */
+  int dir;      /* -execdir: runs in the directory of the entry, {} is ./name */
+  size_t limit; /* '+': the space left for the entries by ARG_MAX, the environment and argv */
+  pthread_mutex_t lock; /* '+': the threads share the collected entries */
+  pathbuf_t names;      /* '+': the collected entries, each terminated by a null character */
+  size_t count;
+  size_t size;          /* '+': the size of the collected entries and their pointers */
+  pathbuf_t directory;  /* '+' with -execdir: the directory of the collected entries */
+  int fd;               /* '+' with -execdir: the same, opened */
+} exec_t;
+
+/**
+ * a part of a -printf format: literal text with the escapes replaced or a directive
+ */
+typedef struct directive_s {
+  char kind;      /* 0 for literal text, else the directive like 'p' or 's'; 'A', 'C', 'T' for times */
+  char time;      /* 'A', 'C', 'T': the time format character like '@', 0 for the ctime layout */
+  char left;      /* '-': aligned to the left */
+  char alternate; /* '#': %m with a leading 0 */
+  int width;
+  int precision;  /* strings are cut off after this many bytes, -1 for no limit */
+  char *text;     /* literal text */
+  size_t length;
+} directive_t;
+
+/**
+ * a -printf format, parsed once into its parts; an entry is rendered into the output buffer
+ */
+typedef struct format_s {
+  directive_t *parts;
+  size_t count;
+  char *texts;       /* the literal texts of the parts */
+  size_t size;       /* the literals, widths and the longest numbers and times, see do_printf */
+  int needs;         /* the NEED_* flags of the directives */
+  unsigned int mask; /* the statx fields of the directives */
+} format_t;
+
+/**
+ * the longest rendered number or time of a -printf directive
+ */
+#define FORMAT_FIELD 64
+
+/**
+ * a directory entry as returned by the directory reader
+ */
+typedef struct direntry_s {
+  char *name;
+  unsigned char type; /* DT_* or DT_UNKNOWN */
+  ino_t ino;
+  off_t offset; /* the position of the next entry */
+} direntry_t;
+
+/**
+ * reads the entries of a directory in bulk into a user buffer
+ * and walks the records in place
+ */
+typedef struct dirreader_s {
+  int fd;
+  char *buffer;
+  size_t size;
+  size_t position;
+  size_t end;
+  int eof;
+  DIR *dir; /* used if getdents64 is not available */
+  direntry_t entry;
+} dirreader_t;
+
+/**
+ * an entry being checked by do_file; the attributes are only read
+ * if a check needs them or if the directory entry type is unknown
+ */
+typedef struct entry_s {
+  char *path;
+  int parent;         /* the descriptor name is relative to, or AT_FDCWD */
+  char *name;         /* the name relative to parent */
+  char *base;         /* the last component of the path, used by -name */
+  unsigned char type; /* DT_* or DT_UNKNOWN */
+  int has_attr;
+  int attr_failed; /* fstatat failed and was reported */
+  int pruned;      /* -prune was true, don't descend */
+  int depth;       /* the location is 0 */
+  size_t root;     /* the length of the location at the start of the path, for %H and %P */
+  struct index_s *index; /* the index the entry is read from, NULL for the filesystem */
+  uint64_t record;       /* the record in the index */
+  struct stat attr;
+} entry_t;
+
+/**
+ * a regular file collected by -dupes
+ */
+typedef struct dupe_s {
+  uint64_t size;
+  dev_t device;
+  ino_t inode;
+  size_t path;      /* the offset in the collected paths, also the order of the traversal */
+  uint64_t hash[2]; /* the first and last DUPES_EDGE bytes, then the whole file */
+  int failed;       /* couldn't be read, already reported */
+} dupe_t;
+
+/**
+ * the files collected by -dupes, shared by the threads; they are compared after the traversal
+ */
+typedef struct dupeset_s {
+  pthread_mutex_t lock;
+  dupe_t *items;
+  size_t count;
+  size_t capacity;
+  pathbuf_t paths; /* each terminated by a null character */
+} dupeset_t;
+
+/**
+ * a set of files by device and inode, open addressing; an inode of 0 marks an empty slot
+ */
+typedef struct inodeset_s {
+  uint64_t *slots; /* the device and the inode of each slot */
+  size_t count;
+  size_t capacity; /* a power of 2 */
+} inodeset_t;
+
+/**
+ * the files of one stage of -dupes, hashed by several threads
+ */
+typedef struct hashjob_s {
+  dupe_t **items;
+  size_t count;
+  size_t next; /* the next file to take */
+  int full;    /* the whole file instead of its edges */
+  int failed;
+  pthread_mutex_t lock;
+} hashjob_t;
+
+/**
+ * the state of a streaming 128-bit hash, four 64-bit lanes over stripes of 32 bytes
+ */
+typedef struct hasher_s {
+  uint64_t lanes[4];
+  unsigned char tail[32]; /* the bytes of an incomplete stripe */
+  size_t tail_length;
+  uint64_t total;
+} hasher_t;
+
+/**
+ * -dupes hashes only this many bytes at the start and at the end of a file first,
+ * files up to twice the size are hashed as a whole right away
+ */
+#define DUPES_EDGE 4096
+
+/**
+ * the threads hashing the files of -dupes without -threads
+ */
+#define DUPES_THREADS 4
+
+/**
+ * an output buffer, written out with write(2) in whole records
+ */
+typedef struct output_s {
+  char *buffer;
+  size_t length;
+  size_t capacity;
+} output_t;
+
+/**
+ * the fixed-width columns of an index, one value per record
+ */
+enum {
+  COL_DEPTH, /* uint16_t, the location is 0 */
+  COL_MODE,  /* uint32_t */
+  COL_UID,   /* uint32_t */
+  COL_GID,   /* uint32_t */
+  COL_NLINK, /* uint32_t */
+  COL_LINK,  /* uint32_t, the offset of the symlink target, 0 for none */
+  COL_SIZE,  /* uint64_t */
+  COL_MTIME, /* int64_t */
+  COL_CTIME, /* int64_t */
+  COL_INO,   /* uint64_t */
+  COL_DEV,   /* uint64_t */
+  COL_BLOCKS, /* uint64_t */
+  COL_FLAGS,  /* uint8_t, INDEX_* flags */
+  INDEX_COLUMNS
+};
+
+/**
+ * the flags of a record
+ */
+enum {
+  INDEX_COMPLETE = 1 /* a directory whose entries were all recorded, -update-index may reuse it */
+};
+
+/**
+ * the header of an index file, in host byte order;
+ * the sections follow it, each starting at a multiple of 8
+ */
+typedef struct index_header_s {
+  char magic[8];       /* INDEX_MAGIC, includes the version */
+  uint64_t count;      /* the number of records */
+  uint64_t paths;      /* the offset of the front-coded paths */
+  uint64_t paths_size;
+  uint64_t blocks;     /* the offset of the path offsets of every INDEX_BLOCK-th record */
+  uint64_t targets;    /* the offset of the symlink targets, each terminated by a null character */
+  uint64_t targets_size;
+  uint64_t columns[INDEX_COLUMNS]; /* the offsets of the columns */
+  int64_t created; /* the start of the build, the entries were read after it */
+} index_header_t;
+
+/**
+ * identifies an index file and its format
+ */
+#define INDEX_MAGIC "MYFINDX2"
+
+/**
+ * the paths are front-coded in blocks of this many records,
+ * so the blocks can be decoded independently by several threads
+ */
+#define INDEX_BLOCK 4096
+
+/**
+ * an index being built; the records are collected in memory in traversal order
+ * and written by do_index_write
+ */
+typedef struct indexer_s {
+  pathbuf_t paths;    /* per record: varint shared prefix, varint suffix length, suffix */
+  pathbuf_t blocks;
+  pathbuf_t targets;
+  pathbuf_t columns[INDEX_COLUMNS];
+  pathbuf_t previous; /* the previous path, the base of the front coding */
+  uint64_t count;
+} indexer_t;
+
+/**
+ * an index mapped for queries
+ */
+typedef struct index_s {
+  char *file; /* for error messages */
+  char *base;
+  size_t size;
+  index_header_t *header;
+} index_t;
+
+/**
+ * decodes the front-coded paths of an index one record after the other
+ */
+typedef struct cursor_s {
+  index_t *index;
+  unsigned char *position; /* the encoding of the next record, NULL before the first seek */
+  uint64_t next;           /* the next record to decode */
+  pathbuf_t path;          /* the path of the record before next */
+} cursor_t;
+
+/**
+ * a directory of the previous index, looked up by its path
+ */
+typedef struct snapdir_s {
+  char *path;
+  uint64_t record;
+  struct snapdir_s *next;
+} snapdir_t;
+
+/**
+ * the previous index of -update-index; unchanged directories are taken from it
+ */
+typedef struct snapshot_s {
+  index_t index;
+  cursor_t cursor; /* shared by the nested do_reuse_dir calls, which mostly read forward */
+  snapdir_t **buckets;
+  size_t capacity; /* a power of 2 */
+} snapshot_t;
+
+/**
+ * the state shared by the threads of a query, which take blocks of records
+ */
+typedef struct query_s {
+  index_t *index;
+  program_t *program;
+  uint64_t next; /* the next block to take */
+  int failed;
+} query_t;
+
+/**
+ * options which apply to the whole run instead of a single entry
+ */
+typedef struct options_s {
+  unsigned int threads;
+  size_t dirbuf;
+  int stat_needed; /* every entry needs its attributes, set by do_compile_program */
+  int uring;       /* read the attributes with io_uring in batches */
+  int flush;       /* 'l'ine or 'b'lock buffered output, decided by isatty if 0 */
+  time_t now;      /* the start of the run, the reference for recent modification times */
+  int preload;     /* fill the id caches from /etc/passwd and /etc/group upfront */
+  int stats;       /* print the counters to stderr at the end */
+  int maxdepth;    /* don't descend below this depth, -1 for no limit */
+  int mindepth;    /* don't check entries above this depth */
+  int xdev;        /* don't descend into directories on other devices */
+  char *build_index; /* record every visited entry into this index file */
+  char *index;       /* query this index file instead of the filesystem */
+  int update;        /* build_index reuses the unchanged directories of the file */
+  int watch;         /* check the changed entries after the traversal until interrupted */
+  unsigned int open_dirs; /* the directories a worker keeps open, the others are suspended */
+  unsigned int shared_dirs; /* -threads: the directories kept open for queued subdirectories */
+  unsigned int exec_jobs; /* the commands of -exec ... + running alongside, 0 waits for each */
+  int dupes;              /* print the duplicate files collected by -dupes at the end */
+  int du;                 /* print the disk usage of each directory when it is left */
+  int du_depth;           /* -du: print only the directories up to this depth, -1 for all */
+  int follow;             /* follow the symlinks: 'L' all of them, 'H' only the locations, 0 none */
+  unsigned int statx_mask; /* the fields statx is asked for, set by do_compile_program */
+  int fast_stat;           /* statx may return cached attributes without revalidating them */
+  struct timespec start;   /* the start of the run, the reference of -mtime and -mmin */
+} options_t;
+
+/**
+ * a cached user or group; unknown ids are cached as well, with the id as the name
+ */
+typedef struct idname_s {
+  unsigned int id;
+  int exists; /* 0 if NSS doesn't know the id */
+  char *name;
+  struct idname_s *next;
+} idname_t;
+
+/**
+ * a hash table of users or groups by id, shared by all threads;
+ * the entries are never removed, so the names can be used without holding the lock
+ */
+typedef struct idcache_s {
+  pthread_rwlock_t lock;
+  idname_t **buckets;
+  size_t count;
+  size_t capacity;
+} idcache_t;
+
+/**
+ * the timed phases of -stats, the time of ls includes its nss lookups and readlink calls
+ * (also for -printf), the time of content the open, read and mmap calls of -contains
+ */
+enum {
+  PHASE_READDIR,
+  PHASE_STAT,
+  PHASE_NSS,
+  PHASE_MATCH,
+  PHASE_LS,
+  PHASE_WRITE,
+  PHASE_CONTENT,
+  PHASES
+};
+
+/**
+ * every STATS_SAMPLE-th call of a phase is timed, the time of the others is extrapolated
+ */
+#define STATS_SAMPLE 64
+
+/**
+ * counters of the run, collected per thread and summed up at the end
+ */
+typedef struct stats_s {
+  unsigned long entries;      /* entries checked by do_file */
+  unsigned long errors;       /* failed fstatat, openat, getdents64 and readlink calls */
+  unsigned long nss_lookups;  /* getpwuid_r and getgrgid_r calls */
+  unsigned long nss_hits;     /* lookups answered by the id caches */
+  unsigned long mtime_hits;   /* modification times rendered by an earlier entry */
+  unsigned long mtime_misses; /* modification times rendered with localtime_r and strftime */
+  unsigned long dirs_read;    /* directories read with getdents64 */
+  unsigned long dirs_reused;  /* unchanged directories taken from the previous index */
+  unsigned long calls[PHASES];
+  unsigned long samples[PHASES];
+  uint64_t sampled[PHASES]; /* nanoseconds spent in the timed calls */
+} stats_t;
+
+/*
+ * the instrumentation of -stats, compiled out with -DNO_STATS (cmake -DWITH_STATS=OFF);
+ * STATS_BEGIN and STATS_END enclose a phase within one block
+ */
+#ifndef NO_STATS
+#define STATS_COUNT(counter) (stats.counter++)
+#define STATS_BEGIN(phase) uint64_t stats_start_##phase = do_stats_begin(phase)
+#define STATS_END(phase) do_stats_end(phase, stats_start_##phase)
+#else
+#define STATS_COUNT(counter) ((void)0)
+#define STATS_BEGIN(phase) ((void)0)
+#define STATS_END(phase) ((void)0)
+#endif
+
+/**
+ * a rendered modification time and the range of times it is valid for
+ */
+typedef struct mtime_s {
+  time_t from;
+  time_t to; /* exclusive */
+  char text[16];
+} mtime_t;
+
+/**
+ * a directory kept open for the queued tasks of its subdirectories, closed with the last one
+ */
+typedef struct dirhandle_s {
+  int fd;
+  unsigned long refs; /* the frame reading the directory and the queued tasks */
+} dirhandle_t;
+
+/**
+ * a directory waiting in a deque; it is opened relative to its parent, so the length
+ * of the path doesn't matter
+ */
+typedef struct task_s {
+  char *path;
+  size_t name;         /* the offset of the directory name in the path */
+  dirhandle_t *parent; /* NULL to open the path relative to the working directory */
+  int depth;           /* the depth of the directory, the location is 0 */
+} task_t;
+
+/**
+ * a double-ended queue of directory paths owned by a single worker;
+ * the owner pushes and pops at the bottom, the other workers steal from the top
+ */
+typedef struct deque_s {
+  pthread_mutex_t lock;
+  task_t *items;
+  size_t top;
+  size_t bottom;
+  size_t capacity;
+} deque_t;
+
+/**
+ * the state shared by all workers of a parallel traversal
+ */
+typedef struct pool_s {
+  struct program_s *program;
+  struct worker_s *workers;
+  unsigned int count;
+  unsigned long pending; /* directories queued or being processed */
+  unsigned long queued;  /* directories waiting in a deque */
+  unsigned int sleeping;
+  unsigned int shared; /* the directories open for queued subdirectories */
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+} pool_t;
+
+#ifdef HAVE_LINUX_IO_URING_H
+/**
+ * a minimal io_uring instance, used to submit statx calls in batches
+ */
+typedef struct uring_s {
+  int fd;
+  unsigned int entries;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+} uring_t;
+
+/**
+ * a directory entry waiting for its statx completion
+ */
+typedef struct batched_s {
+  size_t name; /* the offset in the names of the batch */
+  unsigned char type;
+  int done;
+  int result;   /* 0 or a negative errno */
+  off_t offset; /* the position of the next entry, where a suspended directory continues */
+  struct statx stx;
+} batched_t;
+#else
+typedef struct uring_s uring_t;
+#endif
+
+/**
+ * at most this many directories are open per worker, fewer if RLIMIT_NOFILE is low
+ */
+#define OPEN_DIRS 64
+
+/**
+ * -contains reads files in chunks of this size into a buffer on the stack,
+ * files from CONTAINS_MMAP bytes on are mapped instead
+ */
+#define CONTAINS_BUFFER 65536
+#define CONTAINS_MMAP (1 << 20)
+
+/**
+ * how the entries of a directory frame are read
+ */
+enum {
+  FRAME_READ,  /* with do_reader_next */
+  FRAME_BATCH, /* with do_reader_next and statx on io_uring in batches */
+  FRAME_REUSE  /* from the previous index of -update-index */
+};
+
+/**
+ * a directory on the explicit stack of do_walk; the frames beyond the descriptor budget are
+ * suspended: they close the descriptor, give back the buffers and remember where to continue
+ */
+typedef struct frame_s {
+  int kind;
+  dirreader_t reader; /* only the descriptor is used by FRAME_REUSE, -1 while suspended */
+  size_t length;      /* the length of the directory path */
+  off_t offset;       /* suspended: the position after the entry being descended into */
+  dev_t device;       /* suspended: identifies the directory when it is opened again */
+  ino_t inode;
+  size_t flag;      /* the record + 1 to mark INDEX_COMPLETE at the end with -build-index */
+  int error;        /* with a flag: errno before the directory, restored at the end */
+  uint64_t record;  /* FRAME_REUSE: the next record of the previous index */
+  int record_depth; /* FRAME_REUSE: the depth of the directory record */
+  struct batched_s *batch; /* FRAME_BATCH: the entries of the current batch */
+  char *names;             /* FRAME_BATCH: their names */
+  size_t names_capacity;
+  unsigned int count;   /* FRAME_BATCH: the entries in the batch */
+  unsigned int next;    /* FRAME_BATCH: the next entry to return */
+  unsigned int pending; /* FRAME_BATCH: the submitted statx calls not reaped yet */
+  uint64_t du_blocks;   /* -du: the 512-byte blocks of the directory and the entries below */
+  uint64_t du_entries;
+  dirhandle_t *handle; /* -threads: the directory shared with the tasks of its subdirectories */
+} frame_t;
+
+/**
+ * a directory watched with inotify, found by its watch descriptor
+ */
+typedef struct watch_s {
+  int wd;
+  int depth;    /* the depth of the directory, the location is 0 */
+  dev_t device; /* the device and inode of the directory, to notice when it is replaced */
+  ino_t inode;
+  dev_t root;   /* the device of the location, for -xdev */
+  size_t location; /* the length of the location at the start of the path */
+  char *path;      /* stored after the struct */
+  struct watch_s *next;
+} watch_t;
+
+/**
+ * a location watched with fanotify; the events are matched by the resolved path
+ */
+typedef struct watchroot_s {
+  char *location;
+  char *real; /* from realpath */
+  dev_t device;
+} watchroot_t;
+
+/**
+ * a filesystem marked with fanotify; the directory handles of its events are opened with fd
+ */
+typedef struct watchfs_s {
+  dev_t device;
+  int fsid[2];
+  int fd;
+} watchfs_t;
+
+/**
+ * the events of -watch; fanotify marks whole filesystems and needs no state per directory,
+ * inotify needs a watch per directory and is used if fanotify is not permitted
+ */
+typedef struct watcher_s {
+  int fanotify; /* -1 with inotify */
+  int inotify;  /* -1 with fanotify */
+  watch_t **buckets;
+  size_t capacity; /* a power of 2 */
+  size_t count;
+  int full; /* the inotify watch limit was reached and reported */
+  watchroot_t *roots;
+  size_t root_count;
+  watchfs_t *filesystems;
+  size_t filesystem_count;
+} watcher_t;
+
+/**
+ * the inotify events of a watched directory
+ */
+#define WATCH_INOTIFY                                                                            \
+  (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW |       \
+   IN_EXCL_UNLINK)
+
+/**
+ * the state of a traversal; either a thread of a pool with its own deque
+ * or the only walker of a sequential traversal, then pool is NULL
+ */
+typedef struct worker_s {
+  pool_t *pool;
+  deque_t deque;
+  unsigned int id;
+  pthread_t thread;
+  pathbuf_t path;
+  char **buffers; /* spare directory reader buffers */
+  size_t buffer_count;
+  size_t buffer_capacity;
+  uring_t *uring;   /* created on the first use with -uring */
+  int uring_failed; /* io_uring is not available, use fstatat */
+  int depth;        /* the depth of the entries being processed, the location is 0 */
+  dev_t device;     /* the device of the location, for -xdev */
+  size_t root;      /* the length of the location at the start of the path */
+  indexer_t *indexer; /* records the entries with -build-index */
+  snapshot_t *snapshot; /* the previous index with -update-index */
+  watcher_t *watcher;   /* registers the directories being read with -watch */
+  frame_t *frames;      /* the directories being read, the last one is read next */
+  uint64_t du_blocks;   /* -du: the entry being checked, taken over by its frame if it is read */
+  uint64_t du_entries;
+  inodeset_t ancestors; /* -L: the directories of the frames, a directory among them is a loop */
+  size_t frame_count;
+  size_t frame_capacity;
+  size_t frame_open; /* the frames below are suspended */
+  int walking;       /* do_walk is running, do_dir only adds a frame */
+  int failed;
+} worker_t;
+
 void do_help(void);
 int do_parse_params(int argc, char *argv[], params_t *params);
+int do_parse_test(params_t *params, char *test, char *arg);
+int do_parse_mode(char *arg, long long *mode);
+int do_parse_size(char *arg, size_t *size);
 int do_free_params(params_t *params);
 
-int do_location(params_t *params);
-int do_file(char *path, params_t *params, struct stat attr);
-int do_dir(char *path, params_t *params, struct stat attr);
+program_t *do_compile_program(params_t *params);
+node_t *do_parse_or(params_t **cursor);
+node_t *do_parse_and(params_t **cursor);
+node_t *do_parse_unary(params_t **cursor);
+int do_check_operand(params_t *param, char *after);
+node_t *do_new_node(int op, params_t *param);
+int do_add_child(node_t *node, node_t *child);
+int do_order_node(node_t *node);
+double do_rank_node(node_t *node, int op);
+int do_emit_node(program_t *program, node_t *node, int on_true, int on_false);
+int do_free_node(node_t *node);
+int do_free_program(program_t *program);
+
+int do_location(params_t *params, program_t *program);
+int do_file(entry_t *entry, program_t *program);
+struct stat *do_get_attr(entry_t *entry);
+int do_dir(worker_t *worker, int parent, char *name, program_t *program);
+int do_walk(worker_t *worker, program_t *program);
+int do_frame_open(worker_t *worker, int parent, char *name);
+frame_t *do_frame_push(worker_t *worker, dirreader_t *reader);
+int do_frame_next(worker_t *worker, frame_t *frame, entry_t *entry);
+int do_frame_close(worker_t *worker);
+int do_frame_suspend(worker_t *worker, frame_t *frame);
+int do_frame_resume(worker_t *worker, frame_t *frame, int child);
+int do_entry(worker_t *worker, entry_t *entry, size_t length, program_t *program);
+int do_descend(worker_t *worker, entry_t *entry);
+int do_share_dir(worker_t *worker, entry_t *entry, program_t *program);
+int do_check_loop(worker_t *worker, entry_t *entry);
+int do_du_add(worker_t *worker, entry_t *entry);
+int do_du_settle(worker_t *worker, char *path);
+int do_du_close(worker_t *worker, frame_t *frame);
+int do_du_print(char *path, uint64_t blocks, uint64_t entries);
+int do_inodes_add(inodeset_t *set, dev_t device, ino_t inode, int *added);
+int do_inodes_find(inodeset_t *set, dev_t device, ino_t inode);
+int do_inodes_remove(inodeset_t *set, dev_t device, ino_t inode);
+size_t do_hash_inode(dev_t device, ino_t inode, size_t capacity);
+int do_free_inodes(inodeset_t *set);
+int do_pathbuf_append(pathbuf_t *path, size_t length, char *name);
+int do_pathbuf_reserve(pathbuf_t *path, size_t needed);
+int do_free_worker(worker_t *worker);
+
+int do_reader_open(dirreader_t *reader, worker_t *worker, int parent, char *name);
+int do_reader_attach(dirreader_t *reader, worker_t *worker, int fd);
+direntry_t *do_reader_next(dirreader_t *reader);
+int do_reader_close(dirreader_t *reader, worker_t *worker);
+
+uring_t *do_get_uring(worker_t *worker);
+int do_free_uring(uring_t *uring);
+int do_batch_next(worker_t *worker, frame_t *frame, entry_t *entry);
+int do_batch_free(worker_t *worker, frame_t *frame);
+#ifdef HAVE_LINUX_IO_URING_H
+int do_uring_reap(uring_t *uring, batched_t *batch);
+#endif
+#if defined(HAVE_LINUX_IO_URING_H) || defined(HAVE_STATX)
+void do_convert_statx(struct statx *stx, struct stat *attr);
+#endif
+
+int do_pool(char *path, dev_t device, program_t *program);
+void *do_worker(void *arg);
+int do_push(worker_t *worker, char *path, size_t name, dirhandle_t *parent, int depth);
+dirhandle_t *do_share_frame(pool_t *pool, frame_t *frame);
+int do_release(pool_t *pool, dirhandle_t *handle);
+int do_pop(worker_t *worker, task_t *task);
+int do_steal(worker_t *worker, task_t *task);
+
+int do_write(struct iovec *parts, int count);
+int do_flush(void);
+int do_write_all(struct iovec *parts, int count);
+char *do_reserve(size_t size);
+int do_commit(char *end);
+char *do_format_number(char *out, unsigned long long number, int width);
+char *do_format_string(char *out, char *string, int width, int left);
+int do_free_output(void);
 
 int do_print(char *path);
-int do_ls(char *path, struct stat attr);
-int do_type(char type, struct stat attr);
+int do_print0(char *path);
+int do_ls(char *path, struct stat attr, char *target);
+format_t *do_parse_format(char *string);
+int do_printf(format_t *format, entry_t *entry);
+char *do_format_field(char *out, char *value, size_t length, directive_t *part);
+size_t do_format_time(char *out, struct timespec time, char format);
+int do_free_format(format_t *format);
+int do_type(char type, entry_t *entry);
 int do_nouser(struct stat attr);
 int do_user(unsigned int userid, struct stat attr);
-int do_name(char *path, char *pattern);
-int do_path(char *path, char *pattern);
+int do_size(insn_t *insn, struct stat attr);
+int do_time(insn_t *insn, struct stat attr);
+int do_perm(insn_t *insn, struct stat attr);
+int do_contains(insn_t *insn, entry_t *entry);
+char *do_search(char *data, size_t length, insn_t *insn);
+size_t do_get_guard(char *text);
+int do_name(char *name, matcher_t *matcher);
+int do_path(char *path, matcher_t *matcher);
+int do_names(char *name, patternset_t *set);
+int do_paths(char *path, patternset_t *set);
+
+exec_t *do_new_exec(char **argv, int argc, int multiple, int dir);
+int do_exec(exec_t *exec, entry_t *entry);
+char *do_exec_replace(char *arg, char *path);
+int do_exec_dir(entry_t *entry);
+int do_exec_collect(exec_t *exec, entry_t *entry, char *path);
+int do_exec_flush(exec_t *exec);
+int do_exec_flush_all(program_t *program);
+int do_exec_run(char **argv, int fd, int wait);
+int do_exec_wait(pid_t pid);
+int do_exec_job(pid_t pid);
+int do_exec_finish(program_t *program);
+int do_free_exec(exec_t *exec);
+
+int do_dupes_add(entry_t *entry, struct stat attr);
+int do_dupes_finish(void);
+int do_dupes_hash(dupe_t **items, size_t count, int full);
+void *do_dupes_worker(void *arg);
+int do_hash_file(dupe_t *dupe, int full);
+int do_hash_range(int fd, hasher_t *hasher, char *path, off_t offset, uint64_t length);
+int do_dupes_print(dupe_t **group, size_t count, dupe_t **others);
+int do_compare_files(dupe_t *first, dupe_t *second, int *equal);
+int do_read_range(int fd, char *buffer, char *path, off_t offset, size_t length);
+int do_compare_inodes(const void *a, const void *b);
+int do_compare_hashes(const void *a, const void *b);
+int do_compare_groups(const void *a, const void *b);
+int do_free_dupes(void);
+void do_hasher_init(hasher_t *hasher);
+void do_hasher_update(hasher_t *hasher, unsigned char *data, size_t length);
+void do_hasher_final(hasher_t *hasher, uint64_t *hash);
+
+matcher_t *do_compile_pattern(char *pattern);
+int do_match(matcher_t *matcher, char *string, size_t length);
+int do_free_matcher(matcher_t *matcher);
+patternset_t *do_load_patterns(char *file);
+patternset_t *do_compile_patterns(char **patterns, size_t count);
+int do_add_text(patternset_t *set, matcher_t *matcher);
+size_t do_find_text(patternset_t *set, int kind, char *text, size_t length);
+int do_build_automaton(patternset_t *set, matcher_t **texts, size_t count);
+int do_build_globs(patternset_t *set);
+int do_match_set(patternset_t *set, char *string, size_t length);
+int do_match_globs(patternset_t *set, char *string, size_t length);
+int do_dfa_step(patternset_t *set, int state, unsigned char byte);
+int do_dfa_add(patternset_t *set, unsigned long long *key);
+int do_dfa_flush(patternset_t *set);
+int do_free_patterns(patternset_t *set);
+size_t do_hash_text(char *text, size_t length, size_t capacity);
+char *do_get_basename(char *path);
+
+idname_t *do_get_id(idcache_t *cache, unsigned int id, int group);
+idname_t *do_add_id(idcache_t *cache, unsigned int id, int exists, char *name);
+int do_preload_ids(idcache_t *cache, char *file);
+size_t do_hash_id(unsigned int id, size_t capacity);
+int do_free_ids(idcache_t *cache);
+
+int do_index_record(indexer_t *indexer, entry_t *entry, int depth);
+int do_index_put(pathbuf_t *column, void *value, size_t size);
+int do_index_write(indexer_t *indexer, char *file);
+int do_free_indexer(indexer_t *indexer);
+int do_index_open(index_t *index, char *file);
+int do_index_close(index_t *index);
+int do_query_index(params_t *params, program_t *program);
+int do_query_location(index_t *index, char *location, program_t *program, uint64_t first,
+                      uint64_t last);
+int do_query_parallel(index_t *index, program_t *program);
+void *do_query_worker(void *arg);
+int do_index_attr(index_t *index, uint64_t record, struct stat *attr);
+char *do_index_target(index_t *index, uint64_t record);
+size_t do_trim_slashes(char *path, size_t length);
+int do_cursor_seek(cursor_t *cursor, uint64_t record);
+int do_cursor_next(cursor_t *cursor);
+int do_snapshot_open(snapshot_t *snapshot, char *file);
+int do_snapshot_find(snapshot_t *snapshot, char *path, uint64_t *record);
+int do_snapshot_close(snapshot_t *snapshot);
+int do_reuse_dir(worker_t *worker, entry_t *entry);
+int do_reuse_next(worker_t *worker, frame_t *frame, entry_t *entry);
+int do_index_dir(worker_t *worker, entry_t *entry, program_t *program);
+size_t do_hash_path(char *path, size_t capacity);
+
+int do_watch_open(watcher_t *watcher, params_t *params, program_t *program);
+int do_watch_dir(worker_t *worker, int fd);
+int do_watch_filesystem(watcher_t *watcher, int fd, dev_t device);
+int do_watch(worker_t *worker, program_t *program);
+int do_watch_inotify(worker_t *worker, char *buffer, size_t length, program_t *program);
+int do_watch_fanotify(worker_t *worker, char *buffer, size_t length, program_t *program);
+int do_watch_entry(worker_t *worker, int fd, int depth, char *name, int created,
+                   program_t *program);
+watch_t *do_watch_find(watcher_t *watcher, int wd);
+int do_watch_forget(watcher_t *watcher, int wd);
+int do_watch_close(watcher_t *watcher);
+
+uint64_t do_stats_clock(void);
+uint64_t do_stats_begin(int phase);
+void do_stats_end(int phase, uint64_t start);
+int do_merge_stats(void);
+double do_stats_rate(unsigned long hits, unsigned long misses);
+int do_print_stats(void);
 
 char do_get_type(struct stat attr);
+char do_get_entry_type(entry_t *entry);
 char *do_get_perms(struct stat attr);
 char *do_get_user(struct stat attr);
 char *do_get_group(struct stat attr);
@@ -59,6 +1084,67 @@ char *do_get_symlink(char *path, struct stat attr);
  */
 char *program_name = "";
 
+/**
+ * a global variable containing the options of the run
+ */
+options_t options = {.threads = 1,
+                     .dirbuf = 32768,
+                     .maxdepth = -1,
+                     .open_dirs = OPEN_DIRS,
+                     .du_depth = -1};
+
+/**
+ * the output buffer of the current thread
+ */
+__thread output_t output = {NULL, 0, 0};
+
+/**
+ * serializes the writes of the thread buffers, so records are never interleaved
+ */
+pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * set after a failed write, stops the traversal
+ */
+int output_failed = 0;
+
+/**
+ * the running commands of -exec ... + with -exec-jobs, oldest first;
+ * set after one of them failed or a command couldn't be started, fails the run
+ */
+pid_t *exec_jobs = NULL;
+unsigned int exec_running = 0;
+pthread_mutex_t exec_lock = PTHREAD_MUTEX_INITIALIZER;
+int exec_failed = 0;
+
+/**
+ * the files collected by -dupes
+ */
+dupeset_t dupes = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, {NULL, 0, 0}};
+
+/**
+ * the hard links counted by -du, so each file is counted once
+ */
+inodeset_t du_links = {NULL, 0, 0};
+
+/**
+ * the users and groups seen so far
+ */
+idcache_t users = {PTHREAD_RWLOCK_INITIALIZER, NULL, 0, 0};
+idcache_t groups = {PTHREAD_RWLOCK_INITIALIZER, NULL, 0, 0};
+
+/**
+ * the counters of the current thread and the sum of the finished threads
+ */
+__thread stats_t stats;
+stats_t stats_total;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * the start of the run in nanoseconds of CLOCK_MONOTONIC, for the throughput
+ */
+uint64_t stats_started;
+
 /**
  * @brief entry point; calls do_parse_params and do_location
  *
@@ -69,9 +1155,17 @@ char *program_name = "";
  */
 int main(int argc, char *argv[]) {
   params_t *params;
+  program_t *program;
+  struct rlimit limit;
+  unsigned int budget = UINT_MAX;
+  int status;
 
   program_name = argv[0];
 
+  /* all relative times are calculated from the start, like in GNU find */
+  clock_gettime(CLOCK_REALTIME, &options.start);
+  options.now = options.start.tv_sec;
+
   /* honor the system locale */
   if (!setlocale(LC_ALL, "")) {
     fprintf(stderr, "%s: setlocale() failed\n", program_name);
@@ -95,23 +1189,129 @@ int main(int argc, char *argv[]) {
     return EXIT_SUCCESS;
   }
 
-  if (do_location(params) != EXIT_SUCCESS) {
+  if (!(program = do_compile_program(params))) {
     do_free_params(params);
     return EXIT_FAILURE;
   }
 
-  do_free_params(params);
+  /* the index needs all attributes and the records in depth-first order */
+  if (options.build_index) {
+    options.stat_needed = 1;
+#ifdef STATX_BASIC_STATS
+    options.statx_mask = STATX_BASIC_STATS;
+#endif
+    options.threads = 1;
+  }
 
-  return EXIT_SUCCESS;
-}
+  /* the totals are collected on the stack of a single traversal */
+  if (options.du) {
+    if (options.index) {
+      fprintf(stderr, "%s: -du reads the filesystem and can't be combined with -index\n",
+              program_name);
+      do_free_program(program);
+      do_free_params(params);
+      return EXIT_FAILURE;
+    }
+    options.stat_needed = 1;
+#ifdef STATX_BASIC_STATS
+    options.statx_mask |= STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | STATX_BLOCKS;
+#endif
+    options.threads = 1;
+  }
 
-/**
- * @brief prints out the program usage
- */
+  /* the loops are detected on the stack of a single traversal, by device and inode */
+  if (options.follow == 'L') {
+#ifdef STATX_BASIC_STATS
+    options.statx_mask |= STATX_TYPE | STATX_MODE | STATX_INO;
+#endif
+    options.threads = 1;
+  }
+
+  /* the directories are registered for the events while they are read */
+  if (options.watch) {
+    options.threads = 1;
+  }
+
+  /*
+   * half of the descriptors are left for the output, the index, io_uring and -watch;
+   * a subdirectory is opened before the lowest directory is suspended, hence one less
+   */
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+      limit.rlim_cur / 2 <= UINT_MAX) {
+    budget = limit.rlim_cur >= 4 ? (unsigned int)(limit.rlim_cur / 2 - 1) : 1;
+  }
+
+  /*
+   * with -threads half of the budget keeps the parents of the queued directories open,
+   * the other half is split among the workers for their frames
+   */
+  if (options.threads > 1) {
+    options.shared_dirs = budget / 2 > 0 ? budget / 2 : 1;
+    budget = (budget - budget / 2) / options.threads > 0
+                 ? (budget - budget / 2) / options.threads
+                 : 1;
+  }
+
+  if (budget < options.open_dirs) {
+    options.open_dirs = budget;
+  }
+
+  if (options.stats) {
+    stats_started = do_stats_clock();
+  }
+
+  if (options.preload) {
+    do_preload_ids(&users, "/etc/passwd");
+    do_preload_ids(&groups, "/etc/group");
+  }
+
+  /* interactive use wants to see every entry immediately, pipes want throughput */
+  if (!options.flush) {
+    options.flush = isatty(STDOUT_FILENO) ? 'l' : 'b';
+    errno = 0; /* ENOTTY is not an error, but do_location checks errno */
+  }
+
+  if (options.index) {
+    status = do_query_index(params, program);
+  } else {
+    status = do_location(params, program);
+  }
+
+  /* the rest of the entries of -exec ... + and the commands still running */
+  if (do_exec_finish(program) != EXIT_SUCCESS) {
+    status = EXIT_FAILURE;
+  }
+
+  /* the duplicates are only known when all files are collected */
+  if (options.dupes && (do_dupes_finish() != EXIT_SUCCESS || do_free_output() != EXIT_SUCCESS)) {
+    status = EXIT_FAILURE;
+  }
+  do_free_dupes();
+  do_free_inodes(&du_links);
+
+  if (options.stats) {
+    do_merge_stats();
+    do_print_stats();
+  }
+
+  do_free_ids(&users);
+  do_free_ids(&groups);
+  do_free_program(program);
+  do_free_params(params);
+
+  return status;
+}
+
+/**
+ * @brief prints out the program usage
+ */
 void do_help(void) {
 
   if (printf("usage:\n"
-             "myfind [ <location> ] [ <aktion> ]\n"
+             "myfind [ -H | -L | -P ] [ <location> ] [ <aktion> ]\n"
+             "-H                  follow the symlinks of the locations\n"
+             "-L                  follow all symlinks, loops are reported and not descended into\n"
+             "-P                  never follow symlinks (default)\n"
              "-help               show this message\n"
              "-user <name>|<uid>  entries belonging to a user\n"
              "-name <pattern>     entry names matching a pattern\n"
@@ -119,7 +1319,43 @@ void do_help(void) {
              "-print              print entries with paths\n"
              "-ls                 print entry details\n"
              "-nouser             entries not belonging to a user\n"
-             "-path               entry paths (incl. names) matching a pattern\n") < 0) {
+             "-path               entry paths (incl. names) matching a pattern\n"
+             "-name-from <file>   entry names matching one of the patterns in the file\n"
+             "-path-from <file>   entry paths matching one of the patterns in the file\n"
+             "-size [+-]<n>[cwbkMG] entries of a size, rounded up to units (default b, 512)\n"
+             "-mtime [+-]<n>      entries modified n days ago\n"
+             "-mmin [+-]<n>       entries modified n minutes ago\n"
+             "-newer <file>       entries modified more recently than the file\n"
+             "-perm [-/]<mode>    entries with exactly, all (-) or any (/) of the permissions\n"
+             "-contains <string>  regular files containing the string\n"
+             "-printf <format>    print the format for the entry, like in GNU find\n"
+             "-dupes              print groups of duplicate regular files at the end\n"
+             "-threads <n>        traverse directories with n threads\n"
+             "-dirbuf <size>[KMG] read directories with buffers of this size\n"
+             "-uring              read entry details in batches with io_uring\n"
+             "-fast-stat          accept cached entry details without revalidating them\n"
+             "-print0             print entries with paths, terminated by a null character\n"
+             "-flush line|block   write the output after each entry or when the buffer is full\n"
+             "-preload            read all users and groups from /etc/passwd and /etc/group\n"
+             "-stats              print counters and timings of the run to stderr at the end\n"
+             "-prune              don't descend into the directory\n"
+             "-du                 print the disk usage of each directory, like du\n"
+             "-du-depth <n>       print the disk usage only down to n levels\n"
+             "-maxdepth <n>       don't descend below n levels\n"
+             "-mindepth <n>       don't check entries above n levels\n"
+             "-xdev               don't descend into directories on other filesystems\n"
+             "-build-index <file> record the visited entries into an index file\n"
+             "-update-index <file> rebuild an index file, reusing its unchanged directories\n"
+             "-index <file>       check the records of an index file instead of the filesystem\n"
+             "-watch              check the new and modified entries until interrupted\n"
+             "-exec <cmd> ;       run a command for the entry, {} is replaced by the path\n"
+             "-exec <cmd> {} +    run a command for as many entries at once as possible\n"
+             "-execdir <cmd> ;|+  like -exec, but in the directory of the entry with ./name\n"
+             "-exec-jobs <n>      run up to n commands of -exec ... + alongside the traversal\n"
+             "! <expr>, -not      true if the expression is false\n"
+             "<expr> -a <expr>    true if both are true, also without -a\n"
+             "<expr> -o <expr>    true if one of them is true\n"
+             "( <expr> )          groups an expression\n") < 0) {
     fprintf(stderr, "%s: printf(): %s\n", program_name, strerror(errno));
   }
 }
@@ -148,8 +1384,15 @@ int do_parse_params(int argc, char *argv[], params_t *params) {
   int status = 0;
   int expression = 0;
 
+  /* -H, -L and -P come before the locations, like in GNU find; the last one counts */
+  for (i = 1; i < argc && (strcmp(argv[i], "-H") == 0 || strcmp(argv[i], "-L") == 0 ||
+                           strcmp(argv[i], "-P") == 0);
+       i++) {
+    options.follow = argv[i][1] == 'P' ? 0 : argv[i][1];
+  }
+
   /* params can start from argv[1] */
-  for (i = 1; i < argc; i++, params = params->next) {
+  for (; i < argc; i++, params = params->next) {
 
     /* allocate memory for the next run */
     params->next = calloc(1, sizeof(*params));
@@ -170,6 +1413,11 @@ int do_parse_params(int argc, char *argv[], params_t *params) {
       expression = 1;
       continue;
     }
+    if (strcmp(argv[i], "-print0") == 0) {
+      params->print0 = 1;
+      expression = 1;
+      continue;
+    }
     if (strcmp(argv[i], "-ls") == 0) {
       params->ls = 1;
       expression = 1;
@@ -180,6 +1428,74 @@ int do_parse_params(int argc, char *argv[], params_t *params) {
       expression = 1;
       continue;
     }
+    if (strcmp(argv[i], "-dupes") == 0) {
+      params->dupes = 1;
+      options.dupes = 1;
+      expression = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "-prune") == 0) {
+      params->prune = 1;
+      expression = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "-du") == 0) {
+      options.du = 1;
+      expression = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "-xdev") == 0 || strcmp(argv[i], "-mount") == 0) {
+      options.xdev = 1;
+      expression = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "-watch") == 0) {
+      options.watch = 1;
+      expression = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "-uring") == 0) {
+      options.uring = 1;
+      expression = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "-fast-stat") == 0) {
+      options.fast_stat = 1;
+      expression = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "-preload") == 0) {
+      options.preload = 1;
+      expression = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "-stats") == 0) {
+      options.stats = 1;
+      expression = 1;
+      continue;
+    }
+
+    /* operators, combined into an expression by do_compile_program */
+    if (strcmp(argv[i], "!") == 0 || strcmp(argv[i], "-not") == 0) {
+      params->op = '!';
+      expression = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "-and") == 0) {
+      params->op = 'a';
+      expression = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "-or") == 0) {
+      params->op = 'o';
+      expression = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "(") == 0 || strcmp(argv[i], ")") == 0) {
+      params->op = argv[i][0];
+      expression = 1;
+      continue;
+    }
 
     /* parameters expecting a non-empty second part */
     if (strcmp(argv[i], "-user") == 0) {
@@ -203,9 +1519,28 @@ int do_parse_params(int argc, char *argv[], params_t *params) {
         break; /* the second part is missing */
       }
     }
+    if (strcmp(argv[i], "-build-index") == 0 || strcmp(argv[i], "-update-index") == 0 ||
+        strcmp(argv[i], "-index") == 0) {
+      if (argv[++i] && argv[i][0]) {
+        if (argv[i - 1][1] != 'i') {
+          options.build_index = argv[i];
+          options.update = argv[i - 1][1] == 'u';
+        } else {
+          options.index = argv[i];
+        }
+        expression = 1;
+        continue;
+      } else {
+        status = 2;
+        break; /* the second part is missing */
+      }
+    }
     if (strcmp(argv[i], "-name") == 0) {
       if (argv[++i]) {
         params->name = argv[i];
+        if (!(params->name_matcher = do_compile_pattern(params->name))) {
+          return EXIT_FAILURE;
+        }
         expression = 1;
         continue;
       } else {
@@ -216,15 +1551,196 @@ int do_parse_params(int argc, char *argv[], params_t *params) {
     if (strcmp(argv[i], "-path") == 0) {
       if (argv[++i]) {
         params->path = argv[i];
+        if (!(params->path_matcher = do_compile_pattern(params->path))) {
+          return EXIT_FAILURE;
+        }
+        expression = 1;
+        continue;
+      } else {
+        status = 2;
+        break; /* the second part is missing */
+      }
+    }
+    if (strcmp(argv[i], "-contains") == 0) {
+      if (argv[++i]) {
+        params->contains = argv[i];
+        params->guard = do_get_guard(argv[i]);
+        params->test = OP_CONTAINS;
+        expression = 1;
+        continue;
+      } else {
+        status = 2;
+        break; /* the second part is missing */
+      }
+    }
+    if (strcmp(argv[i], "-printf") == 0) {
+      if (argv[++i]) {
+        if (!(params->format = do_parse_format(argv[i]))) {
+          return EXIT_FAILURE;
+        }
+        expression = 1;
+        continue;
+      } else {
+        status = 2;
+        break; /* the second part is missing */
+      }
+    }
+    if (strcmp(argv[i], "-name-from") == 0 || strcmp(argv[i], "-path-from") == 0) {
+      if (argv[++i]) {
+        if (!(params->patterns = do_load_patterns(argv[i]))) {
+          return EXIT_FAILURE;
+        }
+        params->test = argv[i - 1][1] == 'n' ? OP_NAMES : OP_PATHS;
+        expression = 1;
+        continue;
+      } else {
+        status = 2;
+        break; /* the second part is missing */
+      }
+    }
+
+    if (strcmp(argv[i], "-newer") == 0) {
+      if (argv[++i]) {
+        struct stat attr;
+
+        if (lstat(argv[i], &attr) != 0) {
+          fprintf(stderr, "%s: lstat(%s): %s\n", program_name, argv[i], strerror(errno));
+          return EXIT_FAILURE;
+        }
+        params->test = OP_TIME;
+        params->cmp = '-'; /* modified after the reference */
+        params->time = attr.st_mtim;
+        expression = 1;
+        continue;
+      } else {
+        status = 2;
+        break; /* the second part is missing */
+      }
+    }
+
+    /* parameters expecting a number with an optional comparison or a mode */
+    if (strcmp(argv[i], "-size") == 0 || strcmp(argv[i], "-mtime") == 0 ||
+        strcmp(argv[i], "-mmin") == 0 || strcmp(argv[i], "-perm") == 0) {
+      if (argv[++i]) {
+        if (do_parse_test(params, argv[i - 1], argv[i]) == EXIT_SUCCESS) {
+          expression = 1;
+          continue;
+        } else {
+          status = 3;
+          break; /* the second part is not a number or a mode */
+        }
+      } else {
+        status = 2;
+        break; /* the second part is missing */
+      }
+    }
+
+    /* parameters expecting a command terminated by ';' or by '+' right after {} */
+    if (strcmp(argv[i], "-exec") == 0 || strcmp(argv[i], "-execdir") == 0) {
+      int start = i;
+
+      for (i++; argv[i] && strcmp(argv[i], ";") != 0; i++) {
+        if (strcmp(argv[i], "+") == 0 && strcmp(argv[i - 1], "{}") == 0) {
+          break;
+        }
+      }
+      if (argv[i] && i > start + 1) {
+        if (!(params->exec = do_new_exec(argv + start + 1, i - start - 1, argv[i][0] == '+',
+                                         argv[start][5] == 'd'))) {
+          return EXIT_FAILURE;
+        }
         expression = 1;
         continue;
+      } else {
+        i = start + 1;
+        status = 2;
+        break; /* the command or the terminator is missing */
+      }
+    }
+
+    /* parameters expecting a positive number */
+    if (strcmp(argv[i], "-threads") == 0 || strcmp(argv[i], "-exec-jobs") == 0) {
+      if (argv[++i]) {
+        unsigned int number;
+
+        if (sscanf(argv[i], "%u", &number) == 1 && number > 0) {
+          if (argv[i - 1][1] == 't') {
+            options.threads = number;
+          } else {
+            options.exec_jobs = number;
+          }
+          expression = 1;
+          continue;
+        } else {
+          status = 3;
+          break; /* the second part is not a positive number */
+        }
+      } else {
+        status = 2;
+        break; /* the second part is missing */
+      }
+    }
+
+    /* parameters expecting a non-negative number */
+    if (strcmp(argv[i], "-maxdepth") == 0 || strcmp(argv[i], "-mindepth") == 0 ||
+        strcmp(argv[i], "-du-depth") == 0) {
+      if (argv[++i]) {
+        int depth;
+        char end;
+
+        if (sscanf(argv[i], "%d%c", &depth, &end) == 1 && depth >= 0) {
+          if (argv[i - 1][1] == 'd') {
+            options.du = 1;
+            options.du_depth = depth;
+          } else if (argv[i - 1][2] == 'a') {
+            options.maxdepth = depth;
+          } else {
+            options.mindepth = depth;
+          }
+          expression = 1;
+          continue;
+        } else {
+          status = 3;
+          break; /* the second part is not a non-negative number */
+        }
+      } else {
+        status = 2;
+        break; /* the second part is missing */
+      }
+    }
+
+    /* parameters expecting a size with an optional K, M or G suffix */
+    if (strcmp(argv[i], "-dirbuf") == 0) {
+      if (argv[++i]) {
+        if (do_parse_size(argv[i], &options.dirbuf) == EXIT_SUCCESS && options.dirbuf >= 4096) {
+          expression = 1;
+          continue;
+        } else {
+          status = 3;
+          break; /* the second part is not a size or too small for a single entry */
+        }
       } else {
         status = 2;
         break; /* the second part is missing */
       }
     }
 
-    /* a parameter expecting a restricted second part */
+    /* parameters expecting a restricted second part */
+    if (strcmp(argv[i], "-flush") == 0) {
+      if (argv[++i]) {
+        if ((strcmp(argv[i], "line") == 0) || (strcmp(argv[i], "block") == 0)) {
+          options.flush = argv[i][0];
+          expression = 1;
+          continue;
+        } else {
+          status = 3;
+          break; /* the second part is unknown */
+        }
+      } else {
+        status = 2;
+        break; /* the second part is missing */
+      }
+    }
     if (strcmp(argv[i], "-type") == 0) {
       if (argv[++i]) {
         if ((strcmp(argv[i], "b") == 0) || (strcmp(argv[i], "c") == 0) ||
@@ -282,7 +1798,7 @@ int do_parse_params(int argc, char *argv[], params_t *params) {
   }
   if (status == 5) {
     fprintf(stderr, "%s: paths must precede expression: %s\n", program_name, argv[i]);
-    fprintf(stderr, "Usage: %s [ <location> ] [ <aktion> ]\n", program_name);
+    fprintf(stderr, "Usage: %s [ -H | -L | -P ] [ <location> ] [ <aktion> ]\n", program_name);
     return EXIT_FAILURE;
   }
 
@@ -290,565 +1806,8842 @@ int do_parse_params(int argc, char *argv[], params_t *params) {
 }
 
 /**
- * @brief frees the params linked list
+ * @brief parses the argument of -size, -mtime, -mmin or -perm
  *
- * @param params the parsed parameters
+ * @param params the parameter to populate
+ * @param test the name of the test
+ * @param arg the argument, e.g. +10k, -2 or /u+w
  *
- * @returns EXIT_SUCCESS
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if the argument is invalid
  */
-int do_free_params(params_t *params) {
+int do_parse_test(params_t *params, char *test, char *arg) {
+  static char units[] = "cwbkMG";
+  static long long sizes[] = {1, 2, 512, 1024, 1048576, 1073741824};
+  long long number;
+  long long days;
+  char *unit;
+  char *end;
 
-  while (params) {
-    params_t *next = params->next;
-    free(params);
-    params = next;
+  if (strcmp(test, "-perm") == 0) {
+    params->test = OP_PERM;
+    params->cmp = *arg == '-' || *arg == '/' ? *arg++ : 0;
+    return do_parse_mode(arg, &params->number);
+  }
+
+  params->cmp = *arg == '+' || *arg == '-' ? *arg++ : 0;
+
+  if (*arg < '0' || *arg > '9') {
+    return EXIT_FAILURE;
+  }
+
+  errno = 0;
+  number = strtoll(arg, &end, 10);
+  if (errno != 0 || number > LLONG_MAX / 86400 - 1) {
+    errno = 0;
+    return EXIT_FAILURE;
+  }
+
+  if (test[1] == 's') {
+    unit = *end ? strchr(units, *end) : units + 2;
+    if (!unit || (*end && end[1])) {
+      return EXIT_FAILURE;
+    }
+    params->test = OP_SIZE;
+    params->number = number;
+    params->unit = sizes[unit - units];
+    return EXIT_SUCCESS;
+  }
+
+  if (*end) {
+    return EXIT_FAILURE;
+  }
+
+  /*
+   * the windows of GNU find, with the age from the start of the run:
+   * -mtime n is (n, n+1] days, +n more than n+1 days, -n less than n days and a second;
+   * -mmin n is (n-1, n] minutes, +n more than n minutes, -n less than n minutes
+   */
+  params->test = OP_TIME;
+  params->time = options.start;
+  if (test[2] == 't') {
+    days = params->cmp == '-' ? number : number + 1;
+    params->number = 86400;
+    params->time.tv_sec -= (time_t)(days * 86400 + (params->cmp == '-'));
+  } else {
+    params->number = 60;
+    params->time.tv_sec -= (time_t)(number * 60);
   }
 
   return EXIT_SUCCESS;
 }
 
 /**
- * @brief calls do_file and do_directory on locations from the params struct
+ * @brief parses the mode of -perm, octal or symbolic like u+w,g=rx applied to 0
  *
- * @param params the parsed parameters
+ * @param arg the mode
+ * @param mode the parsed permission bits
  *
- * @returns EXIT_SUCCESS, EXIT_FAILURE
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if the mode is invalid
  */
-int do_location(params_t *params) {
-  struct stat attr;
-  char *location;
+int do_parse_mode(char *arg, long long *mode) {
+  unsigned long result = 0;
+  char *end;
 
-  do {
-    location = params->location;
+  if (*arg >= '0' && *arg <= '7') {
+    result = strtoul(arg, &end, 8);
+    *mode = (long long)result;
+    return *end || result > 07777 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
 
-    if (!location) {
-      location = ".";
+  while (*arg) {
+    unsigned long who = 0;
+
+    for (; *arg && strchr("ugoa", *arg); arg++) {
+      who |= *arg == 'u' ? 04700 : *arg == 'g' ? 02070 : *arg == 'o' ? 01007 : 07777;
+    }
+    if (!who) {
+      who = 07777;
     }
 
-    /*
-     * try reading the attributes of the location
-     * to verify that it exists and to check if it is a directory
-     */
-    if (lstat(location, &attr) == 0) {
-      do_file(location, params, attr);
+    if (!*arg || !strchr("+-=", *arg)) {
+      return EXIT_FAILURE;
+    }
 
-      /* if a directory, process its contents */
-      if (S_ISDIR(attr.st_mode)) {
-        do_dir(location, params, attr);
+    while (*arg && strchr("+-=", *arg)) {
+      char op = *arg++;
+      unsigned long bits = 0;
+
+      for (; *arg && strchr("rwxst", *arg); arg++) {
+        bits |= *arg == 'r' ? 0444 : *arg == 'w' ? 0222 : *arg == 'x' ? 0111
+                                     : *arg == 's' ? 06000 : 01000;
       }
-    } else {
-      fprintf(stderr, "%s: lstat(%s): %s\n", program_name, location, strerror(errno));
+      bits &= who;
+
+      if (op == '+') {
+        result |= bits;
+      } else if (op == '-') {
+        result &= ~bits;
+      } else {
+        result = (result & ~who) | bits;
+      }
+    }
+
+    if (*arg == ',' && arg[1]) {
+      arg++;
+    } else if (*arg) {
       return EXIT_FAILURE;
     }
+  }
+
+  *mode = (long long)result;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief parses a size like 65536, 64K or 1M
+ *
+ * @param arg the string to parse
+ * @param size the parsed size in bytes
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_parse_size(char *arg, size_t *size) {
+  unsigned long long number;
+  int shift = 0;
+  int error = errno;
+  char *end;
+
+  /* only digits and at most one suffix, strtoull alone would accept spaces and signs */
+  if (arg[0] < '0' || arg[0] > '9') {
+    return EXIT_FAILURE;
+  }
+
+  errno = 0;
+  number = strtoull(arg, &end, 10);
+  if (errno != 0) {
+    errno = error;
+    return EXIT_FAILURE; /* out of range */
+  }
+  errno = error;
+
+  if (*end != '\0' && end[1] != '\0') {
+    return EXIT_FAILURE; /* nothing may follow the suffix */
+  }
+
+  if (*end == 'k' || *end == 'K') {
+    shift = 10;
+  } else if (*end == 'M') {
+    shift = 20;
+  } else if (*end == 'G') {
+    shift = 30;
+  } else if (*end != '\0') {
+    return EXIT_FAILURE;
+  }
+
+  if (number > (SIZE_MAX >> shift)) {
+    return EXIT_FAILURE;
+  }
+
+  *size = (size_t)number << shift;
+
+  return EXIT_SUCCESS;
+}
+
+
+/**
+ * @brief compiles the expression after the locations into a program;
+ * the operators are parsed like in GNU find, tests without side effects
+ * are reordered by cost and a -print is added if there is no action
+ *
+ * @param params the parsed parameters
+ *
+ * @returns the program, NULL on errors
+ */
+program_t *do_compile_program(params_t *params) {
+  program_t *program;
+  node_t *root;
+  node_t *print = NULL;
+  params_t *cursor;
+  int capacity = 1; /* the added -print */
+  int i;
+
+  /* the expression starts after the locations, the last node is always empty */
+  while (params->next && params->location) {
+    params = params->next;
+  }
+
+  for (cursor = params; cursor->next; cursor = cursor->next) {
+    capacity++;
+  }
+
+  cursor = params;
+
+  if (!cursor->next) {
+    root = do_new_node(OP_TRUE, NULL);
+  } else if ((root = do_parse_or(&cursor)) && cursor->next) {
+    fprintf(stderr, "%s: you have too many ')'\n", program_name);
+    do_free_node(root);
+    return NULL;
+  }
+
+  if (!root) {
+    return NULL;
+  }
+
+  do_order_node(root);
+
+  /* without an action, the entries which pass the expression are printed, unless indexed */
+  if (!root->action && !options.build_index) {
+    node_t *expression = do_new_node(OP_AND, NULL);
+
+    if (!expression || !(print = do_new_node(OP_PRINT, NULL)) ||
+        do_add_child(expression, root) != EXIT_SUCCESS) {
+      do_free_node(expression);
+      do_free_node(print);
+      do_free_node(root);
+      return NULL;
+    }
+
+    root = expression;
+
+    if (do_add_child(root, print) != EXIT_SUCCESS) {
+      do_free_node(print);
+      do_free_node(root);
+      return NULL;
+    }
+  }
+
+  if (!(program = calloc(1, sizeof(*program))) ||
+      !(program->code = calloc((size_t)capacity, sizeof(*program->code)))) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+    do_free_program(program);
+    do_free_node(root);
+    return NULL;
+  }
+
+  /* the code is emitted from the end, reverse it so it runs forward */
+  program->start = do_emit_node(program, root, PROGRAM_END, PROGRAM_END);
+  do_free_node(root);
+
+  for (i = 0; i < program->count / 2; i++) {
+    insn_t insn = program->code[i];
+
+    program->code[i] = program->code[program->count - 1 - i];
+    program->code[program->count - 1 - i] = insn;
+  }
+
+  for (i = 0; i < program->count; i++) {
+    insn_t *insn = &program->code[i];
+
+    if (insn->on_true != PROGRAM_END) {
+      insn->on_true = program->count - 1 - insn->on_true;
+    }
+    if (insn->on_false != PROGRAM_END) {
+      insn->on_false = program->count - 1 - insn->on_false;
+    }
+    program->needs |= insn->needs;
+
+#ifdef STATX_BASIC_STATS
+    /* statx only asks for the fields a test reads, the type and mode are always needed */
+    options.statx_mask |= STATX_TYPE | STATX_MODE;
+    switch (insn->op) {
+    case OP_USER:
+    case OP_NOUSER:
+      options.statx_mask |= STATX_UID;
+      break;
+    case OP_SIZE:
+    case OP_CONTAINS:
+      options.statx_mask |= STATX_SIZE;
+      break;
+    case OP_DUPES:
+      options.statx_mask |= STATX_SIZE | STATX_INO;
+      break;
+    case OP_TIME:
+      options.statx_mask |= STATX_MTIME;
+      break;
+    case OP_LS:
+      options.statx_mask |= STATX_BASIC_STATS;
+      break;
+    case OP_PRINTF:
+      options.statx_mask |= insn->format->mask;
+      break;
+    }
+#endif
+  }
+
+  if (program->start != PROGRAM_END) {
+    program->start = program->count - 1 - program->start;
+
+    /* every entry needs its attributes, read them upfront (and in batches with -uring) */
+    if (program->code[program->start].needs & (NEED_STAT | NEED_OWNER)) {
+      options.stat_needed = 1;
+    }
+  }
+
+  return program;
+}
+
+/**
+ * @brief parses operands separated by -o
+ *
+ * @param cursor the current parameter, moved behind the operands
+ *
+ * @returns the node, NULL on errors
+ */
+node_t *do_parse_or(params_t **cursor) {
+  node_t *node;
+  node_t *child;
+
+  if (!(child = do_parse_and(cursor))) {
+    return NULL;
+  }
+
+  if (!(*cursor)->next || (*cursor)->op != 'o') {
+    return child;
+  }
+
+  if (!(node = do_new_node(OP_OR, NULL)) || do_add_child(node, child) != EXIT_SUCCESS) {
+    do_free_node(node);
+    do_free_node(child);
+    return NULL;
+  }
+
+  while ((*cursor)->next && (*cursor)->op == 'o') {
+    *cursor = (*cursor)->next;
+
+    if (do_check_operand(*cursor, "-o") != EXIT_SUCCESS) {
+      do_free_node(node);
+      return NULL;
+    }
+
+    if (!(child = do_parse_and(cursor)) || do_add_child(node, child) != EXIT_SUCCESS) {
+      do_free_node(child);
+      do_free_node(node);
+      return NULL;
+    }
+  }
+
+  return node;
+}
+
+/**
+ * @brief parses operands separated by -a or nothing
+ *
+ * @param cursor the current parameter, moved behind the operands
+ *
+ * @returns the node, NULL on errors
+ */
+node_t *do_parse_and(params_t **cursor) {
+  node_t *node;
+  node_t *child;
+
+  if ((*cursor)->op == 'o' || (*cursor)->op == 'a') {
+    fprintf(stderr,
+            "%s: invalid expression; you have used a binary operator '-%c' with nothing before it.\n",
+            program_name, (*cursor)->op);
+    return NULL;
+  }
+
+  if (!(child = do_parse_unary(cursor))) {
+    return NULL;
+  }
+
+  if (!(*cursor)->next || (*cursor)->op == 'o' || (*cursor)->op == ')') {
+    return child;
+  }
+
+  if (!(node = do_new_node(OP_AND, NULL)) || do_add_child(node, child) != EXIT_SUCCESS) {
+    do_free_node(node);
+    do_free_node(child);
+    return NULL;
+  }
+
+  while ((*cursor)->next && (*cursor)->op != 'o' && (*cursor)->op != ')') {
+    if ((*cursor)->op == 'a') {
+      *cursor = (*cursor)->next;
+
+      if (do_check_operand(*cursor, "-a") != EXIT_SUCCESS) {
+        do_free_node(node);
+        return NULL;
+      }
+    }
+
+    if (!(child = do_parse_unary(cursor)) || do_add_child(node, child) != EXIT_SUCCESS) {
+      do_free_node(child);
+      do_free_node(node);
+      return NULL;
+    }
+  }
+
+  return node;
+}
+
+/**
+ * @brief parses a negation, a parenthesized expression or a single test or action
+ *
+ * @param cursor the current parameter, moved behind the operand
+ *
+ * @returns the node, NULL on errors
+ */
+node_t *do_parse_unary(params_t **cursor) {
+  params_t *param = *cursor;
+  node_t *node;
+  node_t *child;
+
+  if (param->op == '!') {
+    *cursor = param->next;
+
+    if (do_check_operand(*cursor, "!") != EXIT_SUCCESS) {
+      return NULL;
+    }
+
+    if (!(child = do_parse_unary(cursor))) {
+      return NULL;
+    }
+
+    if (!(node = do_new_node(OP_NOT, NULL)) || do_add_child(node, child) != EXIT_SUCCESS) {
+      do_free_node(node);
+      do_free_node(child);
+      return NULL;
+    }
+
+    return node;
+  }
+
+  if (param->op == '(') {
+    *cursor = param->next;
+
+    if ((*cursor)->op == ')') {
+      fprintf(stderr, "%s: invalid expression; empty parentheses are not allowed.\n",
+              program_name);
+      return NULL;
+    }
+
+    if (!(*cursor)->next) {
+      fprintf(stderr,
+              "%s: invalid expression; expected to find a ')' but didn't see one. "
+              "Perhaps you need an extra predicate after '('\n",
+              program_name);
+      return NULL;
+    }
+
+    if (!(node = do_parse_or(cursor))) {
+      return NULL;
+    }
+
+    if ((*cursor)->op != ')') {
+      fprintf(stderr,
+              "%s: invalid expression; I was expecting to find a ')' somewhere but did not see one.\n",
+              program_name);
+      do_free_node(node);
+      return NULL;
+    }
+
+    *cursor = (*cursor)->next;
+
+    return node;
+  }
+
+  *cursor = param->next;
+
+  if (param->type) {
+    return do_new_node(OP_TYPE, param);
+  }
+  if (param->name) {
+    return do_new_node(OP_NAME, param);
+  }
+  if (param->path) {
+    return do_new_node(OP_PATH, param);
+  }
+  if (param->user) {
+    return do_new_node(OP_USER, param);
+  }
+  if (param->nouser) {
+    return do_new_node(OP_NOUSER, param);
+  }
+  if (param->print) {
+    return do_new_node(OP_PRINT, param);
+  }
+  if (param->print0) {
+    return do_new_node(OP_PRINT0, param);
+  }
+  if (param->ls) {
+    return do_new_node(OP_LS, param);
+  }
+  if (param->format) {
+    return do_new_node(OP_PRINTF, param);
+  }
+  if (param->dupes) {
+    return do_new_node(OP_DUPES, param);
+  }
+  if (param->prune) {
+    return do_new_node(OP_PRUNE, param);
+  }
+  if (param->exec) {
+    return do_new_node(OP_EXEC, param);
+  }
+  if (param->test) {
+    return do_new_node(param->test, param);
+  }
+
+  /* options like -threads are always true, like in GNU find */
+  return do_new_node(OP_TRUE, param);
+}
+
+/**
+ * @brief checks that an operand follows an operator
+ *
+ * @param param the parameter after the operator
+ * @param after the operator, for the error message
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_check_operand(params_t *param, char *after) {
+
+  if (!param->next) {
+    fprintf(stderr, "%s: expected an expression after '%s'\n", program_name, after);
+    return EXIT_FAILURE;
+  }
+  if (param->op == 'o' || param->op == 'a') {
+    fprintf(stderr,
+            "%s: invalid expression; you have used a binary operator '-%c' with nothing before it.\n",
+            program_name, param->op);
+    return EXIT_FAILURE;
+  }
+  if (param->op == ')') {
+    fprintf(stderr, "%s: expected an expression between '%s' and ')'\n", program_name, after);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief allocates a node of the expression tree
+ *
+ * @param op the OP_* code
+ * @param param the parameter of a test or action, NULL for operators
+ *
+ * @returns the node, NULL on errors
+ */
+node_t *do_new_node(int op, params_t *param) {
+  node_t *node = calloc(1, sizeof(*node));
+
+  if (!node) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+    return NULL;
+  }
+
+  node->op = op;
+  node->param = param;
+
+  return node;
+}
+
+/**
+ * @brief appends an operand to an operator node
+ *
+ * @param node the operator node
+ * @param child the operand, owned by the node on success
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_add_child(node_t *node, node_t *child) {
+  node_t **children = realloc(node->children, sizeof(*children) * (node->count + 1));
+
+  if (!children) {
+    fprintf(stderr, "%s: realloc(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  node->children = children;
+  node->children[node->count++] = child;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief estimates the cost and the rate of a node and sorts the operands of -a and -o;
+ * only neighbouring operands without actions are swapped, the actions keep their order
+ *
+ * the estimates follow the order of the entry data: d_type checks are the cheapest,
+ * then name matching, then tests reading the attributes, then user lookups
+ *
+ * @param node the node
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_order_node(node_t *node) {
+  double rate = 1;
+  size_t i;
+  size_t j;
+
+  node->pure = 1;
+
+  switch (node->op) {
+  case OP_TRUE:
+    node->cost = 0;
+    node->rate = 1;
+    return EXIT_SUCCESS;
+  case OP_TYPE:
+    node->cost = 1;
+    node->rate = node->param->type == 'f' ? 0.8 : node->param->type == 'd' ? 0.15 : 0.02;
+    return EXIT_SUCCESS;
+  case OP_NAME:
+  case OP_PATH:
+    node->cost = node->param->name ? 2 : 3;
+    if (node->op == OP_NAME && node->param->name_matcher->kind == MATCH_FNMATCH) {
+      node->cost = 8;
+    }
+    if (node->op == OP_PATH && node->param->path_matcher->kind == MATCH_FNMATCH) {
+      node->cost = 8;
+    }
+    node->rate = 0.1;
+    return EXIT_SUCCESS;
+  case OP_NAMES:
+  case OP_PATHS:
+    /* one pass over the name, the patterns left to fnmatch are checked one by one */
+    node->cost = (node->op == OP_NAMES ? 4 : 6) + 8 * (double)node->param->patterns->other_count;
+    node->rate = 0.1;
+    return EXIT_SUCCESS;
+  case OP_USER:
+    node->cost = 20;
+    node->rate = 0.5;
+    return EXIT_SUCCESS;
+  case OP_NOUSER:
+    node->cost = 30;
+    node->rate = 0.01;
+    return EXIT_SUCCESS;
+  case OP_SIZE:
+  case OP_TIME:
+  case OP_PERM:
+    node->cost = 20;
+    node->rate = 0.3;
+    return EXIT_SUCCESS;
+  case OP_CONTAINS:
+    /* reads the whole file unless the string is found, so it comes after all other tests */
+    node->cost = 5000;
+    node->rate = 0.05;
+    return EXIT_SUCCESS;
+  case OP_PRINT:
+  case OP_PRINT0:
+  case OP_LS:
+  case OP_PRINTF:
+  case OP_DUPES:
+    node->pure = 0;
+    node->action = 1;
+    node->cost = 50;
+    node->rate = 1;
+    return EXIT_SUCCESS;
+  case OP_PRUNE:
+    node->pure = 0;
+    node->cost = 0;
+    node->rate = 1;
+    return EXIT_SUCCESS;
+  case OP_EXEC:
+    /* a process per entry, with '+' it is collected and always true */
+    node->pure = 0;
+    node->action = 1;
+    node->cost = node->param->exec->multiple ? 50 : 1000;
+    node->rate = node->param->exec->multiple ? 1 : 0.5;
+    return EXIT_SUCCESS;
+  case OP_NOT:
+    do_order_node(node->children[0]);
+    node->pure = node->children[0]->pure;
+    node->action = node->children[0]->action;
+    node->cost = node->children[0]->cost;
+    node->rate = 1 - node->children[0]->rate;
+    return EXIT_SUCCESS;
+  }
+
+  for (i = 0; i < node->count; i++) {
+    do_order_node(node->children[i]);
+  }
+
+  /* a stable insertion sort by rank, which stops at every operand with an action */
+  for (i = 1; i < node->count; i++) {
+    node_t *child = node->children[i];
+
+    if (!child->pure) {
+      continue;
+    }
+
+    for (j = i; j > 0 && node->children[j - 1]->pure &&
+                do_rank_node(node->children[j - 1], node->op) > do_rank_node(child, node->op);
+         j--) {
+      node->children[j] = node->children[j - 1];
+    }
+
+    node->children[j] = child;
+  }
+
+  /* an operand is only evaluated if the previous ones didn't decide the result */
+  node->cost = 0;
+
+  for (i = 0; i < node->count; i++) {
+    node_t *child = node->children[i];
+
+    node->cost += rate * child->cost;
+    node->pure &= child->pure;
+    node->action |= child->action;
+    rate *= node->op == OP_AND ? child->rate : 1 - child->rate;
+  }
+
+  node->rate = node->op == OP_AND ? rate : 1 - rate;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief ranks an operand of -a or -o; cheap operands which often decide
+ * the result come first, for -a those which fail, for -o those which pass
+ *
+ * @param node the operand
+ * @param op OP_AND or OP_OR
+ *
+ * @returns the rank, lower is earlier
+ */
+double do_rank_node(node_t *node, int op) {
+  double decides = op == OP_AND ? 1 - node->rate : node->rate;
+
+  if (decides <= 0) {
+    return 1e30 + node->cost;
+  }
+
+  return node->cost / decides;
+}
+
+/**
+ * @brief emits the instructions of a node; operators emit no code,
+ * they only connect the instructions of their operands
+ *
+ * the code is emitted backwards, an operand is emitted after the operands
+ * it continues with, so the targets are always known
+ *
+ * @param program the program, with enough room for all tests and actions
+ * @param node the node
+ * @param on_true the instruction to continue with if the node is true
+ * @param on_false the instruction to continue with if the node is false
+ *
+ * @returns the first instruction of the node
+ */
+int do_emit_node(program_t *program, node_t *node, int on_true, int on_false) {
+  insn_t *insn;
+  int next;
+  size_t i;
+
+  switch (node->op) {
+  case OP_TRUE:
+    return on_true;
+  case OP_NOT:
+    return do_emit_node(program, node->children[0], on_false, on_true);
+  case OP_AND:
+    for (i = node->count, next = on_true; i > 0; i--) {
+      next = do_emit_node(program, node->children[i - 1], next, on_false);
+    }
+    return next;
+  case OP_OR:
+    for (i = node->count, next = on_false; i > 0; i--) {
+      next = do_emit_node(program, node->children[i - 1], on_true, next);
+    }
+    return next;
+  }
+
+  insn = &program->code[program->count];
+  insn->op = node->op;
+  insn->on_true = on_true;
+  insn->on_false = on_false;
+
+  switch (node->op) {
+  case OP_TYPE:
+    insn->type = node->param->type;
+    insn->needs = NEED_TYPE;
+    break;
+  case OP_NAME:
+    insn->matcher = node->param->name_matcher;
+    insn->needs = NEED_NAME;
+    break;
+  case OP_PATH:
+    insn->matcher = node->param->path_matcher;
+    insn->needs = NEED_NAME;
+    break;
+  case OP_NAMES:
+  case OP_PATHS:
+    insn->patterns = node->param->patterns;
+    insn->needs = NEED_NAME;
+    break;
+  case OP_USER:
+    insn->userid = node->param->userid;
+    insn->needs = NEED_STAT;
+    break;
+  case OP_SIZE:
+  case OP_TIME:
+  case OP_PERM:
+    insn->cmp = node->param->cmp;
+    insn->number = node->param->number;
+    insn->unit = node->param->unit;
+    insn->time = node->param->time;
+    insn->needs = NEED_STAT;
+    break;
+  case OP_DUPES:
+    insn->needs = NEED_STAT;
+    break;
+  case OP_CONTAINS:
+    insn->text = node->param->contains;
+    insn->length = strlen(node->param->contains);
+    insn->guard = node->param->guard;
+    insn->needs = NEED_STAT;
+    break;
+  case OP_NOUSER:
+  case OP_LS:
+    insn->needs = NEED_STAT | NEED_OWNER;
+    break;
+  case OP_PRINTF:
+    insn->format = node->param->format;
+    insn->needs = node->param->format->needs;
+    break;
+  case OP_PRUNE:
+    insn->needs = 0;
+    break;
+  case OP_EXEC:
+    insn->exec = node->param->exec;
+    insn->needs = NEED_NAME;
+    break;
+  default:
+    insn->needs = NEED_NAME;
+  }
+
+  return program->count++;
+}
+
+/**
+ * @brief frees a node of the expression tree and its operands
+ *
+ * @param node the node, may be NULL
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_free_node(node_t *node) {
+  size_t i;
+
+  if (node) {
+    for (i = 0; i < node->count; i++) {
+      do_free_node(node->children[i]);
+    }
+    free(node->children);
+    free(node);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief frees a compiled program; the patterns belong to the parameters
+ *
+ * @param program the program, may be NULL
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_free_program(program_t *program) {
+
+  if (program) {
+    free(program->code);
+    free(program);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief frees the params linked list
+ *
+ * @param params the parsed parameters
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_free_params(params_t *params) {
+
+  while (params) {
+    params_t *next = params->next;
+    do_free_matcher(params->name_matcher);
+    do_free_matcher(params->path_matcher);
+    do_free_patterns(params->patterns);
+    do_free_exec(params->exec);
+    do_free_format(params->format);
+    free(params);
+    params = next;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief calls do_file and do_directory on locations from the params struct
+ *
+ * @param params the parsed parameters
+ * @param program the compiled expression
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_location(params_t *params, program_t *program) {
+  entry_t entry;
+  char *location;
+  worker_t worker;
+  indexer_t indexer;
+  snapshot_t snapshot;
+  watcher_t watcher;
+  int found;
+  int error;
+  int status = EXIT_SUCCESS;
+
+  memset(&worker, 0, sizeof(worker));
+  memset(&indexer, 0, sizeof(indexer));
+
+  if (options.watch) {
+    if (do_watch_open(&watcher, params, program) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+    worker.watcher = &watcher;
+  }
+
+  if (options.build_index) {
+    worker.indexer = &indexer;
+  }
+
+  /* without a previous index, -update-index builds a new one */
+  if (options.update) {
+    if (access(options.build_index, F_OK) == 0) {
+      if (do_snapshot_open(&snapshot, options.build_index) != EXIT_SUCCESS) {
+        if (worker.watcher) {
+          do_watch_close(&watcher);
+        }
+        return EXIT_FAILURE;
+      }
+      worker.snapshot = &snapshot;
+    }
+    errno = 0; /* ENOENT is not an error */
+  }
+
+  do {
+    location = params->location;
+
+    if (!location) {
+      location = ".";
+    }
+
+    /*
+     * try reading the attributes of the location
+     * to verify that it exists and to check if it is a directory;
+     * with -H or -L through a symlink, a dangling one is checked as the symlink itself
+     */
+    error = errno;
+    found = options.follow && stat(location, &entry.attr) == 0;
+    if (!found && (!options.follow || errno == ENOENT)) {
+      errno = error;
+      found = lstat(location, &entry.attr) == 0;
+    }
+
+    if (found) {
+      entry.path = location;
+      entry.parent = AT_FDCWD;
+      entry.name = location;
+      entry.root = strlen(location);
+      entry.type = IFTODT(entry.attr.st_mode);
+      entry.has_attr = 1;
+      entry.attr_failed = 0;
+      entry.pruned = 0;
+      entry.depth = 0;
+      entry.index = NULL;
+
+      worker.depth = 0;
+      worker.device = entry.attr.st_dev;
+      worker.root = entry.root;
+
+      if (!(entry.base = do_get_basename(location))) {
+        status = EXIT_FAILURE;
+      } else if (options.mindepth == 0) {
+        do_file(&entry, program);
+      }
+      free(entry.base);
+
+      if (worker.indexer && do_index_record(worker.indexer, &entry, 0) != EXIT_SUCCESS) {
+        status = EXIT_FAILURE;
+      }
+
+      if (options.du && do_du_add(&worker, &entry) != EXIT_SUCCESS) {
+        status = EXIT_FAILURE;
+      }
+
+      /* if a directory, process its contents */
+      if (do_descend(&worker, &entry) == EXIT_SUCCESS) {
+        if (options.threads > 1) {
+          if (do_pool(location, worker.device, program) != EXIT_SUCCESS) {
+            status = EXIT_FAILURE;
+          }
+        } else if (do_pathbuf_append(&worker.path, 0, location) != EXIT_SUCCESS) {
+          status = EXIT_FAILURE;
+        } else if (worker.indexer) {
+          do_index_dir(&worker, &entry, program);
+        } else {
+          do_dir(&worker, AT_FDCWD, location, program);
+        }
+      }
+
+      /* a location which wasn't read is printed with its own usage, like by du */
+      if (options.du && do_du_settle(&worker, location) != EXIT_SUCCESS) {
+        status = EXIT_FAILURE;
+      }
+    } else {
+      fprintf(stderr, "%s: %s(%s): %s\n", program_name, options.follow ? "stat" : "lstat",
+              location, strerror(errno));
+      do_free_worker(&worker);
+      do_free_indexer(&indexer);
+      if (worker.snapshot) {
+        do_snapshot_close(&snapshot);
+      }
+      if (worker.watcher) {
+        do_watch_close(&watcher);
+      }
+      do_free_output();
+      return EXIT_FAILURE;
+    }
+
+    params = params->next;
+  } while (params && params->location && !output_failed);
+
+  /* an index is written even if single entries failed, like the output */
+  if (worker.indexer && do_index_write(&indexer, options.build_index) != EXIT_SUCCESS) {
+    status = EXIT_FAILURE;
+  }
+  do_free_indexer(&indexer);
+  if (worker.snapshot) {
+    do_snapshot_close(&snapshot);
+  }
+  worker.indexer = NULL;
+  worker.snapshot = NULL;
+
+  /* the traversal is complete, the events are checked with the same worker */
+  if (worker.watcher) {
+    options.du = 0; /* the usage is the one of the traversal */
+    if (!output_failed && do_watch(&worker, program) != EXIT_SUCCESS) {
+      status = EXIT_FAILURE;
+    }
+    do_watch_close(&watcher);
+  }
+
+  do_free_worker(&worker);
+
+  if (do_free_output() != EXIT_SUCCESS || output_failed) {
+    status = EXIT_FAILURE;
+  }
+
+  /* GNU find returns 1 even if a single entry failed */
+  if (errno != 0 || status != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief runs the compiled expression on the entry
+ *
+ * @param entry the entry to be processed, its attributes are read on demand
+ * @param program the compiled expression
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_file(entry_t *entry, program_t *program) {
+  struct stat *attr;
+  char *target;
+  insn_t *insn;
+  int result = 0;
+  int pc;
+
+  STATS_COUNT(entries);
+
+  /* read the attributes upfront if the first test needs them anyway, same as an lstat before */
+  if (options.stat_needed && !do_get_attr(entry)) {
+    return EXIT_FAILURE;
+  }
+
+  for (pc = program->start; pc != PROGRAM_END; pc = result ? insn->on_true : insn->on_false) {
+    insn = &program->code[pc];
+
+    switch (insn->op) {
+    /* filtering; a test needing the attributes fails if they can't be read */
+    case OP_TYPE:
+      result = do_type(insn->type, entry) == EXIT_SUCCESS;
+      break;
+    case OP_NAME:
+      result = do_name(entry->base, insn->matcher) == EXIT_SUCCESS;
+      break;
+    case OP_PATH:
+      result = do_path(entry->path, insn->matcher) == EXIT_SUCCESS;
+      break;
+    case OP_NAMES:
+      result = do_names(entry->base, insn->patterns) == EXIT_SUCCESS;
+      break;
+    case OP_PATHS:
+      result = do_paths(entry->path, insn->patterns) == EXIT_SUCCESS;
+      break;
+    case OP_USER:
+      result = (attr = do_get_attr(entry)) && do_user(insn->userid, *attr) == EXIT_SUCCESS;
+      break;
+    case OP_NOUSER:
+      result = (attr = do_get_attr(entry)) && do_nouser(*attr) == EXIT_SUCCESS;
+      break;
+    case OP_SIZE:
+      result = (attr = do_get_attr(entry)) && do_size(insn, *attr) == EXIT_SUCCESS;
+      break;
+    case OP_TIME:
+      result = (attr = do_get_attr(entry)) && do_time(insn, *attr) == EXIT_SUCCESS;
+      break;
+    case OP_PERM:
+      result = (attr = do_get_attr(entry)) && do_perm(insn, *attr) == EXIT_SUCCESS;
+      break;
+    case OP_CONTAINS:
+      result = do_contains(insn, entry) == EXIT_SUCCESS;
+      break;
+    /* printing; the actions are always true */
+    case OP_PRINT:
+      if (do_print(entry->path) != EXIT_SUCCESS) {
+        return EXIT_FAILURE; /* a fatal error occurred */
+      }
+      result = 1;
+      break;
+    case OP_PRINT0:
+      if (do_print0(entry->path) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+      }
+      result = 1;
+      break;
+    case OP_LS:
+      if (!(attr = do_get_attr(entry))) {
+        result = 0;
+        break;
+      }
+      target = entry->index ? do_index_target(entry->index, entry->record) : NULL;
+      STATS_BEGIN(PHASE_LS);
+      result = do_ls(entry->path, *attr, target) == EXIT_SUCCESS;
+      STATS_END(PHASE_LS);
+      if (!result) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case OP_PRINTF:
+      if ((insn->needs & (NEED_STAT | NEED_OWNER)) && !do_get_attr(entry)) {
+        result = 0;
+        break;
+      }
+      {
+        /* a block of its own, -ls declares the timer of the same phase */
+        STATS_BEGIN(PHASE_LS);
+        result = do_printf(insn->format, entry) == EXIT_SUCCESS;
+        STATS_END(PHASE_LS);
+      }
+      if (!result) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case OP_DUPES:
+      if (!(attr = do_get_attr(entry))) {
+        result = 0;
+        break;
+      }
+      if (do_dupes_add(entry, *attr) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+      }
+      result = 1;
+      break;
+    /* commands; a failed -exec ... ; is false, -exec ... + is always true */
+    case OP_EXEC:
+      result = do_exec(insn->exec, entry) == EXIT_SUCCESS;
+      break;
+    /* traversal */
+    case OP_PRUNE:
+      entry->pruned = 1;
+      result = 1;
+      break;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief returns the entry attributes, calling fstatat on the first use
+ *
+ * @param entry the entry
+ *
+ * @returns the attributes or NULL if fstatat failed
+ */
+struct stat *do_get_attr(entry_t *entry) {
+
+  if (entry->attr_failed) {
+    return NULL; /* already reported */
+  }
+
+  if (!entry->has_attr && entry->index) {
+    do_index_attr(entry->index, entry->record, &entry->attr);
+    entry->has_attr = 1;
+  }
+
+  if (!entry->has_attr) {
+#ifdef HAVE_STATX
+    /* only the fields of the expression, so network filesystems don't revalidate the rest */
+    struct statx stx;
+    char *call = "statx";
+
+    int flags = options.fast_stat ? AT_STATX_DONT_SYNC : 0;
+    int error = errno;
+
+    /* with -L through the symlinks, a dangling one is checked as the symlink itself */
+    STATS_BEGIN(PHASE_STAT);
+    int failed = statx(entry->parent, entry->name,
+                       flags | (options.follow == 'L' ? 0 : AT_SYMLINK_NOFOLLOW),
+                       options.statx_mask, &stx) != 0;
+    if (failed && options.follow == 'L' && errno == ENOENT) {
+      errno = error;
+      failed = statx(entry->parent, entry->name, flags | AT_SYMLINK_NOFOLLOW,
+                     options.statx_mask, &stx) != 0;
+    }
+    STATS_END(PHASE_STAT);
+
+    if (!failed) {
+      do_convert_statx(&stx, &entry->attr);
+    }
+#else
+    char *call = "fstatat";
+
+    int error = errno;
+
+    /* with -L through the symlinks, a dangling one is checked as the symlink itself */
+    STATS_BEGIN(PHASE_STAT);
+    int failed = fstatat(entry->parent, entry->name, &entry->attr,
+                         options.follow == 'L' ? 0 : AT_SYMLINK_NOFOLLOW) != 0;
+    if (failed && options.follow == 'L' && errno == ENOENT) {
+      errno = error;
+      failed = fstatat(entry->parent, entry->name, &entry->attr, AT_SYMLINK_NOFOLLOW) != 0;
+    }
+    STATS_END(PHASE_STAT);
+#endif
+
+    if (failed) {
+      fprintf(stderr, "%s: %s(%s): %s\n", program_name, call, entry->path,
+              strerror(errno));
+      STATS_COUNT(errors);
+      entry->attr_failed = 1;
+      return NULL;
+    }
+    entry->type = IFTODT(entry->attr.st_mode);
+    entry->has_attr = 1;
+  }
+
+  return &entry->attr;
+}
+
+/**
+ * @brief calls do_file on each directory entry recursively;
+ * subdirectories are handed over to the worker's deque if running in a pool
+ *
+ * the directory is opened relative to its parent and the entries are checked
+ * relative to the directory, so the kernel doesn't resolve the full path every time
+ *
+ * @param worker the traversal state, its path is the path of the directory
+ * @param parent the descriptor of the parent directory or AT_FDCWD
+ * @param name the directory name relative to parent
+ * @param program the compiled expression
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_dir(worker_t *worker, int parent, char *name, program_t *program) {
+
+  if (do_frame_open(worker, parent, name) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  return do_walk(worker, program);
+}
+
+/**
+ * @brief runs do_entry on the entries of the top frame until the stack is empty;
+ * a subdirectory is a new frame on top, so neither the C stack nor the open descriptors
+ * grow with the depth of the tree
+ *
+ * @param worker the traversal state with at least one frame
+ * @param program the compiled expression
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_walk(worker_t *worker, program_t *program) {
+  entry_t entry;
+  int status = EXIT_SUCCESS;
+
+  /* called from do_entry within the loop, which continues with the new frame */
+  if (worker->walking) {
+    return EXIT_SUCCESS;
+  }
+
+  worker->walking = 1;
+
+  while (worker->frame_count > 0) {
+    frame_t *frame = &worker->frames[worker->frame_count - 1];
+
+    /* do_entry may grow the stack, the frame is not used after it */
+    if (output_failed || do_frame_next(worker, frame, &entry) != EXIT_SUCCESS ||
+        do_entry(worker, &entry, frame->length, program) != EXIT_SUCCESS) {
+      if (do_frame_close(worker) != EXIT_SUCCESS) {
+        status = EXIT_FAILURE;
+      }
+    }
+  }
+
+  worker->walking = 0;
+
+  return status;
+}
+
+/**
+ * @brief opens a directory and adds it as a frame on top of the stack
+ *
+ * @param worker the traversal state, its path is the path of the directory
+ * @param parent the descriptor of the parent directory or AT_FDCWD
+ * @param name the directory name relative to parent
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_frame_open(worker_t *worker, int parent, char *name) {
+  dirreader_t reader;
+  frame_t *frame;
+
+  if (do_reader_open(&reader, worker, parent, name) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  /* registered before reading, so no entry created in between is missed */
+  if (worker->watcher) {
+    do_watch_dir(worker, reader.fd);
+  }
+
+  if (!(frame = do_frame_push(worker, &reader))) {
+    do_reader_close(&reader, worker);
+    return EXIT_FAILURE;
+  }
+
+  /* the batches stat the symlinks themselves, -L needs their targets */
+  frame->kind = options.uring && options.stat_needed && options.follow != 'L' &&
+                        do_get_uring(worker)
+                    ? FRAME_BATCH
+                    : FRAME_READ;
+  STATS_COUNT(dirs_read);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief adds a frame for an opened directory on top of the stack and suspends
+ * the lowest open frames beyond options.open_dirs
+ *
+ * @param worker the traversal state, its path is the path of the directory
+ * @param reader the opened directory, taken over by the frame
+ *
+ * @returns the frame, valid until the next push, NULL on errors
+ */
+frame_t *do_frame_push(worker_t *worker, dirreader_t *reader) {
+  struct stat attr;
+  frame_t *frame;
+  int added;
+
+  /* -L: the directories on the path, a symlink to one of them is a loop */
+  if (options.follow == 'L') {
+    if (fstat(reader->fd, &attr) != 0) {
+      fprintf(stderr, "%s: fstat(%s): %s\n", program_name, worker->path.buffer,
+              strerror(errno));
+      return NULL;
+    }
+    if (do_inodes_add(&worker->ancestors, attr.st_dev, attr.st_ino, &added) != EXIT_SUCCESS) {
+      return NULL;
+    }
+  }
+
+  if (worker->frame_count == worker->frame_capacity) {
+    size_t capacity = worker->frame_capacity ? worker->frame_capacity * 2 : 16;
+    frame_t *frames = realloc(worker->frames, sizeof(*frames) * capacity);
+
+    if (!frames) {
+      fprintf(stderr, "%s: realloc(): %s\n", program_name, strerror(errno));
+      return NULL;
+    }
+
+    worker->frames = frames;
+    worker->frame_capacity = capacity;
+  }
+
+  frame = &worker->frames[worker->frame_count++];
+  memset(frame, 0, sizeof(*frame));
+  frame->reader = *reader;
+  frame->length = worker->path.length;
+
+  if (options.follow == 'L') {
+    frame->device = attr.st_dev;
+    frame->inode = attr.st_ino;
+  }
+
+  /* -du: the directory itself is counted in its own total */
+  frame->du_blocks = worker->du_blocks;
+  frame->du_entries = worker->du_entries;
+  worker->du_blocks = 0;
+  worker->du_entries = 0;
+
+  /* the entries are one level below the directory */
+  worker->depth++;
+
+  /* a frame which can't be suspended simply stays open */
+  while (worker->frame_count - worker->frame_open > options.open_dirs &&
+         do_frame_suspend(worker, &worker->frames[worker->frame_open]) == EXIT_SUCCESS) {
+    worker->frame_open++;
+  }
+
+  return frame;
+}
+
+/**
+ * @brief returns the next entry of a frame
+ *
+ * @param worker the traversal state
+ * @param frame the top frame
+ * @param entry the entry to fill, the names are valid until the next call
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE at the end of the directory or on errors
+ */
+int do_frame_next(worker_t *worker, frame_t *frame, entry_t *entry) {
+  direntry_t *record;
+
+  if (frame->reader.fd < 0) {
+    return EXIT_FAILURE; /* it couldn't be opened again, already reported */
+  }
+
+  if (frame->kind == FRAME_REUSE) {
+    return do_reuse_next(worker, frame, entry);
+  }
+
+  if (frame->kind == FRAME_BATCH) {
+    return do_batch_next(worker, frame, entry);
+  }
+
+  /* skip '.' and '..' */
+  while ((record = do_reader_next(&frame->reader)) &&
+         (strcmp(record->name, ".") == 0 || strcmp(record->name, "..") == 0)) {
+  }
+
+  if (!record) {
+    if (!frame->reader.eof) {
+      worker->path.buffer[frame->length] = '\0';
+      fprintf(stderr, "%s: getdents64(%s): %s\n", program_name, worker->path.buffer,
+              strerror(errno));
+      STATS_COUNT(errors);
+    }
+    return EXIT_FAILURE;
+  }
+
+  entry->parent = frame->reader.fd;
+  entry->name = record->name;
+  entry->base = record->name;
+  entry->type = record->type;
+  entry->has_attr = 0;
+  entry->attr_failed = 0;
+  entry->pruned = 0;
+  entry->index = NULL;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief removes the top frame; the frame below continues, it is opened again
+ * through ".." if it was suspended
+ *
+ * @param worker the traversal state with at least one frame
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_frame_close(worker_t *worker) {
+  frame_t *frame = &worker->frames[worker->frame_count - 1];
+  pathbuf_t *path = &worker->path;
+  int status = EXIT_SUCCESS;
+
+  /* restore the path and the depth of the directory for the caller */
+  path->length = frame->length;
+  path->buffer[frame->length] = '\0';
+  worker->depth--;
+
+  if (frame->kind == FRAME_BATCH) {
+    do_batch_free(worker, frame);
+  }
+
+  /* with -build-index, all entries below were recorded if nothing set errno */
+  if (frame->flag && errno == 0) {
+    worker->indexer->columns[COL_FLAGS].buffer[frame->flag - 1] |= INDEX_COMPLETE;
+    errno = frame->error;
+  }
+
+  if (options.du && do_du_close(worker, frame) != EXIT_SUCCESS) {
+    status = EXIT_FAILURE;
+  }
+
+  if (options.follow == 'L') {
+    do_inodes_remove(&worker->ancestors, frame->device, frame->inode);
+  }
+
+  if (frame->handle) {
+    do_release(worker->pool, frame->handle);
+  }
+
+  worker->frame_count--;
+
+  if (worker->frame_count > 0 && worker->frame_open == worker->frame_count) {
+    frame_t *below = &worker->frames[worker->frame_count - 1];
+
+    path->length = below->length;
+    path->buffer[below->length] = '\0';
+    worker->frame_open--;
+
+    if (do_frame_resume(worker, below, frame->reader.fd) != EXIT_SUCCESS) {
+      status = EXIT_FAILURE;
+    }
+  }
+
+  if (frame->reader.fd >= 0 && do_reader_close(&frame->reader, worker) != EXIT_SUCCESS) {
+    status = EXIT_FAILURE;
+  }
+
+  return status;
+}
+
+/**
+ * @brief closes the descriptor of a frame and gives back its buffers;
+ * the directory continues after the entry being descended into
+ *
+ * @param worker the traversal state
+ * @param frame an open frame below the top
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if the frame stays open
+ */
+int do_frame_suspend(worker_t *worker, frame_t *frame) {
+  struct stat attr;
+
+  if (fstat(frame->reader.fd, &attr) != 0) {
+    fprintf(stderr, "%s: fstat(%.*s): %s\n", program_name, (int)frame->length,
+            worker->path.buffer, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  frame->device = attr.st_dev;
+  frame->inode = attr.st_ino;
+
+  /* do_batch_next sets the offset of the entries it returns, the reader is ahead of them */
+  if (frame->kind == FRAME_BATCH) {
+    do_batch_free(worker, frame);
+  } else {
+    frame->offset = frame->reader.entry.offset;
+  }
+
+  do_reader_close(&frame->reader, worker);
+  frame->reader.fd = -1;
+  frame->reader.buffer = NULL;
+  frame->reader.dir = NULL;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief opens a suspended frame again and continues reading where it stopped;
+ * the path is only used if ".." of the child is not the same directory anymore,
+ * e.g. because it was moved meanwhile
+ *
+ * @param worker the traversal state, its path is the path of the directory
+ * @param frame the suspended frame
+ * @param child the descriptor of the subdirectory of the frame which was just finished
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_frame_resume(worker_t *worker, frame_t *frame, int child) {
+  struct stat attr;
+  int error = errno;
+  int fd = openat(child, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if (fd >= 0 &&
+      (fstat(fd, &attr) != 0 || attr.st_dev != frame->device || attr.st_ino != frame->inode)) {
+    close(fd);
+    fd = -1;
+  }
+
+  if (fd < 0 &&
+      (fd = openat(AT_FDCWD, worker->path.buffer,
+                   O_RDONLY | O_DIRECTORY | (options.follow ? 0 : O_NOFOLLOW) | O_CLOEXEC)) >= 0 &&
+      (fstat(fd, &attr) != 0 || attr.st_dev != frame->device || attr.st_ino != frame->inode)) {
+    close(fd);
+    fd = -1;
+    errno = ESTALE; /* the directory is not there anymore */
+  }
+
+  if (fd < 0) {
+    fprintf(stderr, "%s: openat(%s): %s\n", program_name, worker->path.buffer, strerror(errno));
+    STATS_COUNT(errors);
+    return EXIT_FAILURE;
+  }
+
+  errno = error;
+
+  if (frame->kind == FRAME_REUSE) {
+    frame->reader.fd = fd;
+    return EXIT_SUCCESS;
+  }
+
+  if (do_reader_attach(&frame->reader, worker, fd) != EXIT_SUCCESS) {
+    frame->reader.fd = -1;
+    return EXIT_FAILURE;
+  }
+
+#ifdef SYS_getdents64
+  if (lseek(fd, frame->offset, SEEK_SET) < 0) {
+    fprintf(stderr, "%s: lseek(%s): %s\n", program_name, worker->path.buffer, strerror(errno));
+    do_reader_close(&frame->reader, worker);
+    frame->reader.fd = -1;
+    return EXIT_FAILURE;
+  }
+#else
+  seekdir(frame->reader.dir, frame->offset);
+#endif
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief appends the entry name to the path, calls do_file on the entry
+ * and descends into it if it is a directory
+ *
+ * @param worker the traversal state
+ * @param entry the entry with parent, name, type and possibly the attributes set
+ * @param length the length of the directory path
+ * @param program the compiled expression
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if the path could not be built
+ */
+int do_entry(worker_t *worker, entry_t *entry, size_t length, program_t *program) {
+  pathbuf_t *path = &worker->path;
+
+  /* replace the previous entry name with the current one */
+  if (do_pathbuf_append(path, length, entry->name) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  entry->path = path->buffer;
+  entry->depth = worker->depth;
+  entry->root = worker->root;
+
+  /*
+   * there are no returns for do_file and do_dir on purpose here;
+   * it is normal for a single entry to fail, then we try the next one
+   */
+  if (options.follow == 'L' && do_check_loop(worker, entry) != EXIT_SUCCESS) {
+    return EXIT_SUCCESS; /* a loop or a symlink which can't be followed, already reported */
+  }
+
+  if (worker->depth >= options.mindepth) {
+    do_file(entry, program);
+  }
+
+  if (entry->attr_failed) {
+    return EXIT_SUCCESS; /* fstatat failed, skip the entry as a whole */
+  }
+
+  if (worker->indexer && do_index_record(worker->indexer, entry, worker->depth) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  if (options.du && do_du_add(worker, entry) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  /* if a directory, call the function recursively or let the pool do it */
+  if (do_descend(worker, entry) == EXIT_SUCCESS) {
+    if (worker->pool) {
+      do_share_dir(worker, entry, program);
+    } else if (worker->indexer) {
+      do_index_dir(worker, entry, program);
+    } else {
+      do_dir(worker, entry->parent, entry->name, program);
+    }
+  }
+
+  /* not taken over by a frame of its own, so it counts for the directory */
+  if (options.du && do_du_settle(worker, entry->path) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief grows the path buffer to hold at least needed bytes
+ *
+ * @param path the path buffer
+ * @param needed the size needed, including the termination
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_pathbuf_reserve(pathbuf_t *path, size_t needed) {
+
+  if (needed > path->capacity) {
+    size_t capacity = path->capacity ? path->capacity : 256;
+
+    while (capacity < needed) {
+      capacity *= 2;
+    }
+
+    char *buffer = realloc(path->buffer, sizeof(char) * capacity);
+
+    if (!buffer) {
+      fprintf(stderr, "%s: realloc(): %s\n", program_name, strerror(errno));
+      return EXIT_FAILURE; /* realloc doesn't free the old object if it fails */
+    }
+
+    path->buffer = buffer;
+    path->capacity = capacity;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief decides before opening a directory if the traversal descends into it;
+ * not if it was pruned, is at -maxdepth or, with -xdev, on another device
+ *
+ * @param worker the traversal state, its depth is the depth of the entry
+ * @param entry the entry
+ *
+ * @returns EXIT_SUCCESS to descend, EXIT_FAILURE otherwise
+ */
+int do_descend(worker_t *worker, entry_t *entry) {
+  struct stat *attr;
+
+  if (entry->pruned) {
+    return EXIT_FAILURE;
+  }
+
+  /* checked before the type, which may need an fstatat */
+  if (options.maxdepth >= 0 && worker->depth >= options.maxdepth) {
+    return EXIT_FAILURE;
+  }
+
+  if (do_get_entry_type(entry) != 'd') {
+    return EXIT_FAILURE;
+  }
+
+  if (options.xdev && (!(attr = do_get_attr(entry)) || attr->st_dev != worker->device)) {
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief queues a subdirectory for the pool, relative to the directory being read;
+ * if that can't be shared within the budget, the worker descends into the subdirectory
+ * itself, on its own stack where the frames beyond options.open_dirs are suspended
+ *
+ * @param worker the traversal state, its path is the path of the subdirectory
+ * @param entry the subdirectory, an entry of the top frame
+ * @param program the compiled expression
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_share_dir(worker_t *worker, entry_t *entry, program_t *program) {
+  frame_t *frame = &worker->frames[worker->frame_count - 1];
+  pathbuf_t *path = &worker->path;
+  dirhandle_t *handle;
+
+  if ((handle = do_share_frame(worker->pool, frame)) &&
+      do_push(worker, path->buffer, path->length - strlen(entry->name), handle,
+              worker->depth) == EXIT_SUCCESS) {
+    return EXIT_SUCCESS;
+  }
+
+  return do_dir(worker, entry->parent, entry->name, program);
+}
+
+/**
+ * @brief with -L, stats the symlinks through to their targets and reports a directory
+ * which is already on the path; only the symlinks and the directories, which are opened
+ * anyway, are stat'ed for this, the files keep their type from the directory
+ *
+ * @param worker the traversal state with the directories of the frames
+ * @param entry the entry
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE to skip the entry
+ */
+int do_check_loop(worker_t *worker, entry_t *entry) {
+  struct stat *attr;
+  size_t i;
+
+  if (!entry->has_attr && entry->type != DT_LNK && entry->type != DT_DIR &&
+      entry->type != DT_UNKNOWN) {
+    return EXIT_SUCCESS;
+  }
+
+  if (!(attr = do_get_attr(entry))) {
+    return EXIT_FAILURE; /* already reported */
+  }
+
+  if (!S_ISDIR(attr->st_mode) ||
+      !do_inodes_find(&worker->ancestors, attr->st_dev, attr->st_ino)) {
+    return EXIT_SUCCESS;
+  }
+
+  for (i = 0; i < worker->frame_count; i++) {
+    frame_t *frame = &worker->frames[i];
+
+    if (frame->device == attr->st_dev && frame->inode == attr->st_ino) {
+      /* the wording of GNU find, scripts look for it */
+      fprintf(stderr,
+              "%s: File system loop detected; '%s' is part of the same file system loop as "
+              "'%.*s'.\n",
+              program_name, entry->path, (int)frame->length, worker->path.buffer);
+      break;
+    }
+  }
+
+  STATS_COUNT(errors);
+  errno = ELOOP;
+
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief counts the blocks of an entry for -du; a file with hard links is only
+ * counted the first time, the entry is pending until do_frame_push or do_du_settle
+ *
+ * @param worker the traversal state
+ * @param entry the entry
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_du_add(worker_t *worker, entry_t *entry) {
+  struct stat *attr;
+  int added = 1;
+
+  if (!(attr = do_get_attr(entry))) {
+    return EXIT_SUCCESS; /* already reported */
+  }
+
+  /* directories can't be hard linked, so only the files with links are remembered */
+  if (!S_ISDIR(attr->st_mode) && attr->st_nlink > 1 &&
+      do_inodes_add(&du_links, attr->st_dev, attr->st_ino, &added) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  if (added) {
+    worker->du_blocks = (uint64_t)attr->st_blocks;
+    worker->du_entries = 1;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief adds a pending entry of -du to the directory being read; without a directory,
+ * it was a location which wasn't read and is printed on its own
+ *
+ * @param worker the traversal state
+ * @param path the path of the entry
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_du_settle(worker_t *worker, char *path) {
+  int status = EXIT_SUCCESS;
+
+  if (worker->du_entries == 0) {
+    return EXIT_SUCCESS;
+  }
+
+  if (worker->frame_count > 0) {
+    worker->frames[worker->frame_count - 1].du_blocks += worker->du_blocks;
+    worker->frames[worker->frame_count - 1].du_entries += worker->du_entries;
+  } else {
+    status = do_du_print(path, worker->du_blocks, worker->du_entries);
+  }
+
+  worker->du_blocks = 0;
+  worker->du_entries = 0;
+
+  return status;
+}
+
+/**
+ * @brief prints the total of a directory being left, down to -du-depth,
+ * and adds it to the directory below
+ *
+ * @param worker the traversal state, its path and depth are the ones of the directory
+ * @param frame the top frame
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_du_close(worker_t *worker, frame_t *frame) {
+
+  if (worker->frame_count > 1) {
+    worker->frames[worker->frame_count - 2].du_blocks += frame->du_blocks;
+    worker->frames[worker->frame_count - 2].du_entries += frame->du_entries;
+  }
+
+  if (options.du_depth >= 0 && worker->depth > options.du_depth) {
+    return EXIT_SUCCESS;
+  }
+
+  return do_du_print(worker->path.buffer, frame->du_blocks, frame->du_entries);
+}
+
+/**
+ * @brief prints a total of -du: the kilobytes like du, the entries and the path
+ *
+ * @param path the path
+ * @param blocks the 512-byte blocks
+ * @param entries the entries, including the directory itself
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_du_print(char *path, uint64_t blocks, uint64_t entries) {
+  size_t length = strlen(path);
+  char *out;
+
+  if (!(out = do_reserve(20 + 1 + 20 + 1 + length + 1))) {
+    return EXIT_FAILURE;
+  }
+
+  out = do_format_number(out, (blocks + 1) / 2, 0);
+  *out++ = '\t';
+  out = do_format_number(out, entries, 0);
+  *out++ = '\t';
+  memcpy(out, path, length);
+  out += length;
+  *out++ = '\n';
+
+  return do_commit(out);
+}
+
+/**
+ * @brief adds a file to a set by its device and inode, the set grows at half load
+ *
+ * @param set the set
+ * @param device the device
+ * @param inode the inode
+ * @param added set to whether the file was not in the set yet
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_inodes_add(inodeset_t *set, dev_t device, ino_t inode, int *added) {
+  uint64_t key = (uint64_t)inode ? (uint64_t)inode : UINT64_MAX; /* 0 is an empty slot */
+  size_t i;
+
+  if (2 * (set->count + 1) > set->capacity) {
+    size_t capacity = set->capacity ? set->capacity * 2 : 256;
+    uint64_t *slots = calloc(capacity, 2 * sizeof(*slots));
+
+    if (!slots) {
+      fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+      return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < set->capacity; i++) {
+      if (set->slots[2 * i + 1]) {
+        size_t j = do_hash_inode((dev_t)set->slots[2 * i], (ino_t)set->slots[2 * i + 1], capacity);
+
+        while (slots[2 * j + 1]) {
+          j = (j + 1) & (capacity - 1);
+        }
+        slots[2 * j] = set->slots[2 * i];
+        slots[2 * j + 1] = set->slots[2 * i + 1];
+      }
+    }
+
+    free(set->slots);
+    set->slots = slots;
+    set->capacity = capacity;
+  }
+
+  for (i = do_hash_inode(device, (ino_t)key, set->capacity); set->slots[2 * i + 1];
+       i = (i + 1) & (set->capacity - 1)) {
+    if (set->slots[2 * i + 1] == key && set->slots[2 * i] == (uint64_t)device) {
+      *added = 0;
+      return EXIT_SUCCESS;
+    }
+  }
+
+  set->slots[2 * i] = (uint64_t)device;
+  set->slots[2 * i + 1] = key;
+  set->count++;
+  *added = 1;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief checks if a file is in a set of inodes
+ *
+ * @param set the set
+ * @param device the device
+ * @param inode the inode
+ *
+ * @returns 1 if it is in the set, 0 otherwise
+ */
+int do_inodes_find(inodeset_t *set, dev_t device, ino_t inode) {
+  uint64_t key = (uint64_t)inode ? (uint64_t)inode : UINT64_MAX;
+  size_t i;
+
+  if (!set->capacity) {
+    return 0;
+  }
+
+  for (i = do_hash_inode(device, (ino_t)key, set->capacity); set->slots[2 * i + 1];
+       i = (i + 1) & (set->capacity - 1)) {
+    if (set->slots[2 * i + 1] == key && set->slots[2 * i] == (uint64_t)device) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief removes a file from a set of inodes; the following slots of its run are
+ * moved back, so the lookups don't need markers for removed files
+ *
+ * @param set the set
+ * @param device the device
+ * @param inode the inode
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if it was not in the set
+ */
+int do_inodes_remove(inodeset_t *set, dev_t device, ino_t inode) {
+  uint64_t key = (uint64_t)inode ? (uint64_t)inode : UINT64_MAX;
+  size_t mask = set->capacity - 1;
+  size_t i, j;
+
+  if (!set->capacity) {
+    return EXIT_FAILURE;
+  }
+
+  for (i = do_hash_inode(device, (ino_t)key, set->capacity);
+       set->slots[2 * i + 1] != key || set->slots[2 * i] != (uint64_t)device;
+       i = (i + 1) & mask) {
+    if (!set->slots[2 * i + 1]) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* a following file moves into the hole unless its home slot lies between them */
+  for (j = (i + 1) & mask; set->slots[2 * j + 1]; j = (j + 1) & mask) {
+    size_t home = do_hash_inode((dev_t)set->slots[2 * j], (ino_t)set->slots[2 * j + 1],
+                                set->capacity);
+
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      set->slots[2 * i] = set->slots[2 * j];
+      set->slots[2 * i + 1] = set->slots[2 * j + 1];
+      i = j;
+    }
+  }
+
+  set->slots[2 * i] = 0;
+  set->slots[2 * i + 1] = 0;
+  set->count--;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief calculates the slot of a file in a set of inodes
+ *
+ * @param device the device
+ * @param inode the inode
+ * @param capacity the capacity of the set, a power of 2
+ *
+ * @returns the slot
+ */
+size_t do_hash_inode(dev_t device, ino_t inode, size_t capacity) {
+  uint64_t hash = ((uint64_t)inode ^ ((uint64_t)device << 32 | (uint64_t)device >> 32)) *
+                  0x9e3779b97f4a7c15ULL;
+
+  return (size_t)(hash >> 32) & (capacity - 1);
+}
+
+/**
+ * @brief frees a set of inodes
+ *
+ * @param set the set
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_free_inodes(inodeset_t *set) {
+
+  free(set->slots);
+  set->slots = NULL;
+  set->count = 0;
+  set->capacity = 0;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief cuts the path at length and appends the name, separated by a slash if needed
+ *
+ * @param path the path buffer, grown if necessary
+ * @param length the length to keep, 0 to replace the whole path
+ * @param name the name to append
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_pathbuf_append(pathbuf_t *path, size_t length, char *name) {
+  size_t size = strlen(name);
+  int slash = length > 0 && path->buffer[length - 1] != '/';
+
+  if (do_pathbuf_reserve(path, length + slash + size + 1) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  if (slash) {
+    path->buffer[length++] = '/';
+  }
+
+  memcpy(path->buffer + length, name, size + 1);
+  path->length = length + size;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief frees the buffers of a traversal state
+ *
+ * @param worker the traversal state
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_free_worker(worker_t *worker) {
+
+  while (worker->buffer_count > 0) {
+    free(worker->buffers[--worker->buffer_count]);
+  }
+
+  free(worker->buffers);
+  free(worker->path.buffer);
+  free(worker->deque.items);
+  free(worker->frames);
+  do_free_inodes(&worker->ancestors);
+  do_free_uring(worker->uring);
+
+  return EXIT_SUCCESS;
+}
+
+#ifdef SYS_getdents64
+/**
+ * the record layout of getdents64, not exported by older C libraries
+ */
+struct linux_dirent64 {
+  unsigned long long d_ino;
+  long long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+#endif
+
+/**
+ * @brief opens a directory relative to its parent for do_reader_next;
+ * the buffer is taken from the worker's spare buffers if possible
+ *
+ * @param reader the reader to initialize
+ * @param worker the traversal state, its path is used for error messages
+ * @param parent the descriptor of the parent directory or AT_FDCWD
+ * @param name the directory name relative to parent
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_reader_open(dirreader_t *reader, worker_t *worker, int parent, char *name) {
+  int follow = options.follow == 'L' || (options.follow == 'H' && worker->depth == 0);
+  int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | (follow ? 0 : O_NOFOLLOW) | O_CLOEXEC);
+
+  if (fd < 0) {
+    fprintf(stderr, "%s: openat(%s): %s\n", program_name, worker->path.buffer, strerror(errno));
+    STATS_COUNT(errors);
+    return EXIT_FAILURE;
+  }
+
+  return do_reader_attach(reader, worker, fd);
+}
+
+/**
+ * @brief prepares a reader for an opened directory
+ *
+ * @param reader the reader to initialize
+ * @param worker the traversal state, its path is used for error messages
+ * @param fd the directory, closed on errors
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_reader_attach(dirreader_t *reader, worker_t *worker, int fd) {
+
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = fd;
+
+#ifdef SYS_getdents64
+  if (worker->buffer_count > 0) {
+    reader->buffer = worker->buffers[--worker->buffer_count];
+  } else {
+    reader->buffer = malloc(options.dirbuf);
+
+    if (!reader->buffer) {
+      fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+      close(reader->fd);
+      return EXIT_FAILURE;
+    }
+  }
+
+  reader->size = options.dirbuf;
+#else
+  reader->dir = fdopendir(reader->fd);
+
+  if (!reader->dir) {
+    fprintf(stderr, "%s: fdopendir(%s): %s\n", program_name, worker->path.buffer, strerror(errno));
+    close(reader->fd);
+    return EXIT_FAILURE;
+  }
+#endif
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief returns the next directory entry, refilling the buffer with getdents64 when it is empty
+ *
+ * @param reader the reader from do_reader_open
+ *
+ * @returns the entry, valid until the next call, or NULL at the end;
+ * on errors NULL is returned and errno is set
+ */
+direntry_t *do_reader_next(dirreader_t *reader) {
+
+#ifdef SYS_getdents64
+  struct linux_dirent64 *record;
+
+  if (reader->position >= reader->end) {
+    long count;
+
+    if (reader->eof) {
+      return NULL;
+    }
+
+    STATS_BEGIN(PHASE_READDIR);
+    count = syscall(SYS_getdents64, reader->fd, reader->buffer, reader->size);
+    STATS_END(PHASE_READDIR);
+
+    if (count <= 0) {
+      /* 0 is the end of the directory, -1 an error with errno set */
+      reader->eof = count == 0;
+      return NULL;
+    }
+
+    reader->position = 0;
+    reader->end = (size_t)count;
+  }
+
+  record = (struct linux_dirent64 *)(reader->buffer + reader->position);
+  reader->position += record->d_reclen;
+
+  reader->entry.name = record->d_name;
+  reader->entry.type = record->d_type;
+  reader->entry.ino = (ino_t)record->d_ino;
+  reader->entry.offset = (off_t)record->d_off;
+#else
+  struct dirent *record;
+
+  errno = 0;
+
+  if (!(record = readdir(reader->dir))) {
+    reader->eof = errno == 0;
+    return NULL;
+  }
+
+  reader->entry.name = record->d_name;
+  reader->entry.type = record->d_type;
+  reader->entry.ino = record->d_ino;
+  reader->entry.offset = telldir(reader->dir);
+#endif
+
+  return &reader->entry;
+}
+
+/**
+ * @brief closes the directory and gives the buffer back to the worker
+ *
+ * @param reader the reader from do_reader_open
+ * @param worker the traversal state
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_reader_close(dirreader_t *reader, worker_t *worker) {
+
+  if (reader->buffer) {
+    if (worker->buffer_count == worker->buffer_capacity) {
+      size_t capacity = worker->buffer_capacity ? worker->buffer_capacity * 2 : 8;
+      char **buffers = realloc(worker->buffers, sizeof(*buffers) * capacity);
+
+      if (buffers) {
+        worker->buffers = buffers;
+        worker->buffer_capacity = capacity;
+      }
+    }
+
+    /* if the list couldn't grow, the buffer is simply freed */
+    if (worker->buffer_count < worker->buffer_capacity) {
+      worker->buffers[worker->buffer_count++] = reader->buffer;
+    } else {
+      free(reader->buffer);
+    }
+  }
+
+  if (reader->dir ? closedir(reader->dir) != 0 : close(reader->fd) != 0) {
+    fprintf(stderr, "%s: closedir(%s): %s\n", program_name, worker->path.buffer, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+#if defined(HAVE_LINUX_IO_URING_H) || defined(HAVE_STATX)
+/**
+ * @brief converts the statx result to the struct stat used everywhere else
+ *
+ * @param stx the statx result
+ * @param attr the attributes to fill
+ */
+void do_convert_statx(struct statx *stx, struct stat *attr) {
+
+  memset(attr, 0, sizeof(*attr));
+
+  attr->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  attr->st_ino = stx->stx_ino;
+  attr->st_mode = stx->stx_mode;
+  attr->st_nlink = stx->stx_nlink;
+  attr->st_uid = stx->stx_uid;
+  attr->st_gid = stx->stx_gid;
+  attr->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+  attr->st_size = (off_t)stx->stx_size;
+  attr->st_blksize = stx->stx_blksize;
+  attr->st_blocks = (blkcnt_t)stx->stx_blocks;
+  attr->st_atim.tv_sec = stx->stx_atime.tv_sec;
+  attr->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+  attr->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  attr->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+  attr->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+  attr->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+/**
+ * @brief returns the io_uring instance of the worker, sets it up on the first use
+ *
+ * @param worker the traversal state
+ *
+ * @returns the instance or NULL if io_uring is not available
+ */
+uring_t *do_get_uring(worker_t *worker) {
+  struct io_uring_params setup;
+  uring_t *uring;
+  char *sq;
+  char *cq;
+
+  if (worker->uring || worker->uring_failed) {
+    return worker->uring;
+  }
+
+  /* from now on, every failure means the synchronous fstatat path is used */
+  worker->uring_failed = 1;
+
+  if (!(uring = calloc(1, sizeof(*uring)))) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+    return NULL;
+  }
+
+  memset(&setup, 0, sizeof(setup));
+  uring->fd = (int)syscall(SYS_io_uring_setup, 256, &setup);
+
+  if (uring->fd < 0) {
+    /* not supported by the kernel or forbidden, e.g. by seccomp */
+    errno = 0;
+    free(uring);
+    return NULL;
+  }
+
+  uring->entries = setup.sq_entries;
+  uring->sq_ring_size = setup.sq_off.array + setup.sq_entries * sizeof(unsigned int);
+  uring->cq_ring_size = setup.cq_off.cqes + setup.cq_entries * sizeof(struct io_uring_cqe);
+  uring->sqes_size = setup.sq_entries * sizeof(struct io_uring_sqe);
+
+  if (setup.features & IORING_FEAT_SINGLE_MMAP) {
+    if (uring->cq_ring_size > uring->sq_ring_size) {
+      uring->sq_ring_size = uring->cq_ring_size;
+    }
+    uring->cq_ring_size = 0;
+  }
+
+  uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+  uring->cq_ring = uring->cq_ring_size == 0 ? uring->sq_ring
+                                            : mmap(NULL, uring->cq_ring_size,
+                                                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                   uring->fd, IORING_OFF_CQ_RING);
+  uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     uring->fd, IORING_OFF_SQES);
+
+  if (uring->sq_ring == MAP_FAILED || uring->cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+    fprintf(stderr, "%s: mmap(): %s\n", program_name, strerror(errno));
+    errno = 0;
+    do_free_uring(uring);
+    return NULL;
+  }
+
+  sq = uring->sq_ring;
+  cq = uring->cq_ring;
+
+  uring->sq_head = (unsigned int *)(sq + setup.sq_off.head);
+  uring->sq_tail = (unsigned int *)(sq + setup.sq_off.tail);
+  uring->sq_mask = (unsigned int *)(sq + setup.sq_off.ring_mask);
+  uring->sq_array = (unsigned int *)(sq + setup.sq_off.array);
+  uring->cq_head = (unsigned int *)(cq + setup.cq_off.head);
+  uring->cq_tail = (unsigned int *)(cq + setup.cq_off.tail);
+  uring->cq_mask = (unsigned int *)(cq + setup.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe *)(cq + setup.cq_off.cqes);
+
+  worker->uring_failed = 0;
+  worker->uring = uring;
+
+  return uring;
+}
+
+/**
+ * @brief unmaps the rings and closes the io_uring instance
+ *
+ * @param uring the instance from do_get_uring, may be NULL
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_free_uring(uring_t *uring) {
+
+  if (!uring) {
+    return EXIT_SUCCESS;
+  }
+
+  if (uring->sqes && uring->sqes != MAP_FAILED) {
+    munmap(uring->sqes, uring->sqes_size);
+  }
+  if (uring->cq_ring_size && uring->cq_ring && uring->cq_ring != MAP_FAILED) {
+    munmap(uring->cq_ring, uring->cq_ring_size);
+  }
+  if (uring->sq_ring && uring->sq_ring != MAP_FAILED) {
+    munmap(uring->sq_ring, uring->sq_ring_size);
+  }
+
+  close(uring->fd);
+  free(uring);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief marks the finished entries, waits for a completion if none has arrived yet
+ *
+ * @param uring the instance
+ * @param batch the entries the completions belong to
+ *
+ * @returns the number of reaped completions, -1 on errors
+ */
+int do_uring_reap(uring_t *uring, batched_t *batch) {
+  unsigned int head = *uring->cq_head;
+  unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+  int reaped = 0;
+
+  if (head == tail) {
+    if (syscall(SYS_io_uring_enter, uring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+        errno != EINTR) {
+      return -1;
+    }
+    tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+  }
+
+  for (; head != tail; head++, reaped++) {
+    struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+
+    batch[cqe->user_data].result = cqe->res;
+    batch[cqe->user_data].done = 1;
+  }
+
+  __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+  return reaped;
+}
+
+/**
+ * @brief returns the next entry of a directory read in batches: the names of up to the ring
+ * size are collected, statx is submitted for all of them at once and an entry is returned
+ * as soon as its statx is completed
+ *
+ * @param worker the traversal state with an io_uring instance
+ * @param frame the top frame
+ * @param entry the entry to fill, the names are valid until the next call
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE at the end of the directory or on errors
+ */
+int do_batch_next(worker_t *worker, frame_t *frame, entry_t *entry) {
+  uring_t *uring = worker->uring;
+  dirreader_t *reader = &frame->reader;
+  batched_t *batch = frame->batch;
+  direntry_t *record = NULL;
+  size_t names_length;
+  long submitted;
+  unsigned int next;
+  unsigned int i;
+  int directory;
+
+  if (!batch && !(batch = frame->batch = malloc(sizeof(*batch) * uring->entries))) {
+    fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (frame->next == frame->count) {
+    /* the statx results of the previous batch must not arrive in the new one */
+    while (frame->pending > 0) {
+      int reaped = do_uring_reap(uring, batch);
+
+      if (reaped < 0) {
+        return EXIT_FAILURE;
+      }
+
+      frame->pending -= (unsigned int)reaped;
+    }
+
+    /* collect the names, they are copied because the reader buffer is refilled */
+    for (frame->count = 0, frame->next = 0, names_length = 0; frame->count < uring->entries;) {
+      size_t size;
+
+      if (!(record = do_reader_next(reader))) {
+        break;
+      }
+      if (strcmp(record->name, ".") == 0 || strcmp(record->name, "..") == 0) {
+        continue;
+      }
+
+      size = strlen(record->name) + 1;
+
+      if (names_length + size > frame->names_capacity) {
+        size_t capacity = frame->names_capacity ? frame->names_capacity * 2 : 4096;
+        char *grown;
+
+        while (capacity < names_length + size) {
+          capacity *= 2;
+        }
+
+        if (!(grown = realloc(frame->names, capacity))) {
+          fprintf(stderr, "%s: realloc(): %s\n", program_name, strerror(errno));
+          return EXIT_FAILURE;
+        }
+
+        frame->names = grown;
+        frame->names_capacity = capacity;
+      }
+
+      memcpy(frame->names + names_length, record->name, size);
+      batch[frame->count].name = names_length;
+      batch[frame->count].type = record->type;
+      batch[frame->count].offset = record->offset;
+      batch[frame->count].done = 0;
+      names_length += size;
+      frame->count++;
+    }
+
+    if (frame->count == 0) {
+      if (!record && !reader->eof) {
+        worker->path.buffer[frame->length] = '\0';
+        fprintf(stderr, "%s: getdents64(%s): %s\n", program_name, worker->path.buffer,
+                strerror(errno));
+        STATS_COUNT(errors);
+      }
+      return EXIT_FAILURE;
+    }
+
+    /* the names are not moved anymore, submit statx for all of them; they run asynchronously,
+     * so only the fstatat fallbacks show up in the stat phase of -stats */
+    for (i = 0; i < frame->count; i++) {
+      unsigned int tail = *uring->sq_tail;
+      unsigned int index = tail & *uring->sq_mask;
+      struct io_uring_sqe *sqe = &uring->sqes[index];
+
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = reader->fd;
+      sqe->addr = (unsigned long)(frame->names + batch[i].name);
+      sqe->len = options.statx_mask;
+      sqe->off = (unsigned long)&batch[i].stx;
+      sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+#ifdef AT_STATX_DONT_SYNC
+      if (options.fast_stat) {
+        sqe->statx_flags |= AT_STATX_DONT_SYNC;
+      }
+#endif
+      sqe->user_data = i;
+
+      uring->sq_array[index] = index;
+      __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    /* the kernel may consume fewer entries than asked for, the rest is submitted again */
+    for (frame->pending = 0; frame->pending < frame->count;) {
+      submitted = syscall(SYS_io_uring_enter, uring->fd, frame->count - frame->pending, 0, 0,
+                          NULL, 0);
+
+      if (submitted < 0 && errno == EINTR) {
+        continue;
+      }
+
+      if (submitted <= 0) {
+        /*
+         * the entries the kernel has not consumed are dropped from the ring, their user_data
+         * must not complete later; they fall back to fstatat in do_get_attr
+         */
+        if (submitted < 0) {
+          fprintf(stderr, "%s: io_uring_enter(): %s\n", program_name, strerror(errno));
+        }
+        __atomic_store_n(uring->sq_tail, *uring->sq_head, __ATOMIC_RELEASE);
+        break;
+      }
+
+      frame->pending += (unsigned int)submitted;
+    }
+  }
+
+  next = frame->next++;
+  directory = batch[next].type == DT_DIR || batch[next].type == DT_UNKNOWN;
+
+  /* a directory is only entered when the batch is completed, its frame reuses the ring */
+  while (frame->pending > 0 && (!batch[next].done || directory)) {
+    int reaped = do_uring_reap(uring, batch);
+
+    if (reaped < 0) {
+      fprintf(stderr, "%s: io_uring_enter(): %s\n", program_name, strerror(errno));
+      break;
+    }
+
+    frame->pending -= (unsigned int)reaped;
+  }
+
+  frame->offset = batch[next].offset;
+
+  entry->parent = reader->fd;
+  entry->name = frame->names + batch[next].name;
+  entry->base = entry->name;
+  entry->type = batch[next].type;
+  entry->has_attr = 0;
+  entry->attr_failed = 0;
+  entry->pruned = 0;
+  entry->index = NULL;
+
+  /* on errors, do_get_attr retries with fstatat and reports the error */
+  if (batch[next].done && batch[next].result == 0) {
+    do_convert_statx(&batch[next].stx, &entry->attr);
+    entry->type = IFTODT(entry->attr.st_mode);
+    entry->has_attr = 1;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief waits for the pending statx calls of a frame and frees its batch
+ *
+ * @param worker the traversal state with an io_uring instance
+ * @param frame the frame
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_batch_free(worker_t *worker, frame_t *frame) {
+
+  /* the statx results must not arrive after the batch is gone */
+  while (frame->pending > 0) {
+    int reaped = do_uring_reap(worker->uring, frame->batch);
+
+    if (reaped < 0) {
+      break;
+    }
+
+    frame->pending -= (unsigned int)reaped;
+  }
+
+  free(frame->names);
+  free(frame->batch);
+  frame->names = NULL;
+  frame->names_capacity = 0;
+  frame->batch = NULL;
+  frame->count = 0;
+  frame->next = 0;
+
+  return EXIT_SUCCESS;
+}
+#else
+/**
+ * @brief io_uring is not available in this build
+ *
+ * @param worker the traversal state
+ *
+ * @returns NULL
+ */
+uring_t *do_get_uring(worker_t *worker) {
+  (void)worker;
+  return NULL;
+}
+
+/**
+ * @brief io_uring is not available in this build
+ *
+ * @param uring always NULL
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_free_uring(uring_t *uring) {
+  (void)uring;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief io_uring is not available in this build, never called
+ *
+ * @param worker the traversal state
+ * @param frame the top frame
+ * @param entry the entry to fill
+ *
+ * @returns EXIT_FAILURE
+ */
+int do_batch_next(worker_t *worker, frame_t *frame, entry_t *entry) {
+  (void)worker;
+  (void)frame;
+  (void)entry;
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief io_uring is not available in this build, there is nothing to free
+ *
+ * @param worker the traversal state
+ * @param frame the frame
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_batch_free(worker_t *worker, frame_t *frame) {
+  (void)worker;
+  (void)frame;
+  return EXIT_SUCCESS;
+}
+#endif
+
+/**
+ * @brief traverses the contents of a directory with options.threads workers;
+ * every directory is a work item, idle workers steal items from the others
+ *
+ * @param path the directory to be processed
+ * @param device the device of the directory, for -xdev
+ * @param program the compiled expression
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_pool(char *path, dev_t device, program_t *program) {
+  task_t task;
+  pool_t pool;
+  unsigned int i;
+  unsigned int started = 0;
+  int error;
+  int status = EXIT_SUCCESS;
+
+  memset(&pool, 0, sizeof(pool));
+  pool.program = program;
+  pool.count = options.threads;
+  pool.workers = calloc(pool.count, sizeof(*pool.workers));
+
+  if (!pool.workers) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  pthread_mutex_init(&pool.idle_lock, NULL);
+  pthread_cond_init(&pool.idle_cond, NULL);
+
+  for (i = 0; i < pool.count; i++) {
+    pool.workers[i].pool = &pool;
+    pool.workers[i].id = i;
+    pool.workers[i].device = device;
+    pool.workers[i].root = strlen(path);
+    pthread_mutex_init(&pool.workers[i].deque.lock, NULL);
+  }
+
+  /* the first worker starts with the location, the others will steal from it */
+  if (do_push(&pool.workers[0], path, 0, NULL, 0) != EXIT_SUCCESS) {
+    status = EXIT_FAILURE;
+  }
+
+  for (i = 0; status == EXIT_SUCCESS && i < pool.count; i++, started++) {
+    if ((error = pthread_create(&pool.workers[i].thread, NULL, do_worker, &pool.workers[i]))) {
+      fprintf(stderr, "%s: pthread_create(): %s\n", program_name, strerror(error));
+      status = EXIT_FAILURE;
+      break;
+    }
+  }
+
+  /* the started workers drain the queue even if some could not be started */
+  if (started == 0 && do_pop(&pool.workers[0], &task) == EXIT_SUCCESS) {
+    free(task.path); /* the location, it has no parent */
+  }
+
+  for (i = 0; i < started; i++) {
+    if ((error = pthread_join(pool.workers[i].thread, NULL))) {
+      fprintf(stderr, "%s: pthread_join(): %s\n", program_name, strerror(error));
+      status = EXIT_FAILURE;
+    }
+  }
+
+  for (i = 0; i < pool.count; i++) {
+    if (pool.workers[i].failed) {
+      status = EXIT_FAILURE;
+    }
+    do_free_worker(&pool.workers[i]);
+    pthread_mutex_destroy(&pool.workers[i].deque.lock);
+  }
+
+  pthread_cond_destroy(&pool.idle_cond);
+  pthread_mutex_destroy(&pool.idle_lock);
+  free(pool.workers);
+
+  return status;
+}
+
+/**
+ * @brief the main loop of a worker; processes directories until the pool runs dry
+ *
+ * @param arg the worker
+ *
+ * @returns NULL
+ */
+void *do_worker(void *arg) {
+  worker_t *worker = arg;
+  pool_t *pool = worker->pool;
+  task_t task;
+  int opened;
+
+  errno = 0;
+
+  for (;;) {
+    if (do_pop(worker, &task) != EXIT_SUCCESS && do_steal(worker, &task) != EXIT_SUCCESS) {
+      /* sleep until new work is pushed or the last directory is finished */
+      pthread_mutex_lock(&pool->idle_lock);
+      __atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+      while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0 &&
+             __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) != 0) {
+        pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+      }
+      __atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&pool->idle_lock);
+
+      if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0) {
+        break;
+      }
+      continue;
+    }
+
+    /* after a failed write the queue is only drained */
+    opened = !output_failed && do_pathbuf_append(&worker->path, 0, task.path) == EXIT_SUCCESS;
+    if (opened) {
+      worker->depth = task.depth;
+      opened = do_frame_open(worker, task.parent ? task.parent->fd : AT_FDCWD,
+                             task.path + task.name) == EXIT_SUCCESS;
+    }
+
+    /* the parent is only needed to open the directory */
+    if (task.parent) {
+      do_release(pool, task.parent);
+    }
+    free(task.path);
+
+    if (opened) {
+      do_walk(worker, pool->program);
+    }
+
+    /* wake up everybody if this was the last directory */
+    if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+      pthread_mutex_lock(&pool->idle_lock);
+      pthread_cond_broadcast(&pool->idle_cond);
+      pthread_mutex_unlock(&pool->idle_lock);
+    }
+  }
+
+  /* errno is thread-local, same check as in do_location */
+  if (errno != 0) {
+    worker->failed = 1;
+  }
+
+  if (do_free_output() != EXIT_SUCCESS) {
+    worker->failed = 1;
+  }
+
+  do_merge_stats();
+
+  return NULL;
+}
+
+/**
+ * @brief adds a copy of the path to the bottom of the worker's deque
+ *
+ * @param worker the worker owning the deque
+ * @param path the directory to be processed later
+ * @param name the offset of the directory name in the path
+ * @param parent the parent directory, a reference is taken for the task; NULL for the location
+ * @param depth the depth of the directory
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_push(worker_t *worker, char *path, size_t name, dirhandle_t *parent, int depth) {
+  deque_t *deque = &worker->deque;
+  pool_t *pool = worker->pool;
+  char *copy = strdup(path);
+
+  if (!copy) {
+    fprintf(stderr, "%s: strdup(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  pthread_mutex_lock(&deque->lock);
+
+  if (deque->bottom == deque->capacity) {
+    if (deque->top > 0) {
+      /* reclaim the space left by the stolen items */
+      memmove(deque->items, deque->items + deque->top,
+              sizeof(*deque->items) * (deque->bottom - deque->top));
+      deque->bottom -= deque->top;
+      deque->top = 0;
+    } else {
+      size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+      task_t *items = realloc(deque->items, sizeof(*items) * capacity);
+
+      if (!items) {
+        pthread_mutex_unlock(&deque->lock);
+        fprintf(stderr, "%s: realloc(): %s\n", program_name, strerror(errno));
+        free(copy);
+        return EXIT_FAILURE;
+      }
+
+      deque->items = items;
+      deque->capacity = capacity;
+    }
+  }
+
+  if (parent) {
+    __atomic_add_fetch(&parent->refs, 1, __ATOMIC_SEQ_CST);
+  }
+
+  deque->items[deque->bottom].path = copy;
+  deque->items[deque->bottom].name = name;
+  deque->items[deque->bottom].parent = parent;
+  deque->items[deque->bottom].depth = depth;
+  deque->bottom++;
+
+  pthread_mutex_unlock(&deque->lock);
+
+  __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+  /* a sleeping worker checks queued while holding idle_lock, so it cannot miss this */
+  if (__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief takes the most recently pushed directory from the bottom of the worker's deque
+ *
+ * @param worker the worker owning the deque
+ * @param task the directory, its path has to be freed
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if the deque is empty
+ */
+int do_pop(worker_t *worker, task_t *task) {
+  deque_t *deque = &worker->deque;
+  int status = EXIT_FAILURE;
+
+  pthread_mutex_lock(&deque->lock);
+
+  if (deque->bottom > deque->top) {
+    *task = deque->items[--deque->bottom];
+    status = EXIT_SUCCESS;
+  }
+
+  pthread_mutex_unlock(&deque->lock);
+
+  if (status == EXIT_SUCCESS) {
+    __atomic_sub_fetch(&worker->pool->queued, 1, __ATOMIC_SEQ_CST);
+  }
+
+  return status;
+}
+
+/**
+ * @brief takes the oldest directory from the top of another worker's deque;
+ * the oldest directories are the closest to the root and carry the most work
+ *
+ * @param worker the worker looking for work
+ * @param task the directory, its path has to be freed
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if all deques are empty
+ */
+int do_steal(worker_t *worker, task_t *task) {
+  pool_t *pool = worker->pool;
+  int status = EXIT_FAILURE;
+  unsigned int i;
+
+  for (i = 1; status != EXIT_SUCCESS && i < pool->count; i++) {
+    deque_t *deque = &pool->workers[(worker->id + i) % pool->count].deque;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom > deque->top) {
+      *task = deque->items[deque->top++];
+      status = EXIT_SUCCESS;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+  }
+
+  if (status == EXIT_SUCCESS) {
+    __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+  }
+
+  return status;
+}
+
+/**
+ * @brief returns the handle of a frame shared with the tasks of its subdirectories;
+ * it is a duplicate of the descriptor, so the frame can be suspended independently
+ *
+ * @param pool the pool, it counts the shared directories against options.shared_dirs
+ * @param frame the frame
+ *
+ * @returns the handle, NULL on errors or beyond the budget
+ */
+dirhandle_t *do_share_frame(pool_t *pool, frame_t *frame) {
+  dirhandle_t *handle;
+
+  if (frame->handle) {
+    return frame->handle;
+  }
+
+  if (__atomic_add_fetch(&pool->shared, 1, __ATOMIC_SEQ_CST) > options.shared_dirs) {
+    __atomic_sub_fetch(&pool->shared, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+  }
+
+  if (!(handle = malloc(sizeof(*handle)))) {
+    fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+    __atomic_sub_fetch(&pool->shared, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+  }
+
+  if ((handle->fd = fcntl(frame->reader.fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+    fprintf(stderr, "%s: fcntl(): %s\n", program_name, strerror(errno));
+    __atomic_sub_fetch(&pool->shared, 1, __ATOMIC_SEQ_CST);
+    free(handle);
+    return NULL;
+  }
+
+  handle->refs = 1;
+  frame->handle = handle;
+
+  return handle;
+}
+
+/**
+ * @brief drops a reference to a shared directory, the last one closes it
+ *
+ * @param pool the pool
+ * @param handle the directory
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_release(pool_t *pool, dirhandle_t *handle) {
+
+  if (__atomic_sub_fetch(&handle->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+    close(handle->fd);
+    free(handle);
+    __atomic_sub_fetch(&pool->shared, 1, __ATOMIC_SEQ_CST);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief appends a record to the output buffer of the thread;
+ * a record which doesn't fit is written together with the buffer by a single writev
+ *
+ * @param parts the parts of the record, at most 7
+ * @param count the number of parts
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_write(struct iovec *parts, int count) {
+  size_t size = 0;
+  int i;
+
+  if (output_failed) {
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < count; i++) {
+    size += parts[i].iov_len;
+  }
+
+  if (!output.buffer) {
+    if (!(output.buffer = malloc(65536))) {
+      fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    output.capacity = 65536;
+  }
+
+  if (output.length + size > output.capacity) {
+    /* a huge record goes out together with the buffer, without copying */
+    if (size > output.capacity) {
+      struct iovec all[8];
+
+      all[0].iov_base = output.buffer;
+      all[0].iov_len = output.length;
+      memcpy(all + 1, parts, sizeof(*parts) * (size_t)count);
+      output.length = 0;
+
+      return do_write_all(all, count + 1);
+    }
+
+    if (do_flush() != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    memcpy(output.buffer + output.length, parts[i].iov_base, parts[i].iov_len);
+    output.length += parts[i].iov_len;
+  }
+
+  if (options.flush == 'l') {
+    return do_flush();
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief writes out the output buffer of the thread
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_flush(void) {
+  struct iovec part;
+
+  if (output.length == 0) {
+    return EXIT_SUCCESS;
+  }
+
+  part.iov_base = output.buffer;
+  part.iov_len = output.length;
+  output.length = 0;
+
+  return do_write_all(&part, 1);
+}
+
+/**
+ * @brief writes all parts to stdout, continuing after partial writes;
+ * the first failure is reported and stops the traversal as soon as possible
+ *
+ * @param parts the parts, modified while writing
+ * @param count the number of parts
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_write_all(struct iovec *parts, int count) {
+  int status = EXIT_SUCCESS;
+
+  pthread_mutex_lock(&output_lock);
+
+  while (count > 0) {
+    STATS_BEGIN(PHASE_WRITE);
+    ssize_t written = writev(STDOUT_FILENO, parts, count);
+    STATS_END(PHASE_WRITE);
+
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written < 0) {
+      status = EXIT_FAILURE;
+      break;
+    }
+
+    /* skip the parts which are done, shorten the one which is partially done */
+    while (count > 0 && (size_t)written >= parts->iov_len) {
+      written -= (ssize_t)parts->iov_len;
+      parts++;
+      count--;
+    }
+    if (count > 0) {
+      parts->iov_base = (char *)parts->iov_base + written;
+      parts->iov_len -= (size_t)written;
+    }
+  }
+
+  pthread_mutex_unlock(&output_lock);
+
+  if (status != EXIT_SUCCESS) {
+    if (!__atomic_exchange_n(&output_failed, 1, __ATOMIC_SEQ_CST)) {
+      fprintf(stderr, "%s: write(): %s\n", program_name, strerror(errno));
+    }
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief makes room for a record in the output buffer, so it can be formatted in place
+ *
+ * @param size the maximum size of the record
+ *
+ * @returns the place to write the record to, NULL on errors
+ */
+char *do_reserve(size_t size) {
+
+  if (output_failed) {
+    return NULL;
+  }
+
+  if (output.length + size > output.capacity) {
+    if (do_flush() != EXIT_SUCCESS) {
+      return NULL;
+    }
+  }
+
+  /* the buffer has to grow for huge records, e.g. with very long symlinks */
+  if (size > output.capacity) {
+    size_t capacity = output.capacity ? output.capacity : 65536;
+    char *buffer;
+
+    while (capacity < size) {
+      capacity *= 2;
+    }
+
+    if (!(buffer = realloc(output.buffer, capacity))) {
+      fprintf(stderr, "%s: realloc(): %s\n", program_name, strerror(errno));
+      return NULL;
+    }
+
+    output.buffer = buffer;
+    output.capacity = capacity;
+  }
+
+  return output.buffer + output.length;
+}
+
+/**
+ * @brief completes a record formatted in place after do_reserve
+ *
+ * @param end the end of the record
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_commit(char *end) {
+
+  output.length = (size_t)(end - output.buffer);
+
+  if (options.flush == 'l') {
+    return do_flush();
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief writes a right-aligned number, same as printf("%*llu")
+ *
+ * @param out the place to write to
+ * @param number the number
+ * @param width the minimum width, padded with spaces
+ *
+ * @returns the end of the written number
+ */
+char *do_format_number(char *out, unsigned long long number, int width) {
+  char digits[20];
+  int count = 0;
+
+  do {
+    digits[count++] = (char)('0' + number % 10);
+    number /= 10;
+  } while (number > 0);
+
+  for (; width > count; width--) {
+    *out++ = ' ';
+  }
+
+  while (count > 0) {
+    *out++ = digits[--count];
+  }
+
+  return out;
+}
+
+/**
+ * @brief writes a padded string, same as printf("%*s") or printf("%-*s")
+ *
+ * @param out the place to write to
+ * @param string the string
+ * @param width the minimum width, padded with spaces
+ * @param left whether to align to the left
+ *
+ * @returns the end of the written string
+ */
+char *do_format_string(char *out, char *string, int width, int left) {
+  size_t length = strlen(string);
+  int padding = (size_t)width > length ? width - (int)length : 0;
+
+  if (!left) {
+    memset(out, ' ', (size_t)padding);
+    out += padding;
+  }
+
+  memcpy(out, string, length);
+  out += length;
+
+  if (left) {
+    memset(out, ' ', (size_t)padding);
+    out += padding;
+  }
+
+  return out;
+}
+
+/**
+ * @brief writes out and frees the output buffer of the thread
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_free_output(void) {
+  int status = do_flush();
+
+  free(output.buffer);
+  output.buffer = NULL;
+  output.length = 0;
+  output.capacity = 0;
+
+  return status;
+}
+
+/**
+ * @brief prints out the path
+ *
+ * @param path the path to be processed
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_print(char *path) {
+  struct iovec parts[2];
+
+  parts[0].iov_base = path;
+  parts[0].iov_len = strlen(path);
+  parts[1].iov_base = "\n";
+  parts[1].iov_len = 1;
+
+  return do_write(parts, 2);
+}
+
+/**
+ * @brief prints out the path, terminated by a null character
+ *
+ * @param path the path to be processed
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_print0(char *path) {
+  struct iovec parts[1];
+
+  /* the terminating null character of the string is the separator */
+  parts[0].iov_base = path;
+  parts[0].iov_len = strlen(path) + 1;
+
+  return do_write(parts, 1);
+}
+
+/**
+ * @brief prints out the path with details, formatted directly into the output buffer
+ *
+ * @param path the path to be processed
+ * @param attr the entry attributes from lstat
+ * @param target the symlink target if already known, read with readlink otherwise
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_ls(char *path, struct stat attr, char *target) {
+  unsigned long long blocks = S_ISLNK(attr.st_mode) ? 0 : (unsigned long long)attr.st_blocks / 2;
+  char *perms = do_get_perms(attr);
+  char *user = do_get_user(attr);
+  char *group = do_get_group(attr);
+  char *mtime = do_get_mtime(attr);
+  char *s = target ? target : do_get_symlink(path, attr);
+  size_t path_length = strlen(path);
+  size_t symlink_length = s ? strlen(s) : 0;
+  char *out;
+
+  /* 4 numbers of up to 20 digits, the strings and the separators */
+  out = do_reserve(4 * 20 + 10 + strlen(user) + strlen(group) + 16 + 16 + 12 + path_length + 4 +
+                   symlink_length + 1);
+
+  if (!out) {
+    if (s != target) {
+      free(s);
+    }
+    return EXIT_FAILURE;
+  }
+
+  /* same as "%6lu %4lld %10s %3lu %-8s %-8s %8lld %12s %s%s%s\n" */
+  out = do_format_number(out, attr.st_ino, 6);
+  *out++ = ' ';
+  out = do_format_number(out, blocks, 4);
+  *out++ = ' ';
+  out = do_format_string(out, perms, 10, 0);
+  *out++ = ' ';
+  out = do_format_number(out, attr.st_nlink, 3);
+  *out++ = ' ';
+  out = do_format_string(out, user, 8, 1);
+  *out++ = ' ';
+  out = do_format_string(out, group, 8, 1);
+  *out++ = ' ';
+  out = do_format_number(out, (unsigned long long)attr.st_size, 8);
+  *out++ = ' ';
+  out = do_format_string(out, mtime, 12, 0);
+  *out++ = ' ';
+  memcpy(out, path, path_length);
+  out += path_length;
+
+  if (s) {
+    memcpy(out, " -> ", 4);
+    memcpy(out + 4, s, symlink_length);
+    out += 4 + symlink_length;
+    if (s != target) {
+      free(s);
+    }
+  }
+
+  *out++ = '\n';
+
+  return do_commit(out);
+}
+
+/**
+ * @brief parses a -printf format into literal parts and directives like in GNU find;
+ * unknown escapes and directives are printed as they are after a warning
+ *
+ * @param string the format
+ *
+ * @returns the parsed format, NULL on errors
+ */
+format_t *do_parse_format(char *string) {
+  size_t length = strlen(string);
+  format_t *format;
+  char *text; /* the end of the literal texts */
+  char *c = string;
+
+  /* the literals are never longer than the format itself */
+  if (!(format = calloc(1, sizeof(*format))) ||
+      !(format->parts = calloc(length + 1, sizeof(*format->parts))) ||
+      !(format->texts = malloc(length + 1))) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+    do_free_format(format);
+    return NULL;
+  }
+
+  format->needs = NEED_NAME;
+  text = format->texts;
+
+  while (*c) {
+    directive_t *part = &format->parts[format->count];
+    char *start = c;
+    char byte;
+    char *bytes = &byte;
+    size_t count = 1;
+
+    if (*c == '\\') {
+      c += 2;
+      switch (start[1]) {
+      case 'a':
+        byte = '\a';
+        break;
+      case 'b':
+        byte = '\b';
+        break;
+      case 'f':
+        byte = '\f';
+        break;
+      case 'n':
+        byte = '\n';
+        break;
+      case 'r':
+        byte = '\r';
+        break;
+      case 't':
+        byte = '\t';
+        break;
+      case 'v':
+        byte = '\v';
+        break;
+      case '\\':
+        byte = '\\';
+        break;
+      case 'c':
+        return format; /* stops the output of the format */
+      case '0':
+      case '1':
+      case '2':
+      case '3':
+      case '4':
+      case '5':
+      case '6':
+      case '7':
+        byte = (char)(start[1] - '0');
+        for (; c < start + 4 && *c >= '0' && *c <= '7'; c++) {
+          byte = (char)(byte * 8 + *c - '0');
+        }
+        break;
+      case '\0':
+        c = start + 1;
+        bytes = start;
+        break;
+      default:
+        fprintf(stderr, "%s: warning: unrecognized escape `\\%c'\n", program_name, start[1]);
+        bytes = start;
+        count = 2;
+      }
+    } else if (*c == '%' && c[1] == '%') {
+      c += 2;
+      bytes = start;
+    } else if (*c == '%') {
+      directive_t directive = {0, 0, 0, 0, 0, -1, NULL, 0};
+
+      for (c++; *c && strchr("-+ #0", *c); c++) {
+        directive.left |= *c == '-';
+        directive.alternate |= *c == '#';
+      }
+      for (; *c >= '0' && *c <= '9'; c++) {
+        directive.width = directive.width < 65536 ? directive.width * 10 + *c - '0' : 65536;
+      }
+      if (*c == '.') {
+        for (directive.precision = 0, c++; *c >= '0' && *c <= '9'; c++) {
+          directive.precision =
+              directive.precision < 65536 ? directive.precision * 10 + *c - '0' : 65536;
+        }
+      }
+
+      directive.kind = *c;
+
+      if (*c && strchr("ACT", *c) && c[1] &&
+          strchr("@aAbBcdDeFgGhHIjklmMnprRsStTuUVwWxXyYzZ+", c[1])) {
+        directive.time = c[1];
+        c += 2;
+      } else if (*c && strchr("abcdDfgGhHiklmMnpPstuUy", *c)) {
+        /* %a, %c and %t are the times in the layout of ctime */
+        directive.kind = *c == 'a' ? 'A' : *c == 'c' ? 'C' : *c == 't' ? 'T' : *c;
+        c++;
+      } else {
+        c += *c ? 1 : 0;
+        fprintf(stderr, "%s: warning: unrecognized format directive `%.*s'\n", program_name,
+                (int)(c - start), start);
+        bytes = start;
+        count = (size_t)(c - start);
+        directive.kind = 0;
+      }
+
+      if (directive.kind) {
+        *part = directive;
+        format->count++;
+
+        /* the strings are measured for each entry, the rest fits into a field */
+        format->size += (size_t)directive.width;
+        if (!strchr("pfhHPugl", directive.kind)) {
+          format->size += FORMAT_FIELD;
+        }
+
+        if (directive.kind == 'y') {
+          format->needs |= NEED_TYPE;
+        } else if (directive.kind == 'u' || directive.kind == 'g') {
+          format->needs |= NEED_OWNER;
+        } else if (!strchr("pfhHPd", directive.kind)) {
+          format->needs |= NEED_STAT;
+        }
+
+#ifdef STATX_BASIC_STATS
+        switch (directive.kind) {
+        case 's':
+          format->mask |= STATX_SIZE;
+          break;
+        case 'b':
+        case 'k':
+          format->mask |= STATX_BLOCKS;
+          break;
+        case 'n':
+          format->mask |= STATX_NLINK;
+          break;
+        case 'i':
+          format->mask |= STATX_INO;
+          break;
+        case 'u':
+        case 'U':
+          format->mask |= STATX_UID;
+          break;
+        case 'g':
+        case 'G':
+          format->mask |= STATX_GID;
+          break;
+        case 'A':
+          format->mask |= STATX_ATIME;
+          break;
+        case 'C':
+          format->mask |= STATX_CTIME;
+          break;
+        case 'T':
+          format->mask |= STATX_MTIME;
+          break;
+        }
+#endif
+        continue;
+      }
+    } else {
+      c++;
+      bytes = start;
+    }
+
+    /* the literal text is appended to the previous literal part */
+    if (format->count == 0 || part[-1].kind) {
+      part->text = text;
+      format->count++;
+    } else {
+      part--;
+    }
+    memcpy(text, bytes, count);
+    text += count;
+    part->length += count;
+    format->size += count;
+  }
+
+  return format;
+}
+
+/**
+ * @brief prints out the entry in a -printf format, rendered directly into the output buffer
+ *
+ * @param format the parsed format
+ * @param entry the entry, with the attributes if the format needs them
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_printf(format_t *format, entry_t *entry) {
+  struct stat *attr = &entry->attr;
+  char *path = entry->path;
+  size_t path_length = strlen(path);
+  size_t size = format->size;
+  char *user = NULL;
+  char *group = NULL;
+  char *target = NULL;
+  int has_target = 0;
+  size_t end = path_length;
+  size_t base;
+  size_t root = entry->root;
+  char field[FORMAT_FIELD];
+  char *out;
+  size_t i;
+
+  /*
+   * %h and %f split at the last slash which doesn't end the path, like in GNU find;
+   * %f keeps one of the trailing slashes
+   */
+  while (end > 0 && path[end - 1] == '/') {
+    end--;
+  }
+  for (base = end; base > 0 && path[base - 1] != '/'; base--) {
+  }
+
+  /* %H is the location as given, %P the rest without the slash between them */
+  if (entry->depth > 0 && path[root] == '/') {
+    root++;
+  }
+
+  for (i = 0; i < format->count; i++) {
+    switch (format->parts[i].kind) {
+    case 'p':
+    case 'f':
+    case 'h':
+    case 'H':
+    case 'P':
+      size += path_length + 1;
+      break;
+    case 'u':
+      user = do_get_user(*attr);
+      size += strlen(user);
+      break;
+    case 'g':
+      group = do_get_group(*attr);
+      size += strlen(group);
+      break;
+    case 'l':
+      if (!has_target) {
+        target = entry->index ? do_index_target(entry->index, entry->record)
+                              : do_get_symlink(path, *attr);
+        has_target = 1;
+        size += target ? strlen(target) : 0;
+      }
+      break;
+    }
+  }
+
+  if (!(out = do_reserve(size))) {
+    if (target && !entry->index) {
+      free(target);
+    }
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < format->count; i++) {
+    directive_t *part = &format->parts[i];
+    char *value = field;
+    size_t length = 0;
+    unsigned long long number = 0;
+    unsigned int mode;
+
+    switch (part->kind) {
+    case 0:
+      memcpy(out, part->text, part->length);
+      out += part->length;
+      continue;
+    case 'p':
+      value = path;
+      length = path_length;
+      break;
+    case 'f':
+      value = end > 0 ? path + base : "/";
+      length = end > 0 ? end - base + (end < path_length) : 1;
+      break;
+    case 'h':
+      value = end == 0 ? "/" : base == 0 ? "." : path;
+      length = end == 0 ? path_length > 1 : base == 0 ? 1 : base - 1;
+      break;
+    case 'H':
+      value = path;
+      length = entry->root;
+      break;
+    case 'P':
+      value = path + root;
+      length = path_length - root;
+      break;
+    case 'u':
+      value = user;
+      length = strlen(user);
+      break;
+    case 'g':
+      value = group;
+      length = strlen(group);
+      break;
+    case 'l':
+      value = target ? target : "";
+      length = strlen(value);
+      break;
+    case 'M':
+      value = do_get_perms(*attr);
+      length = 10;
+      break;
+    case 'y':
+      field[0] = do_get_entry_type(entry);
+      length = 1;
+      break;
+    case 'm':
+      /* the permission bits in octal, '#' adds a leading 0 */
+      mode = attr->st_mode & 07777;
+      value = field + FORMAT_FIELD;
+      do {
+        *--value = (char)('0' + mode % 8);
+        mode /= 8;
+      } while (mode > 0);
+      if (part->alternate && *value != '0') {
+        *--value = '0';
+      }
+      length = (size_t)(field + FORMAT_FIELD - value);
+      break;
+    case 'A':
+      length = do_format_time(field, attr->st_atim, part->time);
+      break;
+    case 'C':
+      length = do_format_time(field, attr->st_ctim, part->time);
+      break;
+    case 'T':
+      length = do_format_time(field, attr->st_mtim, part->time);
+      break;
+    default:
+      switch (part->kind) {
+      case 'd':
+        number = (unsigned long long)entry->depth;
+        break;
+      case 's':
+        number = (unsigned long long)attr->st_size;
+        break;
+      case 'b':
+        number = (unsigned long long)attr->st_blocks;
+        break;
+      case 'k':
+        number = ((unsigned long long)attr->st_blocks + 1) / 2;
+        break;
+      case 'n':
+        number = (unsigned long long)attr->st_nlink;
+        break;
+      case 'i':
+        number = (unsigned long long)attr->st_ino;
+        break;
+      case 'D':
+        number = (unsigned long long)attr->st_dev;
+        break;
+      case 'U':
+        number = attr->st_uid;
+        break;
+      case 'G':
+        number = attr->st_gid;
+        break;
+      }
+      length = (size_t)(do_format_number(field, number, 0) - field);
+    }
+
+    /* like in GNU find, the precision cuts off strings */
+    if (part->precision >= 0 && strchr("pfhHPuglM", part->kind) &&
+        length > (size_t)part->precision) {
+      length = (size_t)part->precision;
+    }
+
+    out = do_format_field(out, value, length, part);
+  }
+
+  if (target && !entry->index) {
+    free(target);
+  }
+
+  return do_commit(out);
+}
+
+/**
+ * @brief writes a value padded to the width of a -printf directive
+ *
+ * @param out the place to write to
+ * @param value the value, not terminated
+ * @param length the length of the value
+ * @param part the directive with the width and the alignment
+ *
+ * @returns the end of the written value
+ */
+char *do_format_field(char *out, char *value, size_t length, directive_t *part) {
+  size_t padding = (size_t)part->width > length ? (size_t)part->width - length : 0;
+
+  if (!part->left) {
+    memset(out, ' ', padding);
+    out += padding;
+  }
+
+  memcpy(out, value, length);
+  out += length;
+
+  if (part->left) {
+    memset(out, ' ', padding);
+    out += padding;
+  }
+
+  return out;
+}
+
+/**
+ * @brief writes a time of a -printf directive; '@' are the seconds since the epoch,
+ * the seconds of 'S', 'T', '+' and the ctime layout have a fraction like in GNU find,
+ * the other formats are the ones of strftime
+ *
+ * @param out the place to write to, at least FORMAT_FIELD bytes
+ * @param time the time
+ * @param format the format character, 0 for the layout of ctime
+ *
+ * @returns the length of the written time, 0 if it couldn't be converted
+ */
+size_t do_format_time(char *out, struct timespec time, char format) {
+  char pattern[3] = {'%', format, '\0'};
+  char *layout = pattern;
+  char *end = out;
+  long nanoseconds = time.tv_nsec;
+  struct tm local;
+  int i;
+
+  if (format == '@') {
+    if (time.tv_sec < 0) {
+      *end++ = '-';
+    }
+    end = do_format_number(end, (unsigned long long)(time.tv_sec < 0 ? -time.tv_sec : time.tv_sec),
+                           0);
+  } else {
+    if (!localtime_r(&time.tv_sec, &local)) {
+      return 0;
+    }
+
+    switch (format) {
+    case '\0':
+      layout = "%a %b %e %H:%M:%S";
+      break;
+    case '+':
+      layout = "%Y-%m-%d+%H:%M:%S";
+      break;
+    case 'T':
+      layout = "%H:%M:%S";
+      break;
+    }
+
+    /* room for the fraction and the year */
+    end += strftime(end, FORMAT_FIELD - 20, layout, &local);
+
+    if (format != '\0' && !strchr("ST+", format)) {
+      return (size_t)(end - out);
+    }
+  }
+
+  /* the fraction has 9 digits of nanoseconds and a 0, like in GNU find */
+  *end++ = '.';
+  for (i = 8; i >= 0; i--) {
+    end[i] = (char)('0' + nanoseconds % 10);
+    nanoseconds /= 10;
+  }
+  end[9] = '0';
+  end += 10;
+
+  if (format == '\0') {
+    end += strftime(end, 8, " %Y", &local);
+  }
+
+  return (size_t)(end - out);
+}
+
+/**
+ * @brief frees a parsed -printf format
+ *
+ * @param format the format, may be NULL
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_free_format(format_t *format) {
+
+  if (format) {
+    free(format->parts);
+    free(format->texts);
+    free(format);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief checks if the type matches the entry
+ *
+ * @param type the type to match against
+ * @param entry the entry, the directory entry type is used if known
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_type(char type, entry_t *entry) {
+
+  /* comparing two chars */
+  if (type == do_get_entry_type(entry)) {
+    return EXIT_SUCCESS;
+  }
+
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief checks if the entry doesn't have a user
+ *
+ * @param attr the entry attributes from lstat
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_nouser(struct stat attr) {
+
+  if (!do_get_id(&users, attr.st_uid, 0)->exists) {
+    return EXIT_SUCCESS;
+  }
+
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief checks if the userid matches the entry attribute
+ *
+ * @param userid the uid to match against
+ * @param attr the entry attributes from lstat
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_user(unsigned int userid, struct stat attr) {
+
+  if (userid == attr.st_uid) {
+    return EXIT_SUCCESS;
+  }
+
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief checks the size of the entry, rounded up to whole units like in GNU find
+ *
+ * @param insn the instruction with the comparison, the number of units and the unit
+ * @param attr the entry attributes
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_size(insn_t *insn, struct stat attr) {
+  long long units = ((long long)attr.st_size + insn->unit - 1) / insn->unit;
+
+  if (insn->cmp == '+' ? units > insn->number
+                       : insn->cmp == '-' ? units < insn->number : units == insn->number) {
+    return EXIT_SUCCESS;
+  }
+
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief checks the modification time of the entry against the reference time:
+ * '+' before it, '-' after it, otherwise within the window starting at it
+ *
+ * @param insn the instruction with the comparison, the window in seconds and the reference time
+ * @param attr the entry attributes
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_time(insn_t *insn, struct stat attr) {
+  struct timespec *time = &attr.st_mtim;
+  int before = time->tv_sec < insn->time.tv_sec ||
+               (time->tv_sec == insn->time.tv_sec && time->tv_nsec < insn->time.tv_nsec);
+  int after = time->tv_sec > insn->time.tv_sec ||
+              (time->tv_sec == insn->time.tv_sec && time->tv_nsec > insn->time.tv_nsec);
+  int within = !before && (time->tv_sec - insn->time.tv_sec < insn->number ||
+                           (time->tv_sec - insn->time.tv_sec == insn->number &&
+                            time->tv_nsec < insn->time.tv_nsec));
+
+  if (insn->cmp == '+' ? before : insn->cmp == '-' ? after : within) {
+    return EXIT_SUCCESS;
+  }
+
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief checks the permission bits of the entry: exactly the mode,
+ * '-' all of its bits or '/' any of them (always true for 0)
+ *
+ * @param insn the instruction with the comparison and the mode
+ * @param attr the entry attributes
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_perm(insn_t *insn, struct stat attr) {
+  long long mode = attr.st_mode & 07777;
+
+  if (insn->cmp == '-' ? (mode & insn->number) == insn->number
+                       : insn->cmp == '/' ? insn->number == 0 || (mode & insn->number)
+                                          : mode == insn->number) {
+    return EXIT_SUCCESS;
+  }
+
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief checks if a regular file contains the string; small files are read with pread
+ * into a buffer on the stack, large ones are mapped, the search stops at the first hit
+ *
+ * @param insn the instruction with the string
+ * @param entry the entry, its attributes are read for the type and the size
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if it doesn't contain the string or can't be read
+ */
+int do_contains(insn_t *insn, entry_t *entry) {
+  char buffer[CONTAINS_BUFFER];
+  struct stat *attr;
+  struct stat current;
+  size_t kept = 0;
+  off_t offset = 0;
+  ssize_t got;
+  char *call = "pread";
+  int found = 0;
+  int fd;
+
+  if (!(attr = do_get_attr(entry)) || !S_ISREG(attr->st_mode)) {
+    return EXIT_FAILURE;
+  }
+
+  /* like grep -l '', the empty string is in every file with content, size 0 ones are read */
+  if (insn->length == 0 && attr->st_size > 0) {
+    return EXIT_SUCCESS;
+  }
+
+  STATS_BEGIN(PHASE_CONTENT);
+
+  /* the records of an index have no open directory */
+  fd = entry->index ? open(entry->path, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)
+                    : openat(entry->parent, entry->name,
+                             O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+  if (fd < 0) {
+    call = "open";
+    got = -1;
+  } else if (attr->st_size >= CONTAINS_MMAP || insn->length > CONTAINS_BUFFER / 2) {
+    void *data = MAP_FAILED;
+
+    /* the size of the opened file, it may have been truncated since it was checked */
+    call = "mmap";
+    got = 0;
+    if (fstat(fd, &current) != 0) {
+      call = "fstat";
+      got = -1;
+    } else if (current.st_size > 0 &&
+               (data = mmap(NULL, (size_t)current.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+                   MAP_FAILED) {
+      got = -1;
+    } else if (current.st_size > 0) {
+      madvise(data, (size_t)current.st_size, MADV_SEQUENTIAL);
+      found = do_search(data, (size_t)current.st_size, insn) != NULL;
+      munmap(data, (size_t)current.st_size);
+    }
+  } else {
+    /* the last length - 1 bytes of a chunk are kept, a match may span two chunks */
+    while ((got = pread(fd, buffer + kept, sizeof(buffer) - kept, offset)) > 0 ||
+           (got < 0 && errno == EINTR)) {
+      if (got < 0) {
+        continue;
+      }
+      offset += got;
+      kept += (size_t)got;
+      if (insn->length == 0 || do_search(buffer, kept, insn)) {
+        found = 1;
+        break;
+      }
+      if (insn->length > 1 && kept >= insn->length - 1) {
+        memmove(buffer, buffer + kept - (insn->length - 1), insn->length - 1);
+        kept = insn->length - 1;
+      } else if (insn->length <= 1) {
+        kept = 0;
+      }
+    }
+  }
+
+  if (got < 0) {
+    fprintf(stderr, "%s: %s(%s): %s\n", program_name, call, entry->path, strerror(errno));
+    STATS_COUNT(errors);
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  STATS_END(PHASE_CONTENT);
+
+  return found ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief finds the string of -contains in a buffer; memchr looks for its rarest byte,
+ * it is vectorized in the C library, and memcmp checks the rest around it
+ *
+ * @param data the buffer
+ * @param length the length of the buffer
+ * @param insn the instruction with the string
+ *
+ * @returns the first occurrence, NULL if there is none
+ */
+char *do_search(char *data, size_t length, insn_t *insn) {
+  char *end;
+  char *candidate;
+
+  if (insn->length == 0) {
+    return data;
+  }
+  if (length < insn->length) {
+    return NULL;
+  }
+
+  /* the candidates for the guard byte, the string has to fit around them */
+  candidate = data + insn->guard;
+  end = data + length - (insn->length - insn->guard - 1);
+
+  for (; (candidate = memchr(candidate, insn->text[insn->guard], (size_t)(end - candidate)));
+       candidate++) {
+    if (memcmp(candidate - insn->guard, insn->text, insn->length) == 0) {
+      return candidate - insn->guard;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief chooses the byte of a string memchr looks for; bytes which are rare in text
+ * and binaries (punctuation, upper case, non-ASCII) have fewer false candidates than
+ * spaces, null characters, digits and common lower case letters
+ *
+ * @param text the string
+ *
+ * @returns the position of the byte, 0 for the empty string
+ */
+size_t do_get_guard(char *text) {
+  static char common[] = " \t\n\r0123456789etaoinsrhldcumfpgwybv";
+  size_t best = 0;
+  int best_rank = -1;
+  size_t i;
+
+  for (i = 0; text[i]; i++) {
+    unsigned char c = (unsigned char)text[i];
+    int rank = strchr(common, c) ? 0 : (c >= 'a' && c <= 'z') ? 1 : 2;
+
+    if (rank > best_rank) {
+      best = i;
+      best_rank = rank;
+    }
+  }
+
+  return best;
+}
+
+/**
+ * @brief checks if the filename matches the pattern
+ *
+ * @param name the entry name, the last component of the path
+ * @param matcher the compiled pattern to match against
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_name(char *name, matcher_t *matcher) {
+  STATS_BEGIN(PHASE_MATCH);
+  int status = do_match(matcher, name, strlen(name));
+  STATS_END(PHASE_MATCH);
+
+  return status;
+}
+
+/**
+ * @brief checks if the path matches the pattern
+ *
+ * @param path the entry path
+ * @param matcher the compiled pattern to match against
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_path(char *path, matcher_t *matcher) {
+  STATS_BEGIN(PHASE_MATCH);
+  int status = do_match(matcher, path, strlen(path));
+  STATS_END(PHASE_MATCH);
+
+  return status;
+}
+
+/**
+ * @brief checks if the filename matches one of the patterns
+ *
+ * @param name the entry name, the last component of the path
+ * @param set the compiled patterns of -name-from
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_names(char *name, patternset_t *set) {
+  STATS_BEGIN(PHASE_MATCH);
+  int status = do_match_set(set, name, strlen(name));
+  STATS_END(PHASE_MATCH);
+
+  return status;
+}
+
+/**
+ * @brief checks if the path matches one of the patterns
+ *
+ * @param path the entry path
+ * @param set the compiled patterns of -path-from
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_paths(char *path, patternset_t *set) {
+  STATS_BEGIN(PHASE_MATCH);
+  int status = do_match_set(set, path, strlen(path));
+  STATS_END(PHASE_MATCH);
+
+  return status;
+}
+
+/**
+ * @brief parses the command of -exec or -execdir
+ *
+ * @param argv the command, followed by the terminator
+ * @param argc the number of arguments without the terminator
+ * @param multiple terminated by '+', the last argument is {}
+ * @param dir -execdir
+ *
+ * @returns the command, NULL on errors
+ */
+exec_t *do_new_exec(char **argv, int argc, int multiple, int dir) {
+  exec_t *exec;
+  long limit = sysconf(_SC_ARG_MAX);
+  char **variable;
+  int i;
+
+  if (multiple && argc < 2) {
+    fprintf(stderr, "%s: missing argument to `-exec%s'\n", program_name, dir ? "dir" : "");
+    return NULL;
+  }
+
+  /* the entries are appended at the end, so {} can't appear anywhere else */
+  for (i = 0; multiple && i < argc - 1; i++) {
+    if (strstr(argv[i], "{}")) {
+      fprintf(stderr, "%s: only one instance of {} is supported with -exec%s ... +\n",
+              program_name, dir ? "dir" : "");
+      return NULL;
+    }
+  }
+
+  if (!(exec = calloc(1, sizeof(*exec)))) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+    return NULL;
+  }
+
+  exec->argv = argv;
+  exec->argc = multiple ? argc - 1 : argc;
+  exec->multiple = multiple;
+  exec->dir = dir;
+  exec->fd = -1;
+  pthread_mutex_init(&exec->lock, NULL);
+
+  /* the environment and the command count against ARG_MAX as well, 2048 bytes stay spare */
+  if (limit <= 0) {
+    limit = 131072;
+  }
+  limit -= 2048;
+  for (variable = environ; *variable; variable++) {
+    limit -= (long)(strlen(*variable) + 1 + sizeof(char *));
+  }
+  for (i = 0; i < exec->argc; i++) {
+    limit -= (long)(strlen(argv[i]) + 1 + sizeof(char *));
+  }
+  exec->limit = limit > 4096 ? (size_t)limit : 4096;
+
+  return exec;
+}
+
+/**
+ * @brief runs the command of -exec or -execdir for the entry; with ';' the command runs
+ * right away, with '+' the entry is collected until the arguments reach ARG_MAX
+ *
+ * @param exec the command
+ * @param entry the entry
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if the command failed or couldn't be started
+ */
+int do_exec(exec_t *exec, entry_t *entry) {
+  char *path = entry->path;
+  char *name = entry->base;
+  size_t length = strlen(name);
+  size_t end;
+  int slash = 0;
+  char **argv;
+  int status = EXIT_FAILURE;
+  int fd = -1;
+  int i;
+
+  /* a location keeps one trailing slash and the root stays "/", like GNU find */
+  if (exec->dir && entry->depth == 0 && entry->parent == AT_FDCWD) {
+    end = do_trim_slashes(entry->path, strlen(entry->path));
+    for (length = 0; length < end && entry->path[end - length - 1] != '/'; length++) {
+    }
+    name = entry->path + end - length;
+    slash = entry->path[end] == '/';
+  }
+
+  /* -execdir passes the name relative to the directory */
+  if (exec->dir && length == 0) {
+    path = "/";
+  } else if (exec->dir) {
+    if (!(path = malloc(length + 4))) {
+      fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    memcpy(path, "./", 2);
+    memcpy(path + 2, name, length);
+    strcpy(path + 2 + length, slash ? "/" : "");
+  }
+
+  if (exec->multiple) {
+    status = do_exec_collect(exec, entry, path);
+  } else if (!(argv = calloc((size_t)exec->argc + 1, sizeof(*argv)))) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+  } else {
+    for (i = 0; i < exec->argc && (argv[i] = do_exec_replace(exec->argv[i], path)); i++) {
+    }
+
+    if (i == exec->argc && (!exec->dir || (fd = do_exec_dir(entry)) >= 0)) {
+      status = do_exec_run(argv, fd, 1);
+    }
+
+    while (i-- > 0) {
+      if (argv[i] != exec->argv[i]) {
+        free(argv[i]);
+      }
+    }
+    free(argv);
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (path != entry->path && length > 0) {
+    free(path);
+  }
+
+  return status;
+}
+
+/**
+ * @brief replaces every {} in an argument with the path, like GNU find also inside words
+ *
+ * @param arg the argument
+ * @param path the path
+ *
+ * @returns the argument itself if it contains no {}, a new string otherwise, NULL on errors
+ */
+char *do_exec_replace(char *arg, char *path) {
+  size_t length = strlen(path);
+  size_t count = 0;
+  char *found;
+  char *result;
+  char *out;
+
+  for (found = strstr(arg, "{}"); found; found = strstr(found + 2, "{}")) {
+    count++;
+  }
+
+  if (count == 0) {
+    return arg;
+  }
+
+  if (!(result = malloc(strlen(arg) - 2 * count + length * count + 1))) {
+    fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+    return NULL;
+  }
+
+  for (out = result; (found = strstr(arg, "{}")); arg = found + 2) {
+    memcpy(out, arg, (size_t)(found - arg));
+    out += found - arg;
+    memcpy(out, path, length);
+    out += length;
+  }
+  strcpy(out, arg);
+
+  return result;
+}
+
+/**
+ * @brief opens the directory of the entry for -execdir
+ *
+ * @param entry the entry
+ *
+ * @returns the descriptor, -1 on errors
+ */
+int do_exec_dir(entry_t *entry) {
+  size_t length;
+  char *directory;
+  int fd;
+
+  /* the entries of a traversal have their directory open already */
+  if (entry->parent != AT_FDCWD) {
+    if ((fd = fcntl(entry->parent, F_DUPFD_CLOEXEC, 0)) < 0) {
+      fprintf(stderr, "%s: fcntl(%s): %s\n", program_name, entry->path, strerror(errno));
+    }
+    return fd;
+  }
+
+  /* locations and records of an index: the path without its last component */
+  length = do_trim_slashes(entry->path, strlen(entry->path));
+  while (length > 0 && entry->path[length - 1] != '/') {
+    length--;
+  }
+
+  if (!(directory = length > 0 ? strndup(entry->path, length) : strdup("."))) {
+    fprintf(stderr, "%s: strndup(): %s\n", program_name, strerror(errno));
+    return -1;
+  }
+
+  if ((fd = open(directory, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    fprintf(stderr, "%s: open(%s): %s\n", program_name, directory, strerror(errno));
+  }
+
+  free(directory);
+
+  return fd;
+}
+
+/**
+ * @brief adds the entry to the collected entries of -exec ... +, running the command
+ * first if the entry doesn't fit or, with -execdir, is in another directory
+ *
+ * @param exec the command
+ * @param entry the entry
+ * @param path the path passed to the command
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_exec_collect(exec_t *exec, entry_t *entry, char *path) {
+  size_t length = strlen(path);
+  size_t directory = strlen(entry->path) - strlen(entry->base);
+  int status = EXIT_SUCCESS;
+
+  pthread_mutex_lock(&exec->lock);
+
+  /* -execdir runs the command once per directory, which the path prefix identifies */
+  if (exec->dir && exec->count > 0 &&
+      (directory != exec->directory.length ||
+       memcmp(entry->path, exec->directory.buffer, directory) != 0)) {
+    do_exec_flush(exec);
+  }
+
+  if (exec->count > 0 && exec->size + length + 1 + sizeof(char *) > exec->limit) {
+    do_exec_flush(exec);
+  }
+
+  if (exec->dir && exec->count == 0) {
+    if (do_pathbuf_reserve(&exec->directory, directory + 1) != EXIT_SUCCESS ||
+        (exec->fd = do_exec_dir(entry)) < 0) {
+      status = EXIT_FAILURE;
+    } else {
+      memcpy(exec->directory.buffer, entry->path, directory);
+      exec->directory.length = directory;
+    }
+  }
+
+  if (status == EXIT_SUCCESS &&
+      do_pathbuf_reserve(&exec->names, exec->names.length + length + 1) == EXIT_SUCCESS) {
+    memcpy(exec->names.buffer + exec->names.length, path, length + 1);
+    exec->names.length += length + 1;
+    exec->size += length + 1 + sizeof(char *);
+    exec->count++;
+  } else {
+    status = EXIT_FAILURE;
+  }
+
+  pthread_mutex_unlock(&exec->lock);
+
+  /* like in GNU find, -exec ... + is true, a failure affects the exit status only */
+  if (status != EXIT_SUCCESS) {
+    __atomic_store_n(&exec_failed, 1, __ATOMIC_RELAXED);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief runs the command of -exec ... + with the collected entries;
+ * called with the lock of the command held
+ *
+ * @param exec the command
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_exec_flush(exec_t *exec) {
+  char **argv;
+  char *name;
+  size_t i;
+  int status = EXIT_FAILURE;
+
+  if (exec->count == 0) {
+    return EXIT_SUCCESS;
+  }
+
+  if (!(argv = malloc(sizeof(*argv) * ((size_t)exec->argc + exec->count + 1)))) {
+    fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+  } else {
+    memcpy(argv, exec->argv, sizeof(*argv) * (size_t)exec->argc);
+    for (i = 0, name = exec->names.buffer; i < exec->count; i++, name += strlen(name) + 1) {
+      argv[(size_t)exec->argc + i] = name;
+    }
+    argv[(size_t)exec->argc + exec->count] = NULL;
+
+    /* the arguments are copied by the exec, the buffer may be reused right away */
+    status = do_exec_run(argv, exec->fd, options.exec_jobs == 0);
+    free(argv);
+  }
+
+  exec->names.length = 0;
+  exec->count = 0;
+  exec->size = 0;
+  if (exec->fd >= 0) {
+    close(exec->fd);
+    exec->fd = -1;
+  }
+
+  if (status != EXIT_SUCCESS) {
+    __atomic_store_n(&exec_failed, 1, __ATOMIC_RELAXED);
+  }
+
+  return status;
+}
+
+/**
+ * @brief runs the commands of all -exec ... + with their collected entries
+ *
+ * @param program the compiled expression
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_exec_flush_all(program_t *program) {
+  int status = EXIT_SUCCESS;
+  int i;
+
+  for (i = 0; i < program->count; i++) {
+    exec_t *exec = program->code[i].exec;
+
+    if (program->code[i].op == OP_EXEC && exec->multiple) {
+      pthread_mutex_lock(&exec->lock);
+      if (do_exec_flush(exec) != EXIT_SUCCESS) {
+        status = EXIT_FAILURE;
+      }
+      pthread_mutex_unlock(&exec->lock);
+    }
+  }
+
+  return status;
+}
+
+/**
+ * @brief starts a command with posix_spawnp, for -execdir in the directory
+ *
+ * @param argv the command and its arguments
+ * @param fd the working directory of the command, -1 for the current one
+ * @param wait wait for the command, otherwise it becomes one of the -exec-jobs
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if the command couldn't be started or failed
+ */
+int do_exec_run(char **argv, int fd, int wait) {
+  posix_spawn_file_actions_t actions;
+  pid_t pid;
+  int saved = errno;
+  int error;
+
+  /* the output of the command follows the entries printed before */
+  if (do_flush() != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  if ((error = posix_spawn_file_actions_init(&actions)) != 0) {
+    fprintf(stderr, "%s: posix_spawn_file_actions_init(): %s\n", program_name, strerror(error));
+    return EXIT_FAILURE;
+  }
+
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDFCHDIR_NP
+  if (fd >= 0 && (error = posix_spawn_file_actions_addfchdir_np(&actions, fd)) != 0) {
+    fprintf(stderr, "%s: posix_spawn_file_actions_addfchdir_np(): %s\n", program_name,
+            strerror(error));
+    posix_spawn_file_actions_destroy(&actions);
+    return EXIT_FAILURE;
+  }
+  error = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+#else
+  /* without the glibc 2.29 extension the child changes the directory itself */
+  if (fd >= 0) {
+    if ((pid = fork()) == 0) {
+      if (fchdir(fd) == 0) {
+        execvp(argv[0], argv);
+      }
+      fprintf(stderr, "%s: execvp(%s): %s\n", program_name, argv[0], strerror(errno));
+      _exit(127);
+    }
+    error = pid < 0 ? errno : 0;
+  } else {
+    error = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+  }
+#endif
+  posix_spawn_file_actions_destroy(&actions);
+
+  /*
+   * the search through PATH leaves ENOENT behind even if the command was found;
+   * a failure is only reported through the status, -exec ... ; is just false then
+   */
+  errno = saved;
+
+  if (error != 0) {
+    fprintf(stderr, "%s: posix_spawnp(%s): %s\n", program_name, argv[0], strerror(error));
+    return EXIT_FAILURE;
+  }
+
+  return wait ? do_exec_wait(pid) : do_exec_job(pid);
+}
+
+/**
+ * @brief waits for a command
+ *
+ * @param pid the command
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if it didn't exit with 0
+ */
+int do_exec_wait(pid_t pid) {
+  int status;
+
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      fprintf(stderr, "%s: waitpid(): %s\n", program_name, strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief adds a command to the running -exec-jobs; if all are taken,
+ * a finished one is reaped or else the oldest one is waited for
+ *
+ * @param pid the command
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_exec_job(pid_t pid) {
+  unsigned int i;
+  int status;
+
+  pthread_mutex_lock(&exec_lock);
+
+  if (!exec_jobs && !(exec_jobs = calloc(options.exec_jobs, sizeof(*exec_jobs)))) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+    pthread_mutex_unlock(&exec_lock);
+    return do_exec_wait(pid);
+  }
+
+  while (exec_running == options.exec_jobs) {
+    for (i = 0; i < exec_running; i++) {
+      if (waitpid(exec_jobs[i], &status, WNOHANG) == exec_jobs[i]) {
+        break;
+      }
+    }
+
+    if (i == exec_running) {
+      i = 0;
+      if (do_exec_wait(exec_jobs[0]) != EXIT_SUCCESS) {
+        exec_failed = 1;
+      }
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      exec_failed = 1;
+    }
+
+    memmove(exec_jobs + i, exec_jobs + i + 1, sizeof(*exec_jobs) * (exec_running - i - 1));
+    exec_running--;
+  }
+
+  exec_jobs[exec_running++] = pid;
+
+  pthread_mutex_unlock(&exec_lock);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief runs the commands of all -exec ... + with the rest of their entries
+ * and waits for the running -exec-jobs
+ *
+ * @param program the compiled expression
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if a command of -exec ... + failed
+ */
+int do_exec_finish(program_t *program) {
+
+  do_exec_flush_all(program);
+
+  pthread_mutex_lock(&exec_lock);
+  while (exec_running > 0) {
+    if (do_exec_wait(exec_jobs[--exec_running]) != EXIT_SUCCESS) {
+      exec_failed = 1;
+    }
+  }
+  free(exec_jobs);
+  exec_jobs = NULL;
+  pthread_mutex_unlock(&exec_lock);
+
+  return exec_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * @brief frees a command of -exec or -execdir
+ *
+ * @param exec the command, may be NULL
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_free_exec(exec_t *exec) {
+
+  if (!exec) {
+    return EXIT_SUCCESS;
+  }
+
+  if (exec->fd >= 0) {
+    close(exec->fd);
+  }
+  pthread_mutex_destroy(&exec->lock);
+  free(exec->names.buffer);
+  free(exec->directory.buffer);
+  free(exec);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief collects a regular file for -dupes; empty files are skipped,
+ * there is nothing to reclaim
+ *
+ * @param entry the entry
+ * @param attr the entry attributes
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_dupes_add(entry_t *entry, struct stat attr) {
+  size_t length = strlen(entry->path);
+  dupe_t *dupe;
+  int status = EXIT_SUCCESS;
+
+  if (!S_ISREG(attr.st_mode) || attr.st_size <= 0) {
+    return EXIT_SUCCESS;
+  }
+
+  pthread_mutex_lock(&dupes.lock);
+
+  if (dupes.count == dupes.capacity) {
+    size_t capacity = dupes.capacity ? dupes.capacity * 2 : 1024;
+    dupe_t *items = realloc(dupes.items, sizeof(*items) * capacity);
+
+    if (!items) {
+      fprintf(stderr, "%s: realloc(): %s\n", program_name, strerror(errno));
+      pthread_mutex_unlock(&dupes.lock);
+      return EXIT_FAILURE;
+    }
+
+    dupes.items = items;
+    dupes.capacity = capacity;
+  }
+
+  if (do_pathbuf_reserve(&dupes.paths, dupes.paths.length + length + 1) != EXIT_SUCCESS) {
+    status = EXIT_FAILURE;
+  } else {
+    dupe = &dupes.items[dupes.count++];
+    memset(dupe, 0, sizeof(*dupe));
+    dupe->size = (uint64_t)attr.st_size;
+    dupe->device = attr.st_dev;
+    dupe->inode = attr.st_ino;
+    dupe->path = dupes.paths.length;
+    memcpy(dupes.paths.buffer + dupes.paths.length, entry->path, length + 1);
+    dupes.paths.length += length + 1;
+  }
+
+  pthread_mutex_unlock(&dupes.lock);
+
+  return status;
+}
+
+/**
+ * @brief prints the groups of duplicate files, the largest files first, each group
+ * followed by an empty line; most files are never read: only those with the size of
+ * another file get their edges hashed, and only those whose edges collide are hashed fully
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if a file couldn't be read or the output failed
+ */
+int do_dupes_finish(void) {
+  dupe_t **list;
+  dupe_t **others = NULL;
+  size_t count = 0;
+  size_t kept;
+  size_t start;
+  size_t i;
+  int status = EXIT_SUCCESS;
+
+  if (dupes.count < 2) {
+    return EXIT_SUCCESS;
+  }
+
+  if (!(list = malloc(sizeof(*list) * dupes.count))) {
+    fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < dupes.count; i++) {
+    list[i] = &dupes.items[i];
+  }
+
+  /* hard links are the same file, the first path found represents it */
+  qsort(list, dupes.count, sizeof(*list), do_compare_inodes);
+
+  for (i = 0; i < dupes.count; i++) {
+    if (count == 0 || list[i]->device != list[count - 1]->device ||
+        list[i]->inode != list[count - 1]->inode) {
+      list[count++] = list[i];
+    }
+  }
+
+  /* only files sharing their size with another file can be duplicates */
+  for (start = 0, kept = 0; start < count; start = i) {
+    for (i = start + 1; i < count && list[i]->size == list[start]->size; i++) {
+    }
+    if (i - start > 1) {
+      memmove(list + kept, list + start, sizeof(*list) * (i - start));
+      kept += i - start;
+    }
+  }
+
+  if (do_dupes_hash(list, kept, 0) != EXIT_SUCCESS) {
+    status = EXIT_FAILURE;
+  }
+
+  /* the same size and the same edges, the larger ones are hashed as a whole */
+  for (i = 0, count = 0; i < kept; i++) {
+    if (!list[i]->failed) {
+      list[count++] = list[i];
+    }
+  }
+
+  qsort(list, count, sizeof(*list), do_compare_hashes);
+
+  for (start = 0, kept = 0; start < count; start = i) {
+    for (i = start + 1; i < count && do_compare_hashes(&list[start], &list[i]) == 0; i++) {
+    }
+    if (i - start > 1) {
+      memmove(list + kept, list + start, sizeof(*list) * (i - start));
+      kept += i - start;
+    }
+  }
+
+  if (do_dupes_hash(list, kept, 1) != EXIT_SUCCESS) {
+    status = EXIT_FAILURE;
+  }
+
+  for (i = 0, count = 0; i < kept; i++) {
+    if (!list[i]->failed) {
+      list[count++] = list[i];
+    }
+  }
+
+  qsort(list, count, sizeof(*list), do_compare_groups);
+
+  /* the files moved out of a group while it is compared, at most all but one */
+  if (count > 0 && !(others = malloc(sizeof(*others) * count))) {
+    fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+    free(list);
+    return EXIT_FAILURE;
+  }
+
+  for (start = 0; start < count && !output_failed; start = i) {
+    for (i = start + 1; i < count && do_compare_hashes(&list[start], &list[i]) == 0; i++) {
+    }
+    if (i - start > 1 && do_dupes_print(list + start, i - start, others) != EXIT_SUCCESS) {
+      status = EXIT_FAILURE;
+    }
+  }
+
+  free(others);
+  free(list);
+
+  return status;
+}
+
+/**
+ * @brief hashes files with several threads, which take one file after the other
+ *
+ * @param items the files
+ * @param count the number of files
+ * @param full the whole files instead of their edges, the small files are skipped
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if a file couldn't be read
+ */
+int do_dupes_hash(dupe_t **items, size_t count, int full) {
+  unsigned int threads = options.threads > 1 ? options.threads : DUPES_THREADS;
+  pthread_t *workers;
+  hashjob_t job;
+  unsigned int started = 0;
+  unsigned int i;
+  int error;
+
+  if (count == 0) {
+    return EXIT_SUCCESS;
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.items = items;
+  job.count = count;
+  job.full = full;
+  pthread_mutex_init(&job.lock, NULL);
+
+  if (threads > count) {
+    threads = (unsigned int)count;
+  }
+
+  if ((workers = calloc(threads, sizeof(*workers)))) {
+    for (i = 0; i < threads; i++, started++) {
+      if ((error = pthread_create(&workers[i], NULL, do_dupes_worker, &job))) {
+        fprintf(stderr, "%s: pthread_create(): %s\n", program_name, strerror(error));
+        break;
+      }
+    }
+  }
+
+  /* without threads the files are hashed here */
+  if (started == 0) {
+    do_dupes_worker(&job);
+  }
+
+  for (i = 0; i < started; i++) {
+    if ((error = pthread_join(workers[i], NULL))) {
+      fprintf(stderr, "%s: pthread_join(): %s\n", program_name, strerror(error));
+      job.failed = 1;
+    }
+  }
+
+  free(workers);
+  pthread_mutex_destroy(&job.lock);
+
+  return job.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * @brief hashes the files of a job until none is left
+ *
+ * @param arg the job
+ *
+ * @returns NULL
+ */
+void *do_dupes_worker(void *arg) {
+  hashjob_t *job = arg;
+  dupe_t *dupe;
+
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    dupe = job->next < job->count ? job->items[job->next++] : NULL;
+    pthread_mutex_unlock(&job->lock);
+
+    if (!dupe) {
+      break;
+    }
+
+    if (do_hash_file(dupe, job->full) != EXIT_SUCCESS) {
+      pthread_mutex_lock(&job->lock);
+      job->failed = 1;
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief hashes the first and the last DUPES_EDGE bytes of a file, or the whole file
+ *
+ * @param dupe the file, its hash is set or it is marked as failed
+ * @param full the whole file
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_hash_file(dupe_t *dupe, int full) {
+  char *path = dupes.paths.buffer + dupe->path;
+  hasher_t hasher;
+  int status;
+  int fd;
+
+  /* the edges of a small file are the whole file */
+  if (full && dupe->size <= 2 * DUPES_EDGE) {
+    return EXIT_SUCCESS;
+  }
+
+  if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+    fprintf(stderr, "%s: open(%s): %s\n", program_name, path, strerror(errno));
+    dupe->failed = 1;
+    return EXIT_FAILURE;
+  }
+
+  do_hasher_init(&hasher);
+
+  if (full || dupe->size <= 2 * DUPES_EDGE) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    status = do_hash_range(fd, &hasher, path, 0, dupe->size);
+  } else {
+    status = do_hash_range(fd, &hasher, path, 0, DUPES_EDGE);
+    if (status == EXIT_SUCCESS) {
+      status = do_hash_range(fd, &hasher, path, (off_t)(dupe->size - DUPES_EDGE), DUPES_EDGE);
+    }
+  }
+
+  close(fd);
+
+  if (status != EXIT_SUCCESS) {
+    dupe->failed = 1;
+    return EXIT_FAILURE;
+  }
+
+  do_hasher_final(&hasher, dupe->hash);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief prints the files of a group with the same hash which are identical byte by byte;
+ * the files differing from the first one are compared again among themselves, so a hash
+ * collision splits the group instead of reporting different files as duplicates
+ *
+ * @param group the files with the same size and hash, in the order of the traversal
+ * @param count the number of files, at least 2
+ * @param others space for count files
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_dupes_print(dupe_t **group, size_t count, dupe_t **others) {
+  size_t same;
+  size_t rest;
+  size_t i;
+  int equal = 0;
+  int status = EXIT_SUCCESS;
+
+  while (count > 1 && !output_failed) {
+    for (i = 1, same = 1, rest = 0; i < count; i++) {
+      if (!group[0]->failed && do_compare_files(group[0], group[i], &equal) != EXIT_SUCCESS) {
+        status = EXIT_FAILURE;
+      }
+      if (group[i]->failed) {
+        continue; /* already reported */
+      }
+      if (!group[0]->failed && equal) {
+        group[same++] = group[i];
+      } else {
+        others[rest++] = group[i];
+      }
+    }
+
+    if (!group[0]->failed && same > 1) {
+      for (i = 0; i < same; i++) {
+        if (do_print(dupes.paths.buffer + group[i]->path) != EXIT_SUCCESS) {
+          status = EXIT_FAILURE;
+        }
+      }
+      if (do_print("") != EXIT_SUCCESS) {
+        status = EXIT_FAILURE;
+      }
+    }
+
+    memcpy(group, others, sizeof(*group) * rest);
+    count = rest;
+  }
+
+  return status;
+}
+
+/**
+ * @brief compares the contents of two files of the same size
+ *
+ * @param first the first file
+ * @param second the second file, marked as failed if it can't be read
+ * @param equal set to whether the contents are the same
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if a file couldn't be read, it is marked as failed
+ */
+int do_compare_files(dupe_t *first, dupe_t *second, int *equal) {
+  char buffers[2][CONTAINS_BUFFER];
+  char *paths[2];
+  dupe_t *files[2];
+  int fds[2];
+  off_t offset = 0;
+  size_t length;
+  int status = EXIT_SUCCESS;
+  int i;
+
+  files[0] = first;
+  files[1] = second;
+  *equal = 1;
+
+  for (i = 0; i < 2; i++) {
+    paths[i] = dupes.paths.buffer + files[i]->path;
+    if ((fds[i] = open(paths[i], O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) <
+        0) {
+      fprintf(stderr, "%s: open(%s): %s\n", program_name, paths[i], strerror(errno));
+      files[i]->failed = 1;
+      if (i == 1) {
+        close(fds[0]);
+      }
+      return EXIT_FAILURE;
+    }
+    posix_fadvise(fds[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  while ((uint64_t)offset < first->size && *equal) {
+    length = first->size - (uint64_t)offset < sizeof(buffers[0])
+                 ? (size_t)(first->size - (uint64_t)offset)
+                 : sizeof(buffers[0]);
+
+    for (i = 0; i < 2 && status == EXIT_SUCCESS; i++) {
+      if (do_read_range(fds[i], buffers[i], paths[i], offset, length) != EXIT_SUCCESS) {
+        files[i]->failed = 1;
+        status = EXIT_FAILURE;
+      }
+    }
+    if (status != EXIT_SUCCESS) {
+      break;
+    }
+
+    *equal = memcmp(buffers[0], buffers[1], length) == 0;
+    offset += (off_t)length;
+  }
+
+  close(fds[0]);
+  close(fds[1]);
+
+  return status;
+}
+
+/**
+ * @brief reads a range of a file completely with pread
+ *
+ * @param fd the file
+ * @param buffer the buffer for the range
+ * @param path the path of the file, for error messages
+ * @param offset the start of the range
+ * @param length the length of the range, the file is expected to be long enough
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if it couldn't be read or is shorter now
+ */
+int do_read_range(int fd, char *buffer, char *path, off_t offset, size_t length) {
+  ssize_t got;
+
+  while (length > 0) {
+    got = pread(fd, buffer, length, offset);
+
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      fprintf(stderr, "%s: pread(%s): %s\n", program_name, path,
+              strerror(got < 0 ? errno : ESTALE)); /* truncated since it was collected */
+      return EXIT_FAILURE;
+    }
+
+    buffer += got;
+    offset += got;
+    length -= (size_t)got;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief hashes a range of a file with pread
+ *
+ * @param fd the file
+ * @param hasher the hash state
+ * @param path the path of the file, for error messages
+ * @param offset the start of the range
+ * @param length the length of the range, the file is expected to be long enough
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if it couldn't be read or is shorter now
+ */
+int do_hash_range(int fd, hasher_t *hasher, char *path, off_t offset, uint64_t length) {
+  unsigned char buffer[CONTAINS_BUFFER];
+  ssize_t got;
+
+  while (length > 0) {
+    got = pread(fd, buffer, length < sizeof(buffer) ? (size_t)length : sizeof(buffer), offset);
+
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      fprintf(stderr, "%s: pread(%s): %s\n", program_name, path,
+              strerror(got < 0 ? errno : ESTALE)); /* truncated since it was collected */
+      return EXIT_FAILURE;
+    }
+
+    do_hasher_update(hasher, buffer, (size_t)got);
+    offset += got;
+    length -= (uint64_t)got;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief orders files by size, device, inode and the order of the traversal, for qsort
+ *
+ * @param a a pointer to the first file
+ * @param b a pointer to the second file
+ *
+ * @returns < 0, 0 or > 0
+ */
+int do_compare_inodes(const void *a, const void *b) {
+  const dupe_t *x = *(dupe_t *const *)a;
+  const dupe_t *y = *(dupe_t *const *)b;
+
+  if (x->size != y->size) {
+    return x->size < y->size ? -1 : 1;
+  }
+  if (x->device != y->device) {
+    return x->device < y->device ? -1 : 1;
+  }
+  if (x->inode != y->inode) {
+    return x->inode < y->inode ? -1 : 1;
+  }
+  return x->path < y->path ? -1 : x->path > y->path;
+}
+
+/**
+ * @brief orders files by size and hash, for qsort; equal files are duplicates
+ *
+ * @param a a pointer to the first file
+ * @param b a pointer to the second file
+ *
+ * @returns < 0, 0 or > 0
+ */
+int do_compare_hashes(const void *a, const void *b) {
+  const dupe_t *x = *(dupe_t *const *)a;
+  const dupe_t *y = *(dupe_t *const *)b;
+
+  if (x->size != y->size) {
+    return x->size < y->size ? -1 : 1;
+  }
+  if (x->hash[0] != y->hash[0]) {
+    return x->hash[0] < y->hash[0] ? -1 : 1;
+  }
+  if (x->hash[1] != y->hash[1]) {
+    return x->hash[1] < y->hash[1] ? -1 : 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief orders the groups of duplicates, the largest files first,
+ * and the files of a group in the order of the traversal, for qsort
+ *
+ * @param a a pointer to the first file
+ * @param b a pointer to the second file
+ *
+ * @returns < 0, 0 or > 0
+ */
+int do_compare_groups(const void *a, const void *b) {
+  const dupe_t *x = *(dupe_t *const *)a;
+  const dupe_t *y = *(dupe_t *const *)b;
+  int order;
+
+  if (x->size != y->size) {
+    return x->size > y->size ? -1 : 1;
+  }
+  if ((order = do_compare_hashes(a, b)) != 0) {
+    return order;
+  }
+  return x->path < y->path ? -1 : x->path > y->path;
+}
+
+/**
+ * @brief frees the files collected by -dupes
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_free_dupes(void) {
+
+  free(dupes.items);
+  free(dupes.paths.buffer);
+  dupes.items = NULL;
+  dupes.paths.buffer = NULL;
+  dupes.count = 0;
+  dupes.capacity = 0;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * the multipliers of the hash, from xxHash
+ */
+#define HASH_PRIME1 0x9e3779b185ebca87ULL
+#define HASH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME3 0x165667b19e3779f9ULL
+#define HASH_PRIME4 0x85ebca77c2b2ae63ULL
+#define HASH_PRIME5 0x27d4eb2f165667c5ULL
+#define HASH_ROTATE(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define HASH_ROUND(acc, input) (HASH_ROTATE((acc) + (input)*HASH_PRIME2, 31) * HASH_PRIME1)
+#define HASH_MIX(x)                                                                               \
+  ((x) ^= (x) >> 33, (x) *= HASH_PRIME2, (x) ^= (x) >> 29, (x) *= HASH_PRIME3, (x) ^= (x) >> 32)
+
+/**
+ * @brief starts a hash
+ *
+ * @param hasher the hash state
+ */
+void do_hasher_init(hasher_t *hasher) {
+
+  memset(hasher, 0, sizeof(*hasher));
+  hasher->lanes[0] = HASH_PRIME1 + HASH_PRIME2;
+  hasher->lanes[1] = HASH_PRIME2;
+  hasher->lanes[3] = 0 - HASH_PRIME1;
+}
+
+/**
+ * @brief adds bytes to a hash; the lanes take one 64-bit word of every stripe each,
+ * which the compiler keeps in registers and interleaves
+ *
+ * @param hasher the hash state
+ * @param data the bytes
+ * @param length the number of bytes
+ */
+void do_hasher_update(hasher_t *hasher, unsigned char *data, size_t length) {
+  uint64_t word;
+  size_t take;
+  int i;
+
+  hasher->total += length;
+
+  if (hasher->tail_length > 0) {
+    take = 32 - hasher->tail_length < length ? 32 - hasher->tail_length : length;
+    memcpy(hasher->tail + hasher->tail_length, data, take);
+    hasher->tail_length += take;
+    data += take;
+    length -= take;
+
+    if (hasher->tail_length < 32) {
+      return;
+    }
+
+    for (i = 0; i < 4; i++) {
+      memcpy(&word, hasher->tail + 8 * i, 8);
+      hasher->lanes[i] = HASH_ROUND(hasher->lanes[i], word);
+    }
+    hasher->tail_length = 0;
+  }
+
+  for (; length >= 32; data += 32, length -= 32) {
+    for (i = 0; i < 4; i++) {
+      memcpy(&word, data + 8 * i, 8);
+      hasher->lanes[i] = HASH_ROUND(hasher->lanes[i], word);
+    }
+  }
+
+  memcpy(hasher->tail, data, length);
+  hasher->tail_length = length;
+}
+
+/**
+ * @brief finishes a hash; two differently mixed words of the lanes make 128 bits
+ *
+ * @param hasher the hash state
+ * @param hash the hash, two words
+ */
+void do_hasher_final(hasher_t *hasher, uint64_t *hash) {
+  uint64_t *lanes = hasher->lanes;
+  uint64_t acc = HASH_ROTATE(lanes[0], 1) + HASH_ROTATE(lanes[1], 7) + HASH_ROTATE(lanes[2], 12) +
+                 HASH_ROTATE(lanes[3], 18);
+  uint64_t other;
+  uint64_t word;
+  size_t i;
+
+  for (i = 0; i < 4; i++) {
+    acc = (acc ^ HASH_ROUND(0, lanes[i])) * HASH_PRIME1 + HASH_PRIME4;
+  }
+
+  acc += hasher->total;
+
+  for (i = 0; i + 8 <= hasher->tail_length; i += 8) {
+    memcpy(&word, hasher->tail + i, 8);
+    acc ^= HASH_ROUND(0, word);
+    acc = HASH_ROTATE(acc, 27) * HASH_PRIME1 + HASH_PRIME4;
+  }
+  for (; i < hasher->tail_length; i++) {
+    acc ^= hasher->tail[i] * HASH_PRIME5;
+    acc = HASH_ROTATE(acc, 11) * HASH_PRIME1;
+  }
+
+  other = (HASH_ROTATE(lanes[0], 7) ^ lanes[2]) * HASH_PRIME1 +
+          (HASH_ROTATE(lanes[1], 13) ^ lanes[3]) * HASH_PRIME2 + hasher->total * HASH_PRIME5 +
+          acc * HASH_PRIME3;
+
+  HASH_MIX(acc);
+  HASH_MIX(other);
+
+  hash[0] = acc;
+  hash[1] = other;
+}
+
+/**
+ * @brief compiles a pattern with the semantics of fnmatch without flags;
+ * patterns without wildcards in the middle are matched with memcmp/memchr,
+ * the rest is turned into a bit-parallel NFA with one state per character
+ *
+ * @param pattern the pattern
+ *
+ * @returns the compiled pattern, NULL on errors
+ */
+matcher_t *do_compile_pattern(char *pattern) {
+  matcher_t *matcher = calloc(1, sizeof(*matcher));
+  unsigned char (*sets)[32] = NULL; /* a bitmap of the accepted bytes per character */
+  int *stars = NULL;                /* whether a '*' precedes the character */
+  char *collate = setlocale(LC_COLLATE, NULL);
+  int simple_collate = !collate || strcmp(collate, "C") == 0 || strcmp(collate, "POSIX") == 0;
+  size_t size = strlen(pattern);
+  size_t count = 0;
+  size_t literal = 0; /* characters without wildcards */
+  int star = 0;
+  int middle = 0; /* a '*' between two characters */
+  size_t i;
+  size_t c;
+
+  if (!matcher || !(sets = calloc(size + 1, sizeof(*sets))) ||
+      !(stars = calloc(size + 2, sizeof(*stars))) || !(matcher->text = malloc(size + 1))) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+    free(sets);
+    free(stars);
+    do_free_matcher(matcher);
+    return NULL;
+  }
+
+  matcher->pattern = pattern;
+  matcher->kind = MATCH_NFA;
+
+  for (i = 0; i < size; i++) {
+    unsigned char *set = sets[count];
+
+    if (pattern[i] == '*') {
+      star = 1;
+      continue;
+    }
+
+    if (star && count > 0) {
+      middle = 1;
+    }
+    stars[count] = star;
+    star = 0;
+
+    if (pattern[i] == '?') {
+      memset(set, 0xff, 32);
+      matcher->multibyte = 1;
+    } else if (pattern[i] == '[' && !strchr(pattern + i + 1, ']')) {
+      /* glibc treats an unterminated bracket inconsistently, leave it to fnmatch */
+      matcher->kind = MATCH_FNMATCH;
+      break;
+    } else if (pattern[i] == '[') {
+      size_t j = i + 1;
+      int negate = 0;
+      int closed = 0;
+
+      if (pattern[j] == '!' || pattern[j] == '^') {
+        negate = 1;
+        j++;
+      }
+
+      /* a ']' right after the opening is a member */
+      for (c = 0; j < size; c++) {
+        unsigned char from;
+        unsigned char to;
+
+        if (pattern[j] == ']' && c > 0) {
+          closed = 1;
+          break;
+        }
+        if (pattern[j] == '[' && (pattern[j + 1] == ':' || pattern[j + 1] == '=' ||
+                                  pattern[j + 1] == '.')) {
+          matcher->kind = MATCH_FNMATCH;
+          break;
+        }
+        if (pattern[j] == '\\' && j + 1 < size) {
+          j++;
+        }
+
+        from = (unsigned char)pattern[j++];
+        to = from;
+
+        if (pattern[j] == '-' && j + 1 < size && pattern[j + 1] != ']') {
+          j++;
+          if (pattern[j] == '\\' && j + 1 < size) {
+            j++;
+          }
+          to = (unsigned char)pattern[j++];
+
+          /* ranges follow the collation order, which is only the byte order in C */
+          if (!simple_collate || from > 127 || to > 127) {
+            matcher->kind = MATCH_FNMATCH;
+          }
+        }
+
+        for (; from <= to; from++) {
+          set[from / 8] |= (unsigned char)(1 << (from % 8));
+          if (from == 255) {
+            break;
+          }
+        }
+      }
+
+      if (!closed) {
+        /* not a bracket expression, e.g. "[a\]", fnmatch will decide */
+        matcher->kind = MATCH_FNMATCH;
+        break;
+      }
+
+      if (negate) {
+        for (c = 0; c < 32; c++) {
+          set[c] = (unsigned char)~set[c];
+        }
+      }
+
+      i = j;
+      matcher->multibyte = 1;
+    } else {
+      /* a backslash escapes the next character, a trailing one is an error for fnmatch */
+      if (pattern[i] == '\\' && ++i == size) {
+        matcher->kind = MATCH_FNMATCH;
+        break;
+      }
+
+      set[(unsigned char)pattern[i] / 8] |= (unsigned char)(1 << ((unsigned char)pattern[i] % 8));
+      matcher->text[literal++] = pattern[i];
+    }
+
+    count++;
+  }
+
+  stars[count] = star;
+  matcher->text[literal] = '\0';
+  matcher->length = literal;
+
+  if (matcher->kind == MATCH_FNMATCH) {
+    /* nothing to prepare */
+  } else if (literal == count && !middle) {
+    if (stars[0] && (count == 0 || stars[count])) {
+      matcher->kind = MATCH_CONTAINS; /* also "*", which contains the empty string */
+    } else if (stars[0]) {
+      matcher->kind = MATCH_SUFFIX;
+    } else if (stars[count]) {
+      matcher->kind = MATCH_PREFIX;
+    } else {
+      matcher->kind = MATCH_LITERAL;
+    }
+  } else if (count > 63) {
+    matcher->kind = MATCH_FNMATCH;
+  } else if (!(matcher->table = calloc(256, sizeof(*matcher->table)))) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+    free(sets);
+    free(stars);
+    do_free_matcher(matcher);
+    return NULL;
+  } else {
+    /* state i means i characters are matched; a byte in set i advances it to i + 1 */
+    for (i = 0; i < count; i++) {
+      for (c = 0; c < 256; c++) {
+        if (sets[i][c / 8] & (1 << (c % 8))) {
+          matcher->table[c] |= 1ULL << i;
+        }
+      }
+    }
+    for (i = 0; i <= count; i++) {
+      if (stars[i]) {
+        matcher->loops |= 1ULL << i;
+      }
+    }
+    matcher->accept = 1ULL << count;
+    matcher->count = count;
+    for (matcher->tail = 0; matcher->tail < count && !stars[count - matcher->tail];) {
+      matcher->tail++;
+    }
+  }
+
+  free(sets);
+  free(stars);
+
+  return matcher;
+}
+
+/**
+ * @brief matches a string against a compiled pattern
+ *
+ * @param matcher the compiled pattern
+ * @param string the string
+ * @param length the length of the string
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_match(matcher_t *matcher, char *string, size_t length) {
+  unsigned long long state = 1;
+  char *end;
+  size_t i;
+
+  switch (matcher->kind) {
+  case MATCH_LITERAL:
+    if (length == matcher->length && memcmp(string, matcher->text, length) == 0) {
+      return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+  case MATCH_PREFIX:
+    if (length >= matcher->length && memcmp(string, matcher->text, matcher->length) == 0) {
+      return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+  case MATCH_SUFFIX:
+    if (length >= matcher->length &&
+        memcmp(string + length - matcher->length, matcher->text, matcher->length) == 0) {
+      return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+  case MATCH_CONTAINS:
+    if (matcher->length == 0) {
+      return EXIT_SUCCESS;
+    }
+    if (length < matcher->length) {
+      return EXIT_FAILURE;
+    }
+    /* memchr finds the candidates for the first character, it is vectorized in the C library */
+    end = string + length - matcher->length + 1;
+    for (; (string = memchr(string, matcher->text[0], (size_t)(end - string))); string++) {
+      if (memcmp(string + 1, matcher->text + 1, matcher->length - 1) == 0) {
+        return EXIT_SUCCESS;
+      }
+    }
+    return EXIT_FAILURE;
+  case MATCH_NFA:
+    /* '?' and brackets match a whole multibyte character, leave those to fnmatch */
+    if (matcher->multibyte && MB_CUR_MAX > 1) {
+      for (i = 0; i < length; i++) {
+        if ((unsigned char)string[i] > 127) {
+          return fnmatch(matcher->pattern, string, 0) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+      }
+    }
+    /* the characters after the last '*' are anchored at the end, which rejects most names early */
+    if (length < matcher->count) {
+      return EXIT_FAILURE;
+    }
+    for (i = 1; i <= matcher->tail; i++) {
+      if (!(matcher->table[(unsigned char)string[length - i]] & (1ULL << (matcher->count - i)))) {
+        return EXIT_FAILURE;
+      }
+    }
+    for (i = 0; i < length && state; i++) {
+      state = ((state & matcher->table[(unsigned char)string[i]]) << 1) | (state & matcher->loops);
+    }
+    return state & matcher->accept ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (fnmatch(matcher->pattern, string, 0) == 0) {
+    return EXIT_SUCCESS;
+  }
+
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief frees a compiled pattern
+ *
+ * @param matcher the compiled pattern, may be NULL
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_free_matcher(matcher_t *matcher) {
+
+  if (matcher) {
+    free(matcher->text);
+    free(matcher->table);
+    free(matcher);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief reads the patterns of -name-from or -path-from, one per line;
+ * empty lines are skipped
+ *
+ * @param file the pattern file
+ *
+ * @returns the compiled patterns, NULL on errors
+ */
+patternset_t *do_load_patterns(char *file) {
+  pathbuf_t data = {NULL, 0, 0};
+  patternset_t *set;
+  char **lines;
+  size_t count = 0;
+  size_t i;
+  ssize_t got;
+  char *line;
+  int fd;
+
+  if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0) {
+    fprintf(stderr, "%s: open(%s): %s\n", program_name, file, strerror(errno));
+    return NULL;
+  }
+
+  /* read to the end, the file may also be a pipe */
+  do {
+    if (do_pathbuf_reserve(&data, data.length + 65536 + 1) != EXIT_SUCCESS) {
+      close(fd);
+      free(data.buffer);
+      return NULL;
+    }
+    got = read(fd, data.buffer + data.length, 65536);
+    if (got > 0) {
+      data.length += (size_t)got;
+    }
+  } while (got > 0 || (got < 0 && errno == EINTR));
+
+  if (got < 0) {
+    fprintf(stderr, "%s: read(%s): %s\n", program_name, file, strerror(errno));
+    close(fd);
+    free(data.buffer);
+    return NULL;
+  }
+
+  close(fd);
+  data.buffer[data.length] = '\0';
+
+  for (i = 0; i < data.length; i++) {
+    count += data.buffer[i] == '\n';
+  }
+
+  if (!(lines = malloc(sizeof(*lines) * (count + 1)))) {
+    fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+    free(data.buffer);
+    return NULL;
+  }
+
+  /* the lines are terminated in place, the matchers keep pointing into the data */
+  for (count = 0, line = data.buffer; line < data.buffer + data.length;) {
+    char *end = memchr(line, '\n', (size_t)(data.buffer + data.length - line));
+
+    if (!end) {
+      end = data.buffer + data.length;
+    }
+    *end = '\0';
+    if (end > line) {
+      lines[count++] = line;
+    }
+    line = end + 1;
+  }
+
+  set = do_compile_patterns(lines, count);
+  free(lines);
+
+  if (!set) {
+    free(data.buffer);
+    return NULL;
+  }
+
+  set->data = data.buffer;
+
+  return set;
+}
+
+/**
+ * @brief compiles patterns into a set, which matches a string if one of them matches;
+ * the cost of a match depends on the length of the string, not on the number of patterns
+ *
+ * @param patterns the patterns, they have to outlive the set
+ * @param count the number of patterns
+ *
+ * @returns the compiled patterns, NULL on errors
+ */
+patternset_t *do_compile_patterns(char **patterns, size_t count) {
+  patternset_t *set = calloc(1, sizeof(*set));
+  matcher_t **contains = NULL;
+  size_t contains_count = 0;
+  size_t texts = 0;
+  size_t i;
+
+  if (!set) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+    return NULL;
+  }
+
+  pthread_rwlock_init(&set->lock, NULL);
+
+  if (!(set->matchers = calloc(count + 1, sizeof(*set->matchers))) ||
+      !(set->globs = calloc(count + 1, sizeof(*set->globs))) ||
+      !(set->others = calloc(count + 1, sizeof(*set->others))) ||
+      !(contains = calloc(count + 1, sizeof(*contains)))) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+    free(contains);
+    do_free_patterns(set);
+    return NULL;
+  }
+
+  for (i = 0; i < count; i++) {
+    matcher_t *matcher = do_compile_pattern(patterns[i]);
+
+    if (!matcher) {
+      free(contains);
+      do_free_patterns(set);
+      return NULL;
+    }
+
+    set->matchers[set->count++] = matcher;
+
+    switch (matcher->kind) {
+    case MATCH_LITERAL:
+    case MATCH_PREFIX:
+    case MATCH_SUFFIX:
+      texts++;
+      break;
+    case MATCH_CONTAINS:
+      if (matcher->length == 0) {
+        set->all = 1;
+      } else {
+        contains[contains_count++] = matcher;
+      }
+      break;
+    case MATCH_NFA:
+      set->globs[set->glob_count++] = matcher;
+      break;
+    default:
+      set->others[set->other_count++] = matcher;
+    }
+  }
+
+  if (texts) {
+    for (set->slot_capacity = 16; set->slot_capacity < texts * 2; set->slot_capacity *= 2) {
+    }
+
+    if (!(set->slots = calloc(set->slot_capacity, sizeof(*set->slots)))) {
+      fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+      free(contains);
+      do_free_patterns(set);
+      return NULL;
+    }
+  }
+
+  for (i = 0; i < set->count; i++) {
+    if (set->matchers[i]->kind <= MATCH_SUFFIX &&
+        do_add_text(set, set->matchers[i]) != EXIT_SUCCESS) {
+      free(contains);
+      do_free_patterns(set);
+      return NULL;
+    }
+  }
+
+  if ((contains_count && do_build_automaton(set, contains, contains_count) != EXIT_SUCCESS) ||
+      (set->glob_count && do_build_globs(set) != EXIT_SUCCESS)) {
+    free(contains);
+    do_free_patterns(set);
+    return NULL;
+  }
+
+  free(contains);
+
+  return set;
+}
+
+/**
+ * @brief adds the text of a literal, prefix or suffix pattern to the hash table
+ * and its length to the distinct lengths of the kind, which are kept sorted
+ *
+ * @param set the pattern set, with room for the text
+ * @param matcher the compiled pattern
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_add_text(patternset_t *set, matcher_t *matcher) {
+  size_t slot = do_find_text(set, matcher->kind, matcher->text, matcher->length);
+  size_t *lengths = set->lengths[matcher->kind];
+  size_t count = set->length_count[matcher->kind];
+  size_t i;
+
+  if (set->slots[slot].text) {
+    return EXIT_SUCCESS; /* a duplicate */
+  }
+
+  set->slots[slot].text = matcher->text;
+  set->slots[slot].length = matcher->length;
+  set->slots[slot].kind = matcher->kind;
+
+  for (i = 0; i < count && lengths[i] < matcher->length; i++) {
+  }
+
+  if (i < count && lengths[i] == matcher->length) {
+    return EXIT_SUCCESS;
+  }
+
+  if (!(lengths = realloc(lengths, sizeof(*lengths) * (count + 1)))) {
+    fprintf(stderr, "%s: realloc(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  memmove(lengths + i + 1, lengths + i, sizeof(*lengths) * (count - i));
+  lengths[i] = matcher->length;
+  set->lengths[matcher->kind] = lengths;
+  set->length_count[matcher->kind]++;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief looks up a text in the hash table of a pattern set
+ *
+ * @param set the pattern set with at least one slot
+ * @param kind MATCH_LITERAL, MATCH_PREFIX or MATCH_SUFFIX
+ * @param text the text, not terminated
+ * @param length the length of the text
+ *
+ * @returns the slot of the text, or the empty slot where it belongs
+ */
+size_t do_find_text(patternset_t *set, int kind, char *text, size_t length) {
+  size_t mask = set->slot_capacity - 1;
+  size_t slot = (do_hash_text(text, length, set->slot_capacity) ^ (size_t)kind) & mask;
+
+  for (; set->slots[slot].text; slot = (slot + 1) & mask) {
+    textslot_t *found = &set->slots[slot];
+
+    if (found->kind == kind && found->length == length &&
+        memcmp(found->text, text, length) == 0) {
+      break;
+    }
+  }
+
+  return slot;
+}
+
+/**
+ * @brief builds an Aho-Corasick automaton of the substring patterns; every node has
+ * a transition for every byte, so a match is one table lookup per byte of the string
+ *
+ * @param set the pattern set
+ * @param texts the MATCH_CONTAINS patterns, none of them empty
+ * @param count the number of patterns
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_build_automaton(patternset_t *set, matcher_t **texts, size_t count) {
+  size_t capacity = 1;
+  size_t *fail;
+  size_t *queue;
+  size_t head = 0;
+  size_t tail = 0;
+  size_t i;
+  size_t j;
+  int c;
+
+  for (i = 0; i < count; i++) {
+    capacity += texts[i]->length;
+  }
+
+  if (!(set->automaton = malloc(sizeof(*set->automaton) * 256 * capacity)) ||
+      !(set->found = calloc(capacity, sizeof(*set->found)))) {
+    fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  memset(set->automaton, 0xff, sizeof(*set->automaton) * 256 * capacity);
+  set->nodes = 1;
+
+  /* the trie of the texts */
+  for (i = 0; i < count; i++) {
+    size_t node = 0;
+
+    for (j = 0; j < texts[i]->length; j++) {
+      int *next = &set->automaton[node * 256 + (unsigned char)texts[i]->text[j]];
+
+      if (*next < 0) {
+        *next = (int)set->nodes++;
+      }
+      node = (size_t)*next;
+    }
+    set->found[node] = 1;
+  }
+
+  if (!(fail = calloc(set->nodes, sizeof(*fail))) ||
+      !(queue = calloc(set->nodes, sizeof(*queue)))) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+    free(fail);
+    return EXIT_FAILURE;
+  }
+
+  /* breadth first, so the transitions of the shorter fallbacks are complete */
+  for (c = 0; c < 256; c++) {
+    int *next = &set->automaton[c];
+
+    if (*next < 0) {
+      *next = 0;
+    } else {
+      queue[tail++] = (size_t)*next;
+    }
+  }
+
+  while (head < tail) {
+    size_t node = queue[head++];
+
+    for (c = 0; c < 256; c++) {
+      int *next = &set->automaton[node * 256 + c];
+      int fallback = set->automaton[fail[node] * 256 + c];
+
+      if (*next < 0) {
+        *next = fallback;
+      } else {
+        fail[*next] = (size_t)fallback;
+        set->found[*next] |= set->found[fallback];
+        queue[tail++] = (size_t)*next;
+      }
+    }
+  }
+
+  free(fail);
+  free(queue);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief packs the NFAs of the glob patterns into one combined NFA and prepares its DFA;
+ * each pattern takes its characters + 1 bits of a word, the shift of a step never moves
+ * a bit into the next pattern, because the final states don't advance
+ *
+ * @param set the pattern set with at least one glob
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_build_globs(patternset_t *set) {
+  size_t used = 64;
+  size_t word = 0;
+  size_t state_size;
+  size_t i;
+  size_t c;
+
+  for (i = 0; i < set->glob_count; i++) {
+    if (used + set->globs[i]->count + 1 > 64) {
+      set->words++;
+      used = 0;
+    }
+    used += set->globs[i]->count + 1;
+  }
+
+  if (!(set->table = calloc(256 * set->words, sizeof(*set->table))) ||
+      !(set->loops = calloc(set->words, sizeof(*set->loops))) ||
+      !(set->accept = calloc(set->words, sizeof(*set->accept))) ||
+      !(set->start = calloc(set->words, sizeof(*set->start))) ||
+      !(set->scratch = calloc(set->words, sizeof(*set->scratch)))) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0, used = 64; i < set->glob_count; i++) {
+    matcher_t *glob = set->globs[i];
+
+    if (used + glob->count + 1 > 64) {
+      word = i ? word + 1 : 0;
+      used = 0;
+    }
+    for (c = 0; c < 256; c++) {
+      set->table[c * set->words + word] |= glob->table[c] << used;
+    }
+    set->loops[word] |= glob->loops << used;
+    set->accept[word] |= glob->accept << used;
+    set->start[word] |= 1ULL << used;
+    set->multibyte |= glob->multibyte;
+    used += glob->count + 1;
+  }
+
+  /* the DFA states are built while matching, only those reached by real names */
+  state_size = set->words * sizeof(*set->keys) + 256 * sizeof(*set->next) + 1;
+  set->state_limit = DFA_MEMORY / state_size > 16 ? DFA_MEMORY / state_size : 16;
+
+  for (set->bucket_capacity = 16; set->bucket_capacity < set->state_limit * 2;
+       set->bucket_capacity *= 2) {
+  }
+
+  if (!(set->buckets = malloc(sizeof(*set->buckets) * set->bucket_capacity))) {
+    fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  return do_dfa_flush(set);
+}
+
+/**
+ * @brief matches a string against a set of compiled patterns
+ *
+ * @param set the compiled patterns
+ * @param string the string
+ * @param length the length of the string
+ *
+ * @returns EXIT_SUCCESS if one of the patterns matches, EXIT_FAILURE otherwise
+ */
+int do_match_set(patternset_t *set, char *string, size_t length) {
+  size_t i;
+
+  if (set->all) {
+    return EXIT_SUCCESS;
+  }
+
+  /* one lookup per distinct length, not per pattern */
+  if (set->length_count[MATCH_LITERAL] &&
+      set->slots[do_find_text(set, MATCH_LITERAL, string, length)].text) {
+    return EXIT_SUCCESS;
+  }
+  for (i = 0; i < set->length_count[MATCH_PREFIX] && set->lengths[MATCH_PREFIX][i] <= length;
+       i++) {
+    if (set->slots[do_find_text(set, MATCH_PREFIX, string, set->lengths[MATCH_PREFIX][i])].text) {
+      return EXIT_SUCCESS;
+    }
+  }
+  for (i = 0; i < set->length_count[MATCH_SUFFIX] && set->lengths[MATCH_SUFFIX][i] <= length;
+       i++) {
+    size_t suffix = set->lengths[MATCH_SUFFIX][i];
+
+    if (set->slots[do_find_text(set, MATCH_SUFFIX, string + length - suffix, suffix)].text) {
+      return EXIT_SUCCESS;
+    }
+  }
+
+  if (set->nodes) {
+    size_t node = 0;
+
+    for (i = 0; i < length; i++) {
+      node = (size_t)set->automaton[node * 256 + (unsigned char)string[i]];
+      if (set->found[node]) {
+        return EXIT_SUCCESS;
+      }
+    }
+  }
+
+  if (set->glob_count && do_match_globs(set, string, length) == EXIT_SUCCESS) {
+    return EXIT_SUCCESS;
+  }
+
+  for (i = 0; i < set->other_count; i++) {
+    if (do_match(set->others[i], string, length) == EXIT_SUCCESS) {
+      return EXIT_SUCCESS;
+    }
+  }
+
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief matches a string against the glob patterns of a set with the DFA; the transitions
+ * are followed under the read lock, a missing one is built under the write lock
+ *
+ * @param set the compiled patterns with at least one glob
+ * @param string the string
+ * @param length the length of the string
+ *
+ * @returns EXIT_SUCCESS if one of the globs matches, EXIT_FAILURE otherwise
+ */
+int do_match_globs(patternset_t *set, char *string, size_t length) {
+  int state = 0;
+  int result;
+  size_t i;
+
+  /* '?' and brackets match a whole multibyte character, do_match leaves those to fnmatch */
+  if (set->multibyte && MB_CUR_MAX > 1) {
+    for (i = 0; i < length && (unsigned char)string[i] <= 127; i++) {
+    }
+    if (i < length) {
+      for (i = 0; i < set->glob_count; i++) {
+        if (do_match(set->globs[i], string, length) == EXIT_SUCCESS) {
+          return EXIT_SUCCESS;
+        }
+      }
+      return EXIT_FAILURE;
+    }
+  }
+
+  pthread_rwlock_rdlock(&set->lock);
+
+  for (i = 0; i < length && state >= 0; i++) {
+    state = set->next[(size_t)state * 256 + (unsigned char)string[i]];
+  }
+
+  if (state >= 0) {
+    result = set->accepting[state];
+    pthread_rwlock_unlock(&set->lock);
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  pthread_rwlock_unlock(&set->lock);
+
+  /* the states may have been flushed meanwhile, start again */
+  pthread_rwlock_wrlock(&set->lock);
+
+  for (i = 0, state = 0; i < length; i++) {
+    int next = set->next[(size_t)state * 256 + (unsigned char)string[i]];
+
+    state = next >= 0 ? next : do_dfa_step(set, state, (unsigned char)string[i]);
+  }
+
+  result = set->accepting[state];
+  pthread_rwlock_unlock(&set->lock);
+
+  return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief builds the transition of a DFA state on a byte; if the cache is full,
+ * it is flushed and only the start state and the new state remain
+ *
+ * @param set the pattern set, the write lock is held
+ * @param state the DFA state
+ * @param byte the byte
+ *
+ * @returns the next DFA state
+ */
+int do_dfa_step(patternset_t *set, int state, unsigned char byte) {
+  unsigned long long *key = &set->keys[(size_t)state * set->words];
+  unsigned long long *table = &set->table[(size_t)byte * set->words];
+  size_t w;
+  int next;
+
+  for (w = 0; w < set->words; w++) {
+    set->scratch[w] = ((key[w] & table[w]) << 1) | (key[w] & set->loops[w]);
+  }
+
+  if ((next = do_dfa_add(set, set->scratch)) >= 0) {
+    set->next[(size_t)state * 256 + byte] = next;
+    return next;
+  }
+
+  do_dfa_flush(set);
+
+  return do_dfa_add(set, set->scratch);
+}
+
+/**
+ * @brief finds or adds the DFA state of an NFA state
+ *
+ * @param set the pattern set, the write lock is held
+ * @param key the NFA state, set->words words
+ *
+ * @returns the DFA state, -1 if the cache is full or on errors
+ */
+int do_dfa_add(patternset_t *set, unsigned long long *key) {
+  size_t size = set->words * sizeof(*key);
+  size_t mask = set->bucket_capacity - 1;
+  size_t bucket = do_hash_text((char *)key, size, set->bucket_capacity);
+  size_t state;
+  size_t w;
+
+  for (; set->buckets[bucket] >= 0; bucket = (bucket + 1) & mask) {
+    if (memcmp(&set->keys[(size_t)set->buckets[bucket] * set->words], key, size) == 0) {
+      return set->buckets[bucket];
+    }
+  }
+
+  if (set->states == set->state_limit) {
+    return -1;
+  }
+
+  if (set->states == set->state_capacity) {
+    size_t capacity = set->state_capacity ? set->state_capacity * 2 : 64;
+    unsigned long long *keys;
+    unsigned char *accepting;
+    int *next;
+
+    if (capacity > set->state_limit) {
+      capacity = set->state_limit;
+    }
+
+    if (!(keys = realloc(set->keys, size * capacity))) {
+      fprintf(stderr, "%s: realloc(): %s\n", program_name, strerror(errno));
+      return -1;
+    }
+    set->keys = keys;
+    if (!(next = realloc(set->next, sizeof(*next) * 256 * capacity))) {
+      fprintf(stderr, "%s: realloc(): %s\n", program_name, strerror(errno));
+      return -1;
+    }
+    set->next = next;
+    if (!(accepting = realloc(set->accepting, sizeof(*accepting) * capacity))) {
+      fprintf(stderr, "%s: realloc(): %s\n", program_name, strerror(errno));
+      return -1;
+    }
+    set->accepting = accepting;
+    set->state_capacity = capacity;
+  }
+
+  state = set->states++;
+  memcpy(&set->keys[state * set->words], key, size);
+  memset(&set->next[state * 256], 0xff, sizeof(*set->next) * 256);
+  set->accepting[state] = 0;
+  for (w = 0; w < set->words; w++) {
+    if (key[w] & set->accept[w]) {
+      set->accepting[state] = 1;
+    }
+  }
+  set->buckets[bucket] = (int)state;
+
+  return (int)state;
+}
+
+/**
+ * @brief empties the DFA of a pattern set, only the start state remains
+ *
+ * @param set the pattern set, the write lock is held
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_dfa_flush(patternset_t *set) {
+
+  set->states = 0;
+  memset(set->buckets, 0xff, sizeof(*set->buckets) * set->bucket_capacity);
+
+  return do_dfa_add(set, set->start) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief frees a pattern set
+ *
+ * @param set the pattern set, may be NULL
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_free_patterns(patternset_t *set) {
+  size_t i;
+
+  if (set) {
+    for (i = 0; i < set->count; i++) {
+      do_free_matcher(set->matchers[i]);
+    }
+    for (i = 0; i < 3; i++) {
+      free(set->lengths[i]);
+    }
+    free(set->matchers);
+    free(set->globs);
+    free(set->others);
+    free(set->slots);
+    free(set->automaton);
+    free(set->found);
+    free(set->table);
+    free(set->loops);
+    free(set->accept);
+    free(set->start);
+    free(set->scratch);
+    free(set->keys);
+    free(set->next);
+    free(set->accepting);
+    free(set->buckets);
+    free(set->data);
+    pthread_rwlock_destroy(&set->lock);
+    free(set);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief FNV-1a hash of a byte string
+ *
+ * @param text the bytes
+ * @param length the number of bytes
+ * @param capacity the number of buckets, a power of 2
+ *
+ * @returns the bucket
+ */
+size_t do_hash_text(char *text, size_t length, size_t capacity) {
+  uint64_t hash = 14695981039346656037u;
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    hash = (hash ^ (unsigned char)text[i]) * 1099511628211u;
+  }
+
+  return (size_t)(hash ^ (hash >> 32)) & (capacity - 1);
+}
+
+/**
+ * @brief returns a copy of the last path component, like basename(3) without modifying the path
+ *
+ * @param path the path
+ *
+ * @returns the last component, which has to be freed, NULL on errors
+ */
+char *do_get_basename(char *path) {
+  size_t length = strlen(path);
+  size_t start;
+  char *base;
+
+  /* trailing slashes don't count, unless the path consists only of them */
+  while (length > 1 && path[length - 1] == '/') {
+    length--;
+  }
+
+  for (start = length; start > 0 && path[start - 1] != '/'; start--) {
+  }
+
+  if (start == length) {
+    start = length > 0 ? length - 1 : 0; /* "/" */
+  }
+
+  if (!(base = malloc(length - start + 1))) {
+    fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+    return NULL;
+  }
+
+  memcpy(base, path + start, length - start);
+  base[length - start] = '\0';
+
+  return base;
+}
+
+/**
+ * @brief converts the entry attributes to a readable type
+ *
+ * @param attr the entry attributes from lstat
+ *
+ * @returns the entry type as a char
+ */
+char do_get_type(struct stat attr) {
+
+  /* block special file */
+  if (S_ISBLK(attr.st_mode)) {
+    return 'b';
+  }
+  /* character special file */
+  if (S_ISCHR(attr.st_mode)) {
+    return 'c';
+  }
+  /* directory */
+  if (S_ISDIR(attr.st_mode)) {
+    return 'd';
+  }
+  /* fifo (named pipe) */
+  if (S_ISFIFO(attr.st_mode)) {
+    return 'p';
+  }
+  /* regular file */
+  if (S_ISREG(attr.st_mode)) {
+    return 'f';
+  }
+  /* symbolic link */
+  if (S_ISLNK(attr.st_mode)) {
+    return 'l';
+  }
+  /* socket */
+  if (S_ISSOCK(attr.st_mode)) {
+    return 's';
+  }
+
+  /* some other file type */
+  return '?';
+}
+
+/**
+ * @brief converts the directory entry type to a readable type,
+ * falls back to the attributes if the file system didn't report it
+ *
+ * @param entry the entry
+ *
+ * @returns the entry type as a char, '?' if unknown
+ */
+char do_get_entry_type(entry_t *entry) {
+  struct stat *attr;
+
+  switch (entry->type) {
+  case DT_BLK:
+    return 'b';
+  case DT_CHR:
+    return 'c';
+  case DT_DIR:
+    return 'd';
+  case DT_FIFO:
+    return 'p';
+  case DT_REG:
+    return 'f';
+  case DT_LNK:
+    return 'l';
+  case DT_SOCK:
+    return 's';
+  }
+
+  if (!entry->has_attr && (attr = do_get_attr(entry))) {
+    return do_get_type(*attr);
+  }
+
+  return '?';
+}
+
+/**
+ * @brief converts the entry attributes to readable permissions
+ *
+ * @param attr the entry attributes from lstat
+ *
+ * @returns the entry permissions as a string
+ */
+char *do_get_perms(struct stat attr) {
+  static __thread char perms[11];
+  char type = do_get_type(attr);
+
+  /*
+   * cast is used to avoid the IDE warnings
+   * about int possibly not fitting into char
+   */
+  perms[0] = (char)(type == 'f' ? '-' : type);
+  perms[1] = (char)(attr.st_mode & S_IRUSR ? 'r' : '-');
+  perms[2] = (char)(attr.st_mode & S_IWUSR ? 'w' : '-');
+  perms[3] = (char)(attr.st_mode & S_ISUID ? (attr.st_mode & S_IXUSR ? 's' : 'S')
+                                           : (attr.st_mode & S_IXUSR ? 'x' : '-'));
+  perms[4] = (char)(attr.st_mode & S_IRGRP ? 'r' : '-');
+  perms[5] = (char)(attr.st_mode & S_IWGRP ? 'w' : '-');
+  perms[6] = (char)(attr.st_mode & S_ISGID ? (attr.st_mode & S_IXGRP ? 's' : 'S')
+                                           : (attr.st_mode & S_IXGRP ? 'x' : '-'));
+  perms[7] = (char)(attr.st_mode & S_IROTH ? 'r' : '-');
+  perms[8] = (char)(attr.st_mode & S_IWOTH ? 'w' : '-');
+  perms[9] = (char)(attr.st_mode & S_ISVTX ? (attr.st_mode & S_IXOTH ? 't' : 'T')
+                                           : (attr.st_mode & S_IXOTH ? 'x' : '-'));
+  perms[10] = '\0';
+
+  return perms;
+}
+
+/**
+ * @brief converts the entry attributes to username or, if not found, uid
+ *
+ * @param attr the entry attributes from lstat
+ *
+ * @returns the username if getpwuid_r() worked, otherwise uid, as a string
+ */
+char *do_get_user(struct stat attr) {
+
+  return do_get_id(&users, attr.st_uid, 0)->name;
+}
+
+/**
+ * @brief converts the entry attributes to groupname or, if not found, gid
+ *
+ * @param attr the entry attributes from lstat
+ *
+ * @returns the groupname if getgrgid_r() worked, otherwise gid, as a string
+ */
+char *do_get_group(struct stat attr) {
+
+  return do_get_id(&groups, attr.st_gid, 1)->name;
+}
+
+/**
+ * @brief finds a user or group in the cache, asks NSS and caches the answer if not there;
+ * the last found entry is remembered per thread, because neighbouring entries often share it
+ *
+ * @param cache users or groups
+ * @param id the uid or gid
+ * @param group whether to use getgrgid_r instead of getpwuid_r
+ *
+ * @returns the cached entry, never NULL
+ */
+idname_t *do_get_id(idcache_t *cache, unsigned int id, int group) {
+  static __thread idname_t *last_user = NULL;
+  static __thread idname_t *last_group = NULL;
+  static idname_t failed = {0, 0, "", NULL};
+  idname_t **last = group ? &last_group : &last_user;
+  idname_t *found = NULL;
+  char *buffer = NULL;
+  char *name = NULL;
+  size_t size = 1024;
+  char number[11]; /* an unsigned int needs 10 chars */
+  int error;
+
+  if (*last && (*last)->id == id) {
+    STATS_COUNT(nss_hits);
+    return *last;
+  }
+
+  pthread_rwlock_rdlock(&cache->lock);
+
+  if (cache->capacity > 0) {
+    for (found = cache->buckets[do_hash_id(id, cache->capacity)]; found;
+         found = found->next) {
+      if (found->id == id) {
+        break;
+      }
+    }
+  }
+
+  pthread_rwlock_unlock(&cache->lock);
+
+  if (found) {
+    STATS_COUNT(nss_hits);
+    return *last = found;
+  }
+
+  /* ask NSS without holding the lock, a slow source would block all threads */
+  do {
+    struct passwd pwd;
+    struct passwd *pwd_result = NULL;
+    struct group grp;
+    struct group *grp_result = NULL;
+    char *bigger = realloc(buffer, size);
+
+    if (!bigger) {
+      fprintf(stderr, "%s: realloc(): %s\n", program_name, strerror(errno));
+      free(buffer);
+      return &failed;
+    }
+
+    buffer = bigger;
+    STATS_COUNT(nss_lookups);
+    STATS_BEGIN(PHASE_NSS);
+
+    if (group) {
+      error = getgrgid_r(id, &grp, buffer, size, &grp_result);
+      name = grp_result ? grp_result->gr_name : NULL;
+    } else {
+      error = getpwuid_r(id, &pwd, buffer, size, &pwd_result);
+      name = pwd_result ? pwd_result->pw_name : NULL;
+    }
+
+    STATS_END(PHASE_NSS);
+
+    size *= 2;
+  } while (error == ERANGE);
+
+  if (!name) {
+    /* the id is not found or the lookup failed, use the id as a string then */
+    snprintf(number, sizeof(number), "%u", id);
+  }
+
+  found = do_add_id(cache, id, name != NULL, name ? name : number);
+  free(buffer);
+
+  if (!found) {
+    return &failed;
+  }
+
+  return *last = found;
+}
+
+/**
+ * @brief adds a user or group to the cache, unless the id is already there
+ *
+ * @param cache users or groups
+ * @param id the uid or gid
+ * @param exists whether NSS knows the id
+ * @param name the name, copied
+ *
+ * @returns the cached entry, NULL on errors
+ */
+idname_t *do_add_id(idcache_t *cache, unsigned int id, int exists, char *name) {
+  idname_t *entry;
+  size_t i;
+
+  pthread_rwlock_wrlock(&cache->lock);
+
+  /* another thread could have added it in the meantime */
+  if (cache->capacity > 0) {
+    for (entry = cache->buckets[do_hash_id(id, cache->capacity)]; entry;
+         entry = entry->next) {
+      if (entry->id == id) {
+        pthread_rwlock_unlock(&cache->lock);
+        return entry;
+      }
+    }
+  }
+
+  /* keep the chains short, rehash into twice as many buckets */
+  if (cache->count >= cache->capacity) {
+    size_t capacity = cache->capacity ? cache->capacity * 2 : 64;
+    idname_t **buckets = calloc(capacity, sizeof(*buckets));
+
+    if (!buckets) {
+      pthread_rwlock_unlock(&cache->lock);
+      fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+      return NULL;
+    }
+
+    for (i = 0; i < cache->capacity; i++) {
+      while (cache->buckets[i]) {
+        idname_t *next = cache->buckets[i]->next;
+        size_t bucket = do_hash_id(cache->buckets[i]->id, capacity);
+
+        cache->buckets[i]->next = buckets[bucket];
+        buckets[bucket] = cache->buckets[i];
+        cache->buckets[i] = next;
+      }
+    }
+
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->capacity = capacity;
+  }
+
+  if (!(entry = malloc(sizeof(*entry))) || !(entry->name = strdup(name))) {
+    pthread_rwlock_unlock(&cache->lock);
+    fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+    free(entry);
+    return NULL;
+  }
+
+  entry->id = id;
+  entry->exists = exists;
+  entry->next = cache->buckets[do_hash_id(id, cache->capacity)];
+  cache->buckets[do_hash_id(id, cache->capacity)] = entry;
+  cache->count++;
+
+  pthread_rwlock_unlock(&cache->lock);
+
+  return entry;
+}
+
+/**
+ * @brief spreads the ids over the buckets, also ids which only differ in the high bits
+ *
+ * @param id the uid or gid
+ * @param capacity the number of buckets, a power of 2
+ *
+ * @returns the bucket
+ */
+size_t do_hash_id(unsigned int id, size_t capacity) {
+  unsigned int hash = id * 2654435761u;
+
+  return (hash ^ (hash >> 16)) & (capacity - 1);
+}
+
+/**
+ * @brief fills the cache from a passwd or group file, "name:password:id:..." per line;
+ * ids from other NSS sources (e.g. LDAP) are still looked up on demand
+ *
+ * @param cache users or groups
+ * @param file /etc/passwd or /etc/group
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_preload_ids(idcache_t *cache, char *file) {
+  FILE *stream = fopen(file, "r");
+  char *line = NULL;
+  size_t size = 0;
+
+  if (!stream) {
+    fprintf(stderr, "%s: fopen(%s): %s\n", program_name, file, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  while (getline(&line, &size, stream) > 0) {
+    char *name = line;
+    char *password = strchr(name, ':');
+    char *id = password ? strchr(password + 1, ':') : NULL;
+    char *end;
+    unsigned long number;
+
+    /* skip comments, NIS compat lines ("+", "-") and broken lines */
+    if (!id || name[0] == '#' || name[0] == '+' || name[0] == '-' || name == password) {
+      continue;
+    }
+
+    *password = '\0';
+    number = strtoul(id + 1, &end, 10);
+
+    /* the first line wins, same as in the files NSS module */
+    if (end != id + 1 && *end == ':' && number <= UINT_MAX) {
+      do_add_id(cache, (unsigned int)number, 1, name);
+    }
+  }
+
+  free(line);
+
+  if (fclose(stream) != 0) {
+    fprintf(stderr, "%s: fclose(%s): %s\n", program_name, file, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  errno = 0; /* getline sets it at the end of the file */
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief frees the cached users or groups
+ *
+ * @param cache users or groups
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_free_ids(idcache_t *cache) {
+  size_t i;
+
+  for (i = 0; i < cache->capacity; i++) {
+    while (cache->buckets[i]) {
+      idname_t *next = cache->buckets[i]->next;
+      free(cache->buckets[i]->name);
+      free(cache->buckets[i]);
+      cache->buckets[i] = next;
+    }
+  }
+
+  free(cache->buckets);
+  cache->buckets = NULL;
+  cache->capacity = 0;
+  cache->count = 0;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief appends an entry to the index being built; the path is front-coded
+ * against the previous one, the attributes go into their columns
+ *
+ * @param indexer the index being built
+ * @param entry the entry, its attributes are read if necessary
+ * @param depth the depth of the entry, the location is 0
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_index_record(indexer_t *indexer, entry_t *entry, int depth) {
+  struct stat *attr = do_get_attr(entry);
+  pathbuf_t *previous = &indexer->previous;
+  size_t length = strlen(entry->path);
+  size_t shared = 0;
+  unsigned char varints[20];
+  size_t size = 0;
+  uint64_t values[2];
+  uint16_t depth16 = depth > UINT16_MAX ? UINT16_MAX : (uint16_t)depth;
+  uint32_t value32;
+  uint64_t value64;
+  int64_t time64;
+  uint8_t flags = 0; /* set by do_index_dir once the entries are recorded */
+  char *target = NULL;
+  int i;
+
+  if (!attr) {
+    return EXIT_SUCCESS; /* already reported, the entry is left out */
+  }
+
+  /* a block starts with a complete path */
+  if (indexer->count % INDEX_BLOCK == 0) {
+    value64 = indexer->paths.length;
+    previous->length = 0;
+    if (do_index_put(&indexer->blocks, &value64, 8) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  while (shared < length && shared < previous->length &&
+         entry->path[shared] == previous->buffer[shared]) {
+    shared++;
+  }
+
+  /* the shared prefix length and the suffix length as LEB128 varints */
+  values[0] = shared;
+  values[1] = length - shared;
+  for (i = 0; i < 2; i++) {
+    do {
+      varints[size++] = (unsigned char)((values[i] & 0x7f) | (values[i] > 0x7f ? 0x80 : 0));
+      values[i] >>= 7;
+    } while (values[i]);
+  }
+
+  if (do_index_put(&indexer->paths, varints, size) != EXIT_SUCCESS ||
+      do_index_put(&indexer->paths, entry->path + shared, length - shared) != EXIT_SUCCESS ||
+      do_pathbuf_append(previous, 0, entry->path) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  /* the targets start with an empty string, so offset 0 means no target */
+  value32 = 0;
+  if (S_ISLNK(attr->st_mode) && !entry->index) {
+    target = do_get_symlink(entry->path, *attr);
+  } else if (S_ISLNK(attr->st_mode) && (target = do_index_target(entry->index, entry->record))) {
+    /* a record reused from the previous index */
+    if (!(target = strdup(target))) {
+      fprintf(stderr, "%s: strdup(): %s\n", program_name, strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+  if (target) {
+    if (indexer->targets.length == 0 && do_index_put(&indexer->targets, "", 1) != EXIT_SUCCESS) {
+      free(target);
+      return EXIT_FAILURE;
+    }
+    if (indexer->targets.length > UINT32_MAX) {
+      fprintf(stderr, "%s: %s: too many symlink targets for the index\n", program_name,
+              entry->path);
+      free(target);
+      return EXIT_FAILURE;
+    }
+    value32 = (uint32_t)indexer->targets.length;
+    if (do_index_put(&indexer->targets, target, strlen(target) + 1) != EXIT_SUCCESS) {
+      free(target);
+      return EXIT_FAILURE;
+    }
+    free(target);
+  }
+
+  if (do_index_put(&indexer->columns[COL_LINK], &value32, 4) != EXIT_SUCCESS ||
+      do_index_put(&indexer->columns[COL_DEPTH], &depth16, 2) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  value32 = (uint32_t)attr->st_mode;
+  if (do_index_put(&indexer->columns[COL_MODE], &value32, 4) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  value32 = (uint32_t)attr->st_uid;
+  if (do_index_put(&indexer->columns[COL_UID], &value32, 4) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  value32 = (uint32_t)attr->st_gid;
+  if (do_index_put(&indexer->columns[COL_GID], &value32, 4) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  value32 = (uint32_t)attr->st_nlink;
+  if (do_index_put(&indexer->columns[COL_NLINK], &value32, 4) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  value64 = (uint64_t)attr->st_size;
+  if (do_index_put(&indexer->columns[COL_SIZE], &value64, 8) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  time64 = (int64_t)attr->st_mtime;
+  if (do_index_put(&indexer->columns[COL_MTIME], &time64, 8) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  time64 = (int64_t)attr->st_ctime;
+  if (do_index_put(&indexer->columns[COL_CTIME], &time64, 8) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  value64 = (uint64_t)attr->st_ino;
+  if (do_index_put(&indexer->columns[COL_INO], &value64, 8) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  value64 = (uint64_t)attr->st_dev;
+  if (do_index_put(&indexer->columns[COL_DEV], &value64, 8) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  value64 = (uint64_t)attr->st_blocks;
+  if (do_index_put(&indexer->columns[COL_BLOCKS], &value64, 8) != EXIT_SUCCESS ||
+      do_index_put(&indexer->columns[COL_FLAGS], &flags, 1) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  indexer->count++;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief appends bytes to a section of the index being built
+ *
+ * @param column the section
+ * @param value the bytes
+ * @param size the number of bytes
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_index_put(pathbuf_t *column, void *value, size_t size) {
+
+  if (do_pathbuf_reserve(column, column->length + size) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  memcpy(column->buffer + column->length, value, size);
+  column->length += size;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief writes the index to a temporary file and renames it,
+ * so readers of the previous index never see a partial one
+ *
+ * @param indexer the index being built
+ * @param file the index file
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_index_write(indexer_t *indexer, char *file) {
+  static const char padding[8];
+  index_header_t header;
+  pathbuf_t *sections[INDEX_COLUMNS + 3];
+  uint64_t *offsets[INDEX_COLUMNS + 3];
+  uint64_t offset = sizeof(header);
+  size_t length = strlen(file);
+  char *temporary = malloc(length + 5);
+  FILE *out;
+  int status = EXIT_SUCCESS;
+  int i;
+
+  if (!temporary) {
+    fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  memcpy(temporary, file, length);
+  memcpy(temporary + length, ".tmp", 5);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEX_MAGIC, 8);
+  header.count = indexer->count;
+  header.paths_size = indexer->paths.length;
+  header.targets_size = indexer->targets.length;
+  header.created = (int64_t)options.now;
+
+  sections[0] = &indexer->paths;
+  offsets[0] = &header.paths;
+  sections[1] = &indexer->targets;
+  offsets[1] = &header.targets;
+  sections[2] = &indexer->blocks;
+  offsets[2] = &header.blocks;
+  for (i = 0; i < INDEX_COLUMNS; i++) {
+    sections[i + 3] = &indexer->columns[i];
+    offsets[i + 3] = &header.columns[i];
+  }
+
+  for (i = 0; i < INDEX_COLUMNS + 3; i++) {
+    *offsets[i] = offset;
+    offset += (sections[i]->length + 7) & ~(size_t)7;
+  }
+
+  if (!(out = fopen(temporary, "wb"))) {
+    fprintf(stderr, "%s: fopen(%s): %s\n", program_name, temporary, strerror(errno));
+    free(temporary);
+    return EXIT_FAILURE;
+  }
+
+  if (fwrite(&header, sizeof(header), 1, out) != 1) {
+    status = EXIT_FAILURE;
+  }
+
+  for (i = 0; status == EXIT_SUCCESS && i < INDEX_COLUMNS + 3; i++) {
+    size_t pad = ((sections[i]->length + 7) & ~(size_t)7) - sections[i]->length;
+
+    if ((sections[i]->length &&
+         fwrite(sections[i]->buffer, sections[i]->length, 1, out) != 1) ||
+        (pad && fwrite(padding, pad, 1, out) != 1)) {
+      status = EXIT_FAILURE;
+    }
+  }
+
+  if (status != EXIT_SUCCESS) {
+    fprintf(stderr, "%s: fwrite(%s): %s\n", program_name, temporary, strerror(errno));
+  }
+
+  if (fclose(out) != 0 && status == EXIT_SUCCESS) {
+    fprintf(stderr, "%s: fclose(%s): %s\n", program_name, temporary, strerror(errno));
+    status = EXIT_FAILURE;
+  }
+
+  if (status == EXIT_SUCCESS && rename(temporary, file) != 0) {
+    fprintf(stderr, "%s: rename(%s): %s\n", program_name, file, strerror(errno));
+    status = EXIT_FAILURE;
+  }
+
+  if (status != EXIT_SUCCESS) {
+    unlink(temporary);
+  }
+
+  free(temporary);
+
+  return status;
+}
+
+/**
+ * @brief frees the sections of an index being built
+ *
+ * @param indexer the index being built
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_free_indexer(indexer_t *indexer) {
+  int i;
+
+  free(indexer->paths.buffer);
+  free(indexer->blocks.buffer);
+  free(indexer->targets.buffer);
+  free(indexer->previous.buffer);
+  for (i = 0; i < INDEX_COLUMNS; i++) {
+    free(indexer->columns[i].buffer);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief maps an index file and checks that all sections are inside of it
+ *
+ * @param index the index to fill
+ * @param file the index file
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_index_open(index_t *index, char *file) {
+  static const size_t widths[INDEX_COLUMNS] = {2, 4, 4, 4, 4, 4, 8, 8, 8, 8, 8, 8, 1};
+  index_header_t *header;
+  struct stat attr;
+  int fd;
+  int i;
+
+  memset(index, 0, sizeof(*index));
+  index->file = file;
+
+  if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0) {
+    fprintf(stderr, "%s: open(%s): %s\n", program_name, file, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (fstat(fd, &attr) != 0) {
+    fprintf(stderr, "%s: fstat(%s): %s\n", program_name, file, strerror(errno));
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  if ((size_t)attr.st_size < sizeof(*header)) {
+    fprintf(stderr, "%s: %s: not an index\n", program_name, file);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  index->size = (size_t)attr.st_size;
+  index->base = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (index->base == MAP_FAILED) {
+    fprintf(stderr, "%s: mmap(%s): %s\n", program_name, file, strerror(errno));
+    index->base = NULL;
+    return EXIT_FAILURE;
+  }
+
+  header = (index_header_t *)index->base;
+  index->header = header;
+
+  if (memcmp(header->magic, INDEX_MAGIC, 8) != 0 || header->paths > index->size ||
+      header->paths_size > index->size - header->paths || header->targets > index->size ||
+      header->targets_size > index->size - header->targets || header->blocks % 8 ||
+      header->blocks > index->size ||
+      (header->count + INDEX_BLOCK - 1) / INDEX_BLOCK > (index->size - header->blocks) / 8) {
+    fprintf(stderr, "%s: %s: not an index or a different version\n", program_name, file);
+    do_index_close(index);
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < INDEX_COLUMNS; i++) {
+    if (header->columns[i] % 8 || header->columns[i] > index->size ||
+        header->count > (index->size - header->columns[i]) / widths[i]) {
+      fprintf(stderr, "%s: %s: the index is truncated\n", program_name, file);
+      do_index_close(index);
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* a query reads the paths from the start to the end */
+  madvise(index->base, index->size, MADV_SEQUENTIAL);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief unmaps an index
+ *
+ * @param index the index
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_index_close(index_t *index) {
+
+  if (index->base) {
+    munmap(index->base, index->size);
+    index->base = NULL;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief runs the compiled expression on the records of an index
+ * instead of the filesystem, for each location
+ *
+ * @param params the parsed parameters
+ * @param program the compiled expression
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_query_index(params_t *params, program_t *program) {
+  index_t index;
+  int parallel = options.threads > 1 && !params->location && !options.xdev;
+  int status = EXIT_SUCCESS;
+  int i;
+
+  if (do_index_open(&index, options.index) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  /* -prune skips the following records, which may be in the next block */
+  for (i = 0; i < program->count; i++) {
+    if (program->code[i].op == OP_PRUNE) {
+      parallel = 0;
+    }
+  }
+
+  if (parallel) {
+    status = do_query_parallel(&index, program);
+  } else {
+    /* without a location, all records are checked */
+    do {
+      if (do_query_location(&index, params->location, program, 0, index.header->count) !=
+          EXIT_SUCCESS) {
+        status = EXIT_FAILURE;
+      }
+
+      params = params->next;
+    } while (params && params->location && !output_failed);
+  }
+
+  do_index_close(&index);
+
+  if (do_free_output() != EXIT_SUCCESS || output_failed) {
+    status = EXIT_FAILURE;
+  }
+
+  if (errno != 0 || status != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief checks the blocks of records with options.threads threads;
+ * only used without locations, -prune and -xdev, which depend on previous records
+ *
+ * @param index the index
+ * @param program the compiled expression
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_query_parallel(index_t *index, program_t *program) {
+  query_t query = {index, program, 0, 0};
+  pthread_t *threads = calloc(options.threads, sizeof(*threads));
+  unsigned int started;
+  unsigned int i;
+  int error;
+
+  if (!threads) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  for (started = 0; started < options.threads; started++) {
+    if ((error = pthread_create(&threads[started], NULL, do_query_worker, &query))) {
+      fprintf(stderr, "%s: pthread_create(): %s\n", program_name, strerror(error));
+      query.failed = 1;
+      break;
+    }
+  }
+
+  /* the started threads take all blocks even if some could not be started */
+  if (started == 0) {
+    do_query_worker(&query);
+  }
+
+  for (i = 0; i < started; i++) {
+    if ((error = pthread_join(threads[i], NULL))) {
+      fprintf(stderr, "%s: pthread_join(): %s\n", program_name, strerror(error));
+      query.failed = 1;
+    }
+  }
+
+  free(threads);
+
+  return query.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * @brief the main loop of a query thread; checks blocks of records until all are taken
+ *
+ * @param arg the query
+ *
+ * @returns NULL
+ */
+void *do_query_worker(void *arg) {
+  query_t *query = arg;
+  uint64_t count = query->index->header->count;
+  uint64_t block;
+
+  errno = 0;
+
+  while (!output_failed &&
+         (block = __atomic_fetch_add(&query->next, 1, __ATOMIC_SEQ_CST)) * INDEX_BLOCK < count) {
+    uint64_t last = (block + 1) * INDEX_BLOCK < count ? (block + 1) * INDEX_BLOCK : count;
+
+    if (do_query_location(query->index, NULL, query->program, block * INDEX_BLOCK, last) !=
+        EXIT_SUCCESS) {
+      __atomic_store_n(&query->failed, 1, __ATOMIC_SEQ_CST);
+    }
+  }
+
+  /* errno is thread-local, same check as in do_location */
+  if (errno != 0 || do_free_output() != EXIT_SUCCESS) {
+    __atomic_store_n(&query->failed, 1, __ATOMIC_SEQ_CST);
+  }
+
+  do_merge_stats();
+
+  return NULL;
+}
+
+/**
+ * @brief runs the compiled expression on the records below a location;
+ * the records are in depth-first order, so the records below an entry follow it
+ * and have a greater depth, which is also how pruned subtrees are skipped
+ *
+ * @param index the index
+ * @param location the path of a record, NULL for all records
+ * @param program the compiled expression
+ * @param first the first record to check, the start of a block
+ * @param last the record after the last one to check
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_query_location(index_t *index, char *location, program_t *program, uint64_t first,
+                      uint64_t last) {
+  index_header_t *header = index->header;
+  uint16_t *depths = (uint16_t *)(index->base + header->columns[COL_DEPTH]);
+  uint32_t *modes = (uint32_t *)(index->base + header->columns[COL_MODE]);
+  uint64_t *devices = (uint64_t *)(index->base + header->columns[COL_DEV]);
+  size_t location_length = location ? do_trim_slashes(location, strlen(location)) : 0;
+  cursor_t cursor = {index, NULL, 0, {NULL, 0, 0}};
+  pathbuf_t *path = &cursor.path;
+  entry_t entry;
+  int found = !location;
+  int base = 0;  /* the depth of the location */
+  size_t root = 0; /* the length of the path of the location in the records */
+  int skip = -1; /* skip the records deeper than this */
+  uint64_t device = 0;
+  uint64_t i;
+  int status = EXIT_SUCCESS;
+
+  if (first < last && do_cursor_seek(&cursor, first) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  for (i = first; i < last && !output_failed; i++) {
+    int depth = depths[i];
+
+    if (do_cursor_next(&cursor) != EXIT_SUCCESS) {
+      free(path->buffer);
+      return EXIT_FAILURE;
+    }
+
+    if (found && depth <= base && location) {
+      break; /* the subtree of the location ends */
+    }
+
+    if (!found || depth <= base) {
+      /* the first record of a subtree to check */
+      if (location && (do_trim_slashes(path->buffer, path->length) != location_length ||
+                       memcmp(path->buffer, location, location_length) != 0)) {
+        continue;
+      }
+      found = 1;
+      base = depth;
+      root = path->length;
+      device = devices[i];
+    }
+
+    /* -maxdepth is also checked directly, the skip doesn't cross the blocks of threads */
+    if ((skip >= 0 && depth > skip) || (options.maxdepth >= 0 && depth - base > options.maxdepth)) {
+      continue;
+    }
+    skip = -1;
+
+    /* the location is printed as given, like in do_location */
+    entry.path = depth == base && location ? location : path->buffer;
+    entry.parent = AT_FDCWD;
+    entry.type = IFTODT(modes[i]);
+    entry.has_attr = 0;
+    entry.attr_failed = 0;
+    entry.pruned = 0;
+    entry.depth = depth - base;
+    entry.root = depth == base ? strlen(entry.path) : root;
+    entry.index = index;
+    entry.record = i;
+
+    if (depth == base) {
+      entry.base = do_get_basename(entry.path);
+    } else {
+      for (entry.base = path->buffer + path->length; entry.base[-1] != '/'; entry.base--) {
+      }
+    }
+    entry.name = entry.base;
+
+    if (!entry.base) {
+      status = EXIT_FAILURE;
+      break;
+    }
+
+    if (depth - base >= options.mindepth && do_file(&entry, program) != EXIT_SUCCESS) {
+      status = EXIT_FAILURE;
+    }
+
+    if (depth == base) {
+      free(entry.base);
+    }
+
+    /* same decisions as do_descend, the records below are skipped */
+    if (entry.pruned || (options.maxdepth >= 0 && depth - base >= options.maxdepth) ||
+        (options.xdev && devices[i] != device)) {
+      skip = depth;
+    }
+  }
+
+  free(path->buffer);
+
+  if (!found) {
+    fprintf(stderr, "%s: %s: not in the index\n", program_name, location ? location : "");
+    return EXIT_FAILURE;
+  }
+
+  return status;
+}
+
+/**
+ * @brief fills the attributes of a record from the index columns
+ *
+ * @param index the index
+ * @param record the record
+ * @param attr the attributes to fill
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_index_attr(index_t *index, uint64_t record, struct stat *attr) {
+  uint64_t *columns = index->header->columns;
+  char *base = index->base;
+
+  memset(attr, 0, sizeof(*attr));
+  attr->st_mode = ((uint32_t *)(base + columns[COL_MODE]))[record];
+  attr->st_uid = ((uint32_t *)(base + columns[COL_UID]))[record];
+  attr->st_gid = ((uint32_t *)(base + columns[COL_GID]))[record];
+  attr->st_nlink = ((uint32_t *)(base + columns[COL_NLINK]))[record];
+  attr->st_size = (off_t)((uint64_t *)(base + columns[COL_SIZE]))[record];
+  attr->st_mtime = (time_t)((int64_t *)(base + columns[COL_MTIME]))[record];
+  attr->st_ctime = (time_t)((int64_t *)(base + columns[COL_CTIME]))[record];
+  attr->st_ino = (ino_t)((uint64_t *)(base + columns[COL_INO]))[record];
+  attr->st_dev = (dev_t)((uint64_t *)(base + columns[COL_DEV]))[record];
+  attr->st_blocks = (blkcnt_t)((uint64_t *)(base + columns[COL_BLOCKS]))[record];
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief returns the symlink target of a record
+ *
+ * @param index the index
+ * @param record the record
+ *
+ * @returns the target, NULL if the record is not a symlink or the target is invalid
+ */
+char *do_index_target(index_t *index, uint64_t record) {
+  index_header_t *header = index->header;
+  uint32_t offset = ((uint32_t *)(index->base + header->columns[COL_LINK]))[record];
+  char *targets = index->base + header->targets;
+
+  if (offset == 0 || offset >= header->targets_size ||
+      !memchr(targets + offset, '\0', header->targets_size - offset)) {
+    return NULL;
+  }
+
+  return targets + offset;
+}
+
+/**
+ * @brief returns the length of a path without trailing slashes, "/" stays
+ *
+ * @param path the path
+ * @param length the length of the path
+ *
+ * @returns the trimmed length
+ */
+size_t do_trim_slashes(char *path, size_t length) {
+
+  while (length > 1 && path[length - 1] == '/') {
+    length--;
+  }
+
+  return length;
+}
+
+/**
+ * @brief positions the cursor so that the next do_cursor_next decodes the record;
+ * the decoding restarts at a block unless the record follows in the same block
+ *
+ * @param cursor the cursor
+ * @param record the record, less than the number of records
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if the index is corrupted
+ */
+int do_cursor_seek(cursor_t *cursor, uint64_t record) {
+  index_t *index = cursor->index;
+  uint64_t *blocks = (uint64_t *)(index->base + index->header->blocks);
+  uint64_t block = record / INDEX_BLOCK;
+
+  if (!cursor->position || record < cursor->next || block > cursor->next / INDEX_BLOCK) {
+    if (blocks[block] > index->header->paths_size) {
+      fprintf(stderr, "%s: %s: the index is corrupted\n", program_name, index->file);
+      return EXIT_FAILURE;
+    }
+    cursor->position = (unsigned char *)index->base + index->header->paths + blocks[block];
+    cursor->next = block * INDEX_BLOCK;
+    cursor->path.length = 0;
+  }
+
+  while (cursor->next < record) {
+    if (do_cursor_next(cursor) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief decodes the path of the next record into the cursor path
+ *
+ * @param cursor the cursor, positioned by do_cursor_seek
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if the index is corrupted
+ */
+int do_cursor_next(cursor_t *cursor) {
+  index_t *index = cursor->index;
+  unsigned char *end = (unsigned char *)index->base + index->header->paths +
+                       index->header->paths_size;
+  pathbuf_t *path = &cursor->path;
+  uint64_t values[2];
+  int i;
+
+  /* the shared prefix length and the suffix length */
+  for (i = 0; i < 2; i++) {
+    int shift = 0;
+
+    values[i] = 0;
+    do {
+      if (cursor->position >= end || shift > 63) {
+        fprintf(stderr, "%s: %s: the index is corrupted\n", program_name, index->file);
+        return EXIT_FAILURE;
+      }
+      values[i] |= (uint64_t)(*cursor->position & 0x7f) << shift;
+      shift += 7;
+    } while (*cursor->position++ & 0x80);
+  }
+
+  if (values[0] > path->length || values[1] > (uint64_t)(end - cursor->position) ||
+      do_pathbuf_reserve(path, values[0] + values[1] + 1) != EXIT_SUCCESS) {
+    fprintf(stderr, "%s: %s: the index is corrupted\n", program_name, index->file);
+    return EXIT_FAILURE;
+  }
+
+  memcpy(path->buffer + values[0], cursor->position, values[1]);
+  cursor->position += values[1];
+  path->length = values[0] + values[1];
+  path->buffer[path->length] = '\0';
+  cursor->next++;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief maps the previous index of -update-index and collects its directories
+ *
+ * @param snapshot the snapshot to fill
+ * @param file the index file
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_snapshot_open(snapshot_t *snapshot, char *file) {
+  index_t *index = &snapshot->index;
+  cursor_t *cursor = &snapshot->cursor;
+  uint32_t *modes;
+  uint64_t directories = 0;
+  uint64_t count;
+  uint64_t i;
+  int status = EXIT_SUCCESS;
+
+  memset(snapshot, 0, sizeof(*snapshot));
+  cursor->index = index;
+
+  if (do_index_open(index, file) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  /* the directories are looked up in traversal order, which differs from the index order */
+  madvise(index->base, index->size, MADV_NORMAL);
+
+  count = index->header->count;
+  modes = (uint32_t *)(index->base + index->header->columns[COL_MODE]);
+
+  for (i = 0; i < count; i++) {
+    if (S_ISDIR(modes[i])) {
+      directories++;
+    }
+  }
+
+  for (snapshot->capacity = 16; snapshot->capacity < directories * 2; snapshot->capacity *= 2) {
+  }
+
+  if (!(snapshot->buckets = calloc(snapshot->capacity, sizeof(*snapshot->buckets)))) {
+    fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+    do_snapshot_close(snapshot);
+    return EXIT_FAILURE;
+  }
+
+  if (count && do_cursor_seek(cursor, 0) != EXIT_SUCCESS) {
+    status = EXIT_FAILURE;
+  }
+
+  for (i = 0; i < count && status == EXIT_SUCCESS; i++) {
+    snapdir_t *directory;
+    size_t bucket;
+
+    if (do_cursor_next(cursor) != EXIT_SUCCESS) {
+      status = EXIT_FAILURE;
+      break;
+    }
+
+    if (!S_ISDIR(modes[i])) {
+      continue;
+    }
+
+    /* the path is stored right after the struct */
+    if (!(directory = malloc(sizeof(*directory) + cursor->path.length + 1))) {
+      fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+      status = EXIT_FAILURE;
+      break;
+    }
+
+    directory->path = (char *)(directory + 1);
+    memcpy(directory->path, cursor->path.buffer, cursor->path.length + 1);
+    directory->record = i;
+
+    bucket = do_hash_path(directory->path, snapshot->capacity);
+    directory->next = snapshot->buckets[bucket];
+    snapshot->buckets[bucket] = directory;
+  }
+
+  if (status != EXIT_SUCCESS) {
+    do_snapshot_close(snapshot);
+  }
+
+  return status;
+}
+
+/**
+ * @brief looks up a directory in the previous index
+ *
+ * @param snapshot the snapshot
+ * @param path the path of the directory
+ * @param record the record of the directory, set if it is found
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if the directory is not in the index
+ */
+int do_snapshot_find(snapshot_t *snapshot, char *path, uint64_t *record) {
+  snapdir_t *directory = snapshot->buckets[do_hash_path(path, snapshot->capacity)];
+
+  for (; directory; directory = directory->next) {
+    if (strcmp(directory->path, path) == 0) {
+      *record = directory->record;
+      return EXIT_SUCCESS;
+    }
+  }
+
+  return EXIT_FAILURE;
+}
+
+/**
+ * @brief frees the directories of a snapshot and unmaps its index
+ *
+ * @param snapshot the snapshot
+ *
+ * @returns EXIT_SUCCESS
+ */
+int do_snapshot_close(snapshot_t *snapshot) {
+  size_t i;
+
+  for (i = 0; snapshot->buckets && i < snapshot->capacity; i++) {
+    snapdir_t *directory = snapshot->buckets[i];
+
+    while (directory) {
+      snapdir_t *next = directory->next;
+
+      free(directory);
+      directory = next;
+    }
+  }
+
+  free(snapshot->buckets);
+  snapshot->buckets = NULL;
+  free(snapshot->cursor.path.buffer);
+  snapshot->cursor.path.buffer = NULL;
+  do_index_close(&snapshot->index);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief FNV-1a hash of a path
+ *
+ * @param path the path
+ * @param capacity the number of buckets, a power of 2
+ *
+ * @returns the bucket
+ */
+size_t do_hash_path(char *path, size_t capacity) {
+
+  return do_hash_text(path, strlen(path), capacity);
+}
+
+/**
+ * @brief reads a directory of an index being built, or with -update-index takes
+ * its entries from the previous index if it is unchanged; the record of the directory
+ * is marked complete by do_frame_close if all of its entries were recorded
+ *
+ * @param worker the traversal state, its path is the path of the directory
+ * @param entry the directory, its record was the last one added
+ * @param program the compiled expression
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_index_dir(worker_t *worker, entry_t *entry, program_t *program) {
+  size_t count = worker->indexer->columns[COL_FLAGS].length;
+  int error = errno;
+  frame_t *frame;
+
+  /* every failure sets errno, which is also how do_location detects them */
+  errno = 0;
+
+  if (!worker->snapshot || do_reuse_dir(worker, entry) != EXIT_SUCCESS) {
+    errno = 0; /* do_frame_open reports it if the directory can't be opened */
+
+    if (do_frame_open(worker, entry->parent, entry->name) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  frame = &worker->frames[worker->frame_count - 1];
+  frame->flag = count;
+  frame->error = error;
+
+  return do_walk(worker, program);
+}
+
+/**
+ * @brief takes the entries of an unchanged directory from the previous index instead of
+ * reading it; the frame returns the entries to be checked and recorded like in do_dir,
+ * but only the subdirectories are read with fstatat, as their contents may have changed
+ *
+ * adding, removing or renaming an entry changes the mtime and ctime of the directory;
+ * a directory changed in the second the previous index was started is read again,
+ * the times are stored in seconds
+ *
+ * @param worker the traversal state, its path is the path of the directory
+ * @param entry the directory
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if the directory has to be read
+ */
+int do_reuse_dir(worker_t *worker, entry_t *entry) {
+  index_t *index = &worker->snapshot->index;
+  index_header_t *header = index->header;
+  uint16_t *depths = (uint16_t *)(index->base + header->columns[COL_DEPTH]);
+  uint8_t *flags = (uint8_t *)(index->base + header->columns[COL_FLAGS]);
+  struct stat *attr = do_get_attr(entry);
+  struct stat previous;
+  dirreader_t reader;
+  frame_t *frame;
+  uint64_t record;
+
+  if (!attr || do_snapshot_find(worker->snapshot, worker->path.buffer, &record) != EXIT_SUCCESS ||
+      !(flags[record] & INDEX_COMPLETE)) {
+    return EXIT_FAILURE;
+  }
+
+  do_index_attr(index, record, &previous);
+  if (previous.st_mtime != attr->st_mtime || previous.st_ctime != attr->st_ctime ||
+      previous.st_ino != attr->st_ino || previous.st_dev != attr->st_dev ||
+      (int64_t)attr->st_ctime >= header->created) {
+    return EXIT_FAILURE;
+  }
+
+  /* the entries are checked relative to the directory like in do_dir */
+  memset(&reader, 0, sizeof(reader));
+  if ((reader.fd = openat(entry->parent, entry->name,
+                          O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+    return EXIT_FAILURE;
+  }
+
+  if (!(frame = do_frame_push(worker, &reader))) {
+    close(reader.fd);
+    return EXIT_FAILURE;
+  }
+
+  frame->kind = FRAME_REUSE;
+  frame->record = record + 1;
+  frame->record_depth = depths[record];
+  STATS_COUNT(dirs_reused);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief returns the next entry of an unchanged directory from the previous index;
+ * the entries are the records one level deeper up to the next sibling of the directory
+ *
+ * @param worker the traversal state with the previous index
+ * @param frame the top frame
+ * @param entry the entry to fill, the name is valid until the cursor moves
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE at the end of the directory or on errors
+ */
+int do_reuse_next(worker_t *worker, frame_t *frame, entry_t *entry) {
+  index_t *index = &worker->snapshot->index;
+  index_header_t *header = index->header;
+  uint16_t *depths = (uint16_t *)(index->base + header->columns[COL_DEPTH]);
+  uint32_t *modes = (uint32_t *)(index->base + header->columns[COL_MODE]);
+  cursor_t *cursor = &worker->snapshot->cursor;
+  uint64_t i = frame->record;
+
+  if (i >= header->count || depths[i] <= frame->record_depth) {
+    return EXIT_FAILURE;
+  }
+
+  if (do_cursor_seek(cursor, i) != EXIT_SUCCESS || do_cursor_next(cursor) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  /* the name points into the cursor, the frames above move it; do_entry is done with it first */
+  for (entry->name = cursor->path.buffer + cursor->path.length; entry->name[-1] != '/';
+       entry->name--) {
+  }
+
+  entry->parent = frame->reader.fd;
+  entry->base = entry->name;
+  entry->type = IFTODT(modes[i]);
+  entry->has_attr = 0;
+  entry->attr_failed = 0;
+  entry->pruned = 0;
+  entry->index = S_ISDIR(modes[i]) ? NULL : index;
+  entry->record = i;
+
+  /* the records below the entry belong to its own frame */
+  for (i++; i < header->count && depths[i] > frame->record_depth + 1; i++) {
+  }
+  frame->record = i;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief prepares the events of -watch; fanotify if it is permitted and the handles of
+ * the locations can be opened, otherwise inotify
+ *
+ * @param watcher the watcher to fill
+ * @param params the parsed parameters with the locations
+ * @param program the compiled expression
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_watch_open(watcher_t *watcher, params_t *params, program_t *program) {
+  int error = errno;
+
+  memset(watcher, 0, sizeof(*watcher));
+  watcher->fanotify = -1;
+  watcher->inotify = -1;
+
+#ifdef HAVE_FANOTIFY_NAMES
+  {
+    int usable = 1;
+    int i;
+
+    /* -prune depends on the directories above an entry, which fanotify doesn't check */
+    for (i = 0; i < program->count; i++) {
+      if (program->code[i].op == OP_PRUNE) {
+        usable = 0;
+      }
+    }
+
+    /* fails without CAP_SYS_ADMIN */
+    if (usable && (watcher->fanotify = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+                                                         FAN_CLOEXEC,
+                                                     O_RDONLY | O_CLOEXEC)) < 0) {
+      usable = 0;
+    }
+
+    /* the events carry directory handles, opening them needs CAP_DAC_READ_SEARCH */
+    do {
+      char *location = params->location ? params->location : ".";
+      struct {
+        struct file_handle handle;
+        unsigned char bytes[MAX_HANDLE_SZ];
+      } probe;
+      watchroot_t *roots;
+      struct stat attr;
+      char *real;
+      int mount;
+      int fd;
+
+      if (!usable || stat(location, &attr) != 0 || !S_ISDIR(attr.st_mode)) {
+        continue; /* do_location reports missing locations */
+      }
+
+      probe.handle.handle_bytes = MAX_HANDLE_SZ;
+      if (name_to_handle_at(AT_FDCWD, location, &probe.handle, &mount, 0) != 0 ||
+          (fd = open_by_handle_at(AT_FDCWD, &probe.handle, O_PATH | O_CLOEXEC)) < 0) {
+        usable = 0;
+        continue;
+      }
+      close(fd);
+
+      if (!(real = realpath(location, NULL))) {
+        fprintf(stderr, "%s: realpath(%s): %s\n", program_name, location, strerror(errno));
+        do_watch_close(watcher);
+        return EXIT_FAILURE;
+      }
+
+      roots = realloc(watcher->roots, sizeof(*roots) * (watcher->root_count + 1));
+      if (!roots) {
+        fprintf(stderr, "%s: realloc(): %s\n", program_name, strerror(errno));
+        free(real);
+        do_watch_close(watcher);
+        return EXIT_FAILURE;
+      }
+
+      watcher->roots = roots;
+      roots[watcher->root_count].location = location;
+      roots[watcher->root_count].real = real;
+      roots[watcher->root_count].device = attr.st_dev;
+      watcher->root_count++;
+    } while ((params = params->next) && params->location);
+
+    if (usable) {
+      errno = error;
+      return EXIT_SUCCESS;
+    }
+
+    do_watch_close(watcher);
+  }
+#else
+  (void)params;
+  (void)program;
+#endif
+
+  /* the probes above may fail, that is no error */
+  errno = error;
+
+  if ((watcher->inotify = inotify_init1(IN_CLOEXEC)) < 0) {
+    fprintf(stderr, "%s: inotify_init1(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief registers a directory being read for the events; with fanotify
+ * only its filesystem is marked, once
+ *
+ * @param worker the traversal state, its path and depth are the ones of the directory
+ * @param fd the opened directory
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_watch_dir(worker_t *worker, int fd) {
+  watcher_t *watcher = worker->watcher;
+  char *path = worker->path.buffer;
+  size_t length = worker->path.length;
+  struct stat attr;
+  watch_t *watch;
+  size_t bucket;
+  int wd;
+
+  if (fstat(fd, &attr) != 0) {
+    fprintf(stderr, "%s: fstat(%s): %s\n", program_name, path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (watcher->fanotify >= 0) {
+    return do_watch_filesystem(watcher, fd, attr.st_dev);
+  }
+
+  if (watcher->full) {
+    return EXIT_FAILURE;
+  }
+
+  if ((wd = inotify_add_watch(watcher->inotify, path, WATCH_INOTIFY)) < 0) {
+    fprintf(stderr, "%s: inotify_add_watch(%s): %s\n", program_name, path, strerror(errno));
+    /* the memory of the watches is bounded by fs.inotify.max_user_watches */
+    if (errno == ENOSPC) {
+      fprintf(stderr, "%s: the following directories are not watched\n", program_name);
+      watcher->full = 1;
+    }
+    return EXIT_FAILURE;
+  }
+
+  /* a directory moved within the tree keeps its descriptor, the path changes */
+  do_watch_forget(watcher, wd);
+
+  if (watcher->count >= watcher->capacity / 2) {
+    size_t capacity = watcher->capacity ? watcher->capacity * 2 : 256;
+    watch_t **buckets = calloc(capacity, sizeof(*buckets));
+    size_t i;
+
+    if (!buckets) {
+      fprintf(stderr, "%s: calloc(): %s\n", program_name, strerror(errno));
+      inotify_rm_watch(watcher->inotify, wd);
+      return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < watcher->capacity; i++) {
+      while ((watch = watcher->buckets[i])) {
+        watcher->buckets[i] = watch->next;
+        bucket = do_hash_id((unsigned int)watch->wd, capacity);
+        watch->next = buckets[bucket];
+        buckets[bucket] = watch;
+      }
+    }
+
+    free(watcher->buckets);
+    watcher->buckets = buckets;
+    watcher->capacity = capacity;
+  }
+
+  /* the path is stored right after the struct */
+  if (!(watch = malloc(sizeof(*watch) + length + 1))) {
+    fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
+    inotify_rm_watch(watcher->inotify, wd);
+    return EXIT_FAILURE;
+  }
+
+  watch->wd = wd;
+  watch->depth = worker->depth;
+  watch->device = attr.st_dev;
+  watch->inode = attr.st_ino;
+  watch->root = worker->device;
+  watch->location = worker->root;
+  watch->path = (char *)(watch + 1);
+  memcpy(watch->path, path, length + 1);
+
+  bucket = do_hash_id((unsigned int)wd, watcher->capacity);
+  watch->next = watcher->buckets[bucket];
+  watcher->buckets[bucket] = watch;
+  watcher->count++;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief marks the filesystem of a directory with fanotify unless it is already marked
+ *
+ * @param watcher the watcher
+ * @param fd a directory on the filesystem
+ * @param device the device of the directory
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_watch_filesystem(watcher_t *watcher, int fd, dev_t device) {
+#ifdef HAVE_FANOTIFY_NAMES
+  watchfs_t *filesystems;
+  struct statfs attr;
+  size_t i;
+
+  for (i = 0; i < watcher->filesystem_count; i++) {
+    if (watcher->filesystems[i].device == device) {
+      return EXIT_SUCCESS;
+    }
+  }
+
+  if (fstatfs(fd, &attr) != 0) {
+    fprintf(stderr, "%s: fstatfs(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (fanotify_mark(watcher->fanotify, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                    FAN_CREATE | FAN_MOVED_TO | FAN_CLOSE_WRITE | FAN_ONDIR, fd, NULL) != 0) {
+    fprintf(stderr, "%s: fanotify_mark(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  filesystems = realloc(watcher->filesystems, sizeof(*filesystems) * (i + 1));
+  if (!filesystems) {
+    fprintf(stderr, "%s: realloc(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  watcher->filesystems = filesystems;
+  filesystems[i].device = device;
+  memcpy(filesystems[i].fsid, &attr.f_fsid, sizeof(filesystems[i].fsid));
+  if ((filesystems[i].fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+    fprintf(stderr, "%s: fcntl(): %s\n", program_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  watcher->filesystem_count++;
+
+  return EXIT_SUCCESS;
+#else
+  (void)watcher;
+  (void)fd;
+  (void)device;
+
+  return EXIT_FAILURE;
+#endif
+}
+
+/**
+ * @brief checks the entries of the events until interrupted, or with inotify
+ * until no directory is watched anymore; the output is written after each read
+ *
+ * @param worker the traversal state
+ * @param program the compiled expression
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_watch(worker_t *worker, program_t *program) {
+  watcher_t *watcher = worker->watcher;
+  char buffer[65536] __attribute__((aligned(8)));
+  int fd = watcher->fanotify >= 0 ? watcher->fanotify : watcher->inotify;
+  ssize_t length;
+  int status = EXIT_SUCCESS;
+
+  /* the matches of the traversal are complete */
+  if (do_flush() != EXIT_SUCCESS || do_exec_flush_all(program) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  while (!output_failed && (watcher->fanotify >= 0 || watcher->count > 0)) {
+    if ((length = read(fd, buffer, sizeof(buffer))) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "%s: read(): %s\n", program_name, strerror(errno));
+      return EXIT_FAILURE;
+    }
+
+    if (watcher->fanotify >= 0) {
+      status = do_watch_fanotify(worker, buffer, (size_t)length, program);
+    } else {
+      status = do_watch_inotify(worker, buffer, (size_t)length, program);
+    }
 
-    params = params->next;
-  } while (params && params->location);
-
-  /* GNU find returns 1 even if a single entry failed */
-  if (errno != 0) {
-    return EXIT_FAILURE;
+    if (status != EXIT_SUCCESS || do_flush() != EXIT_SUCCESS ||
+        do_exec_flush_all(program) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
   }
 
-  return EXIT_SUCCESS;
+  return status;
 }
 
 /**
- * @brief checks the entry using subfunctions based on params, if passed, prints it
+ * @brief checks the entries of a read of inotify events
  *
- * @param path the path to be processed
- * @param params the parsed parameters
- * @param attr the entry attributes from lstat
+ * @param worker the traversal state
+ * @param buffer the events
+ * @param length the length of the events
+ * @param program the compiled expression
  *
  * @returns EXIT_SUCCESS, EXIT_FAILURE
  */
-int do_file(char *path, params_t *params, struct stat attr) {
-  int printed = 0;
+int do_watch_inotify(worker_t *worker, char *buffer, size_t length, program_t *program) {
+  watcher_t *watcher = worker->watcher;
+  struct inotify_event *event;
+  struct stat attr;
+  watch_t *watch;
+  size_t offset;
+  int error;
+  int fd;
 
-  do {
-    /* filtering */
-    if (params->type) {
-      if (do_type(params->type, attr) != EXIT_SUCCESS) {
-        return EXIT_SUCCESS; /* the entry didn't pass the check, do not print it */
-      }
-    }
-    if (params->nouser) {
-      if (do_nouser(attr) != EXIT_SUCCESS) {
-        return EXIT_SUCCESS;
-      }
-    }
-    if (params->user) {
-      if (do_user(params->userid, attr) != EXIT_SUCCESS) {
-        return EXIT_SUCCESS;
-      }
-    }
-    if (params->name) {
-      if (do_name(path, params->name) != EXIT_SUCCESS) {
-        return EXIT_SUCCESS;
-      }
+  for (offset = 0; offset + sizeof(*event) <= length; offset += sizeof(*event) + event->len) {
+    event = (struct inotify_event *)(buffer + offset);
+
+    if (event->mask & IN_Q_OVERFLOW) {
+      fprintf(stderr, "%s: inotify: the event queue overflowed, entries were missed\n",
+              program_name);
+      continue;
     }
-    if (params->path) {
-      if (do_path(path, params->path) != EXIT_SUCCESS) {
-        return EXIT_SUCCESS;
-      }
+
+    if (event->mask & IN_IGNORED) {
+      do_watch_forget(watcher, event->wd);
+      continue;
     }
-    /* printing */
-    if (params->print) {
-      if (do_print(path) != EXIT_SUCCESS) {
-        return EXIT_FAILURE; /* a fatal error occurred */
-      }
-      printed = 1;
+
+    if (!(watch = do_watch_find(watcher, event->wd))) {
+      continue;
     }
-    if (params->ls) {
-      if (do_ls(path, attr) != EXIT_SUCCESS) {
-        return EXIT_FAILURE;
+
+    /*
+     * a directory moved or deleted is not watched anymore;
+     * one moved within the tree is registered again from its new parent
+     */
+    error = errno;
+    if ((fd = open(watch->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0 ||
+        fstat(fd, &attr) != 0 || attr.st_dev != watch->device || attr.st_ino != watch->inode) {
+      if (fd >= 0) {
+        close(fd);
       }
-      printed = 1;
+      inotify_rm_watch(watcher->inotify, event->wd);
+      errno = error;
+      continue;
     }
 
-    params = params->next;
-  } while (params);
-
-  if (printed == 0) {
-    if (do_print(path) != EXIT_SUCCESS) {
-      return EXIT_FAILURE;
+    if (event->len && (event->mask & (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE)) &&
+        do_pathbuf_append(&worker->path, 0, watch->path) == EXIT_SUCCESS) {
+      worker->device = watch->root;
+      worker->root = watch->location;
+      do_watch_entry(worker, fd, watch->depth, event->name, event->mask & IN_CREATE, program);
     }
+
+    close(fd);
   }
 
   return EXIT_SUCCESS;
 }
 
 /**
- * @brief calls do_file on each directory entry recursively
+ * @brief checks the entries of a read of fanotify events; the directory handle of
+ * an event is opened and its path matched against the resolved locations
  *
- * @param path the path to be processed
- * @param params the parsed parameters
- * @param attr the entry attributes from lstat
+ * @param worker the traversal state
+ * @param buffer the events
+ * @param length the length of the events
+ * @param program the compiled expression
  *
  * @returns EXIT_SUCCESS, EXIT_FAILURE
  */
-int do_dir(char *path, params_t *params, struct stat attr) {
-  DIR *dir;
-  struct dirent *entry;
-  size_t length;
-  char *slash = "";
-  char *full_path;
+int do_watch_fanotify(worker_t *worker, char *buffer, size_t length, program_t *program) {
+#ifdef HAVE_FANOTIFY_NAMES
+  watcher_t *watcher = worker->watcher;
+  struct fanotify_event_metadata *event = (struct fanotify_event_metadata *)buffer;
+  ssize_t remaining = (ssize_t)length;
+  char link[32];
+  char real[PATH_MAX];
 
-  dir = opendir(path);
+  for (; FAN_EVENT_OK(event, remaining); event = FAN_EVENT_NEXT(event, remaining)) {
+    struct fanotify_event_info_fid *info = (struct fanotify_event_info_fid *)(event + 1);
+    struct file_handle *handle = (struct file_handle *)info->handle;
+    watchroot_t *root = NULL;
+    char *name;
+    char *suffix = NULL;
+    ssize_t size;
+    size_t i;
+    int error = errno;
+    int mount = -1;
+    int depth = 0;
+    int fd;
 
-  if (!dir) {
-    fprintf(stderr, "%s: opendir(%s): %s\n", program_name, path, strerror(errno));
-    return EXIT_FAILURE;
-  }
+    if (event->vers != FANOTIFY_METADATA_VERSION) {
+      fprintf(stderr, "%s: fanotify: unsupported event version %d\n", program_name, event->vers);
+      return EXIT_FAILURE;
+    }
 
-  while ((entry = readdir(dir))) {
-    /* skip '.' and '..' */
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+    if (event->mask & FAN_Q_OVERFLOW) {
+      fprintf(stderr, "%s: fanotify: the event queue overflowed, entries were missed\n",
+              program_name);
       continue;
     }
 
-    length = strlen(path);
-    
-    /* add a trailing slash if not present */
-    if (path[length - 1] != '/') {
-      slash = "/";
+    if (event->event_len < sizeof(*event) + sizeof(*info) ||
+        info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+      continue;
     }
 
-    /* allocate memory for the full entry path */
-    length += strlen(entry->d_name) + 2;
-    full_path = malloc(sizeof(char) * length);
-
-    if (!full_path) {
-      fprintf(stderr, "%s: malloc(): %s\n", program_name, strerror(errno));
-      break; /* a return would require a closedir() */
+    name = (char *)handle->f_handle + handle->handle_bytes;
+    if (strcmp(name, ".") == 0) {
+      continue; /* an event on the directory itself */
     }
 
-    /* concat the path with the entry name */
-    if (snprintf(full_path, length, "%s%s%s", path, slash, entry->d_name) < 0) {
-      fprintf(stderr, "%s: snprintf(): %s\n", program_name, strerror(errno));
-      free(full_path);
-      break;
+    for (i = 0; i < watcher->filesystem_count; i++) {
+      if (memcmp(watcher->filesystems[i].fsid, &info->fsid, 8) == 0) {
+        mount = watcher->filesystems[i].fd;
+      }
     }
 
-    /* process the entry */
-    if (lstat(full_path, &attr) == 0) {
-      /*
-       * there are no returns for do_file and do_dir on purpose here;
-       * it is normal for a single entry to fail, then we try the next one
-       */
-      do_file(full_path, params, attr);
+    /* the directory may be gone already */
+    if (mount < 0 ||
+        (fd = open_by_handle_at(mount, handle, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+      errno = error;
+      continue;
+    }
 
-      /* if a directory, call the function recursively */
-      if (S_ISDIR(attr.st_mode)) {
-        do_dir(full_path, params, attr);
-      }
-    } else {
-      fprintf(stderr, "%s: lstat(%s): %s\n", program_name, full_path, strerror(errno));
-      free(full_path);
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    if ((size = readlink(link, real, sizeof(real) - 1)) < 0) {
+      errno = error;
+      close(fd);
       continue;
     }
+    real[size] = '\0';
 
-    free(full_path);
-  }
+    /* the first location the directory is below, the path is printed relative to it */
+    for (i = 0; i < watcher->root_count && !root; i++) {
+      size_t prefix = strlen(watcher->roots[i].real);
 
-  if (closedir(dir) != 0) {
-    fprintf(stderr, "%s: closedir(%s): %s\n", program_name, path, strerror(errno));
-    return EXIT_FAILURE;
-  }
+      if (strncmp(real, watcher->roots[i].real, prefix) == 0 &&
+          (real[prefix] == '\0' || real[prefix] == '/' || prefix == 1)) {
+        root = &watcher->roots[i];
+        suffix = real + prefix + (real[prefix] == '/');
+      }
+    }
 
-  return EXIT_SUCCESS;
-}
+    if (root) {
+      for (i = 0; suffix[i]; i++) {
+        depth += suffix[i] == '/';
+      }
+      depth += *suffix != '\0';
 
-/**
- * @brief prints out the path
- *
- * @param path the path to be processed
- *
- * @returns EXIT_SUCCESS, EXIT_FAILURE
- */
-int do_print(char *path) {
+      if (do_pathbuf_append(&worker->path, 0, root->location) == EXIT_SUCCESS &&
+          (!*suffix ||
+           do_pathbuf_append(&worker->path, worker->path.length, suffix) == EXIT_SUCCESS)) {
+        worker->device = root->device;
+        worker->root = strlen(root->location);
+        do_watch_entry(worker, fd, depth, name, event->mask & FAN_CREATE, program);
+      }
+    }
 
-  if (printf("%s\n", path) < 0) {
-    fprintf(stderr, "%s: printf(): %s\n", program_name, strerror(errno));
-    return EXIT_FAILURE;
+    close(fd);
   }
 
   return EXIT_SUCCESS;
+#else
+  (void)worker;
+  (void)buffer;
+  (void)length;
+  (void)program;
+
+  return EXIT_FAILURE;
+#endif
 }
 
 /**
- * @brief prints out the path with details
+ * @brief checks an entry of an event like do_entry, including the entries below
+ * a new directory; a new regular file is checked once it is closed after writing
  *
- * @param path the path to be processed
- * @param attr the entry attributes from lstat
+ * @param worker the traversal state, its path is the path of the directory
+ * @param fd the directory
+ * @param depth the depth of the directory
+ * @param name the name of the entry
+ * @param created the event is the creation of the entry
+ * @param program the compiled expression
  *
  * @returns EXIT_SUCCESS, EXIT_FAILURE
  */
-int do_ls(char *path, struct stat attr) {
-  unsigned long inode = attr.st_ino;
-  long long blocks = S_ISLNK(attr.st_mode) ? 0 : attr.st_blocks / 2;
-  char *perms = do_get_perms(attr);
-  unsigned long links = attr.st_nlink;
-  char *user = do_get_user(attr);
-  char *group = do_get_group(attr);
-  long long size = attr.st_size;
-  char *mtime = do_get_mtime(attr);
-  char *s = do_get_symlink(path, attr);
-  char *arrow = s ? " -> " : "";
-  char *symlink = s ? s : "";
+int do_watch_entry(worker_t *worker, int fd, int depth, char *name, int created,
+                   program_t *program) {
+  size_t length = worker->path.length;
+  entry_t entry;
+  int status;
 
-  if (printf("%6lu %4lld %10s %3lu %-8s %-8s %8lld %12s %s%s%s\n", inode, blocks, perms, links,
-             user, group, size, mtime, path, arrow, symlink) < 0) {
-    fprintf(stderr, "%s: printf(): %s\n", program_name, strerror(errno));
-    free(s);
+  /* the traversal didn't check the entries below -maxdepth either */
+  if (options.maxdepth >= 0 && depth >= options.maxdepth) {
+    return EXIT_SUCCESS;
+  }
+
+  if (fstatat(fd, name, &entry.attr, AT_SYMLINK_NOFOLLOW) != 0) {
+    if (errno == ENOENT) {
+      errno = 0;
+      return EXIT_SUCCESS; /* removed again already, e.g. a temporary file */
+    }
+    fprintf(stderr, "%s: fstatat(%s/%s): %s\n", program_name, worker->path.buffer, name,
+            strerror(errno));
     return EXIT_FAILURE;
   }
 
-  free(s);
+  if (created && S_ISREG(entry.attr.st_mode) && entry.attr.st_nlink == 1) {
+    return EXIT_SUCCESS;
+  }
 
-  return EXIT_SUCCESS;
+  entry.parent = fd;
+  entry.name = name;
+  entry.base = name;
+  entry.type = IFTODT(entry.attr.st_mode);
+  entry.has_attr = 1;
+  entry.attr_failed = 0;
+  entry.pruned = 0;
+  entry.index = NULL;
+
+  worker->depth = depth + 1;
+  status = do_entry(worker, &entry, length, program);
+  worker->path.length = length;
+  worker->path.buffer[length] = '\0';
+
+  return status;
 }
 
 /**
- * @brief checks if the type matches the entry attributes
+ * @brief returns the inotify watch of a descriptor
  *
- * @param type the type to match against
- * @param attr the entry attributes from lstat
+ * @param watcher the watcher
+ * @param wd the watch descriptor
  *
- * @returns EXIT_SUCCESS, EXIT_FAILURE
+ * @returns the watch, NULL if it is unknown
  */
-int do_type(char type, struct stat attr) {
+watch_t *do_watch_find(watcher_t *watcher, int wd) {
+  watch_t *watch;
 
-  /* comparing two chars */
-  if (type == do_get_type(attr)) {
-    return EXIT_SUCCESS;
+  if (!watcher->capacity) {
+    return NULL;
   }
 
-  return EXIT_FAILURE;
+  for (watch = watcher->buckets[do_hash_id((unsigned int)wd, watcher->capacity)]; watch;
+       watch = watch->next) {
+    if (watch->wd == wd) {
+      return watch;
+    }
+  }
+
+  return NULL;
 }
 
 /**
- * @brief checks if the entry doesn't have a user
+ * @brief removes the inotify watch of a descriptor from the table
  *
- * @param attr the entry attributes from lstat
+ * @param watcher the watcher
+ * @param wd the watch descriptor
  *
- * @returns EXIT_SUCCESS, EXIT_FAILURE
+ * @returns EXIT_SUCCESS, EXIT_FAILURE if it is unknown
  */
-int do_nouser(struct stat attr) {
-  static unsigned int cache_uid = UINT_MAX;
+int do_watch_forget(watcher_t *watcher, int wd) {
+  watch_t **link;
 
-  /* skip getgrgid if we have the record in cache */
-  if (cache_uid == attr.st_uid) {
+  if (!watcher->capacity) {
     return EXIT_FAILURE;
   }
 
-  /* reset the cache */
-  cache_uid = UINT_MAX;
+  for (link = &watcher->buckets[do_hash_id((unsigned int)wd, watcher->capacity)]; *link;
+       link = &(*link)->next) {
+    if ((*link)->wd == wd) {
+      watch_t *watch = *link;
 
-  if (!getpwuid(attr.st_uid)) {
-    return EXIT_SUCCESS;
+      *link = watch->next;
+      free(watch);
+      watcher->count--;
+      return EXIT_SUCCESS;
+    }
   }
 
-  /* cache an existing user (more common) */
-  cache_uid = attr.st_uid;
-
   return EXIT_FAILURE;
 }
 
 /**
- * @brief checks if the userid matches the entry attribute
+ * @brief closes the descriptors of the watcher and frees the watches
  *
- * @param userid the uid to match against
- * @param attr the entry attributes from lstat
+ * @param watcher the watcher
  *
- * @returns EXIT_SUCCESS, EXIT_FAILURE
+ * @returns EXIT_SUCCESS
  */
-int do_user(unsigned int userid, struct stat attr) {
+int do_watch_close(watcher_t *watcher) {
+  size_t i;
 
-  if (userid == attr.st_uid) {
-    return EXIT_SUCCESS;
-  }
+  for (i = 0; i < watcher->capacity; i++) {
+    while (watcher->buckets[i]) {
+      watch_t *watch = watcher->buckets[i];
 
-  return EXIT_FAILURE;
-}
+      watcher->buckets[i] = watch->next;
+      free(watch);
+    }
+  }
+  free(watcher->buckets);
+  watcher->buckets = NULL;
+  watcher->capacity = 0;
+  watcher->count = 0;
 
-/**
- * @brief checks if the filename matches the pattern
- *
- * @param path the entry path
- * @param pattern the pattern to match against
- *
- * @returns EXIT_SUCCESS, EXIT_FAILURE
- */
-int do_name(char *path, char *pattern) {
-  char *filename = basename(path);
-  int flags = 0;
+  for (i = 0; i < watcher->root_count; i++) {
+    free(watcher->roots[i].real);
+  }
+  free(watcher->roots);
+  watcher->roots = NULL;
+  watcher->root_count = 0;
 
-  if (fnmatch(pattern, filename, flags) == 0) {
-    return EXIT_SUCCESS;
+  for (i = 0; i < watcher->filesystem_count; i++) {
+    close(watcher->filesystems[i].fd);
   }
+  free(watcher->filesystems);
+  watcher->filesystems = NULL;
+  watcher->filesystem_count = 0;
 
-  /* basename manual: do not pass the returned pointer to free() */
+  if (watcher->fanotify >= 0) {
+    close(watcher->fanotify);
+    watcher->fanotify = -1;
+  }
+  if (watcher->inotify >= 0) {
+    close(watcher->inotify);
+    watcher->inotify = -1;
+  }
 
-  return EXIT_FAILURE;
+  return EXIT_SUCCESS;
 }
 
 /**
- * @brief checks if the path matches the pattern
- *
- * @param path the entry path
- * @param pattern the pattern to match against
+ * @brief returns the current time for -stats
  *
- * @returns EXIT_SUCCESS, EXIT_FAILURE
+ * @returns the nanoseconds of CLOCK_MONOTONIC
  */
-int do_path(char *path, char *pattern) {
-  int flags = 0;
+uint64_t do_stats_clock(void) {
+  struct timespec now;
 
-  if (fnmatch(pattern, path, flags) == 0) {
-    return EXIT_SUCCESS;
-  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
 
-  return EXIT_FAILURE;
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
 }
 
 /**
- * @brief converts the entry attributes to a readable type
+ * @brief counts a call of a phase and starts timing every STATS_SAMPLE-th one
  *
- * @param attr the entry attributes from lstat
+ * @param phase the phase
  *
- * @returns the entry type as a char
+ * @returns the start time to pass to do_stats_end, 0 if the call is not timed
  */
-char do_get_type(struct stat attr) {
+uint64_t do_stats_begin(int phase) {
 
-  /* block special file */
-  if (S_ISBLK(attr.st_mode)) {
-    return 'b';
-  }
-  /* character special file */
-  if (S_ISCHR(attr.st_mode)) {
-    return 'c';
-  }
-  /* directory */
-  if (S_ISDIR(attr.st_mode)) {
-    return 'd';
-  }
-  /* fifo (named pipe) */
-  if (S_ISFIFO(attr.st_mode)) {
-    return 'p';
-  }
-  /* regular file */
-  if (S_ISREG(attr.st_mode)) {
-    return 'f';
-  }
-  /* symbolic link */
-  if (S_ISLNK(attr.st_mode)) {
-    return 'l';
-  }
-  /* socket */
-  if (S_ISSOCK(attr.st_mode)) {
-    return 's';
+  if (stats.calls[phase]++ % STATS_SAMPLE != 0 || !options.stats) {
+    return 0;
   }
 
-  /* some other file type */
-  return '?';
+  return do_stats_clock();
 }
 
 /**
- * @brief converts the entry attributes to readable permissions
- *
- * @param attr the entry attributes from lstat
+ * @brief adds the time of a timed call to its phase
  *
- * @returns the entry permissions as a string
+ * @param phase the phase
+ * @param start the result of do_stats_begin
  */
-char *do_get_perms(struct stat attr) {
-  static char perms[11];
-  char type = do_get_type(attr);
-
-  /*
-   * cast is used to avoid the IDE warnings
-   * about int possibly not fitting into char
-   */
-  perms[0] = (char)(type == 'f' ? '-' : type);
-  perms[1] = (char)(attr.st_mode & S_IRUSR ? 'r' : '-');
-  perms[2] = (char)(attr.st_mode & S_IWUSR ? 'w' : '-');
-  perms[3] = (char)(attr.st_mode & S_ISUID ? (attr.st_mode & S_IXUSR ? 's' : 'S')
-                                           : (attr.st_mode & S_IXUSR ? 'x' : '-'));
-  perms[4] = (char)(attr.st_mode & S_IRGRP ? 'r' : '-');
-  perms[5] = (char)(attr.st_mode & S_IWGRP ? 'w' : '-');
-  perms[6] = (char)(attr.st_mode & S_ISGID ? (attr.st_mode & S_IXGRP ? 's' : 'S')
-                                           : (attr.st_mode & S_IXGRP ? 'x' : '-'));
-  perms[7] = (char)(attr.st_mode & S_IROTH ? 'r' : '-');
-  perms[8] = (char)(attr.st_mode & S_IWOTH ? 'w' : '-');
-  perms[9] = (char)(attr.st_mode & S_ISVTX ? (attr.st_mode & S_IXOTH ? 't' : 'T')
-                                           : (attr.st_mode & S_IXOTH ? 'x' : '-'));
-  perms[10] = '\0';
+void do_stats_end(int phase, uint64_t start) {
 
-  return perms;
+  if (start) {
+    stats.sampled[phase] += do_stats_clock() - start;
+    stats.samples[phase]++;
+  }
 }
 
 /**
- * @brief converts the entry attributes to username or, if not found, uid
+ * @brief adds the counters of the current thread to the total
  *
- * @param attr the entry attributes from lstat
- *
- * @returns the username if getpwuid() worked, otherwise uid, as a string
+ * @returns EXIT_SUCCESS
  */
-char *do_get_user(struct stat attr) {
-  struct passwd *pwd;
-
-  static unsigned int cache_uid = UINT_MAX;
-  static char *cache_pw_name = NULL;
-
-  /* skip getgrgid if we have the record in cache */
-  if (cache_uid == attr.st_uid) {
-    return cache_pw_name;
-  }
+int do_merge_stats(void) {
+  int phase;
 
-  /* reset the cache */
-  cache_uid = UINT_MAX;
-
-  pwd = getpwuid(attr.st_uid);
-
-  if (!pwd) {
-    /*
-     * the user is not found or getpwuid failed,
-     * return the uid as a string then;
-     * an unsigned int needs 10 chars
-     */
-    static char user[11];
-    if (snprintf(user, 11, "%u", attr.st_uid) < 0) {
-      fprintf(stderr, "%s: snprintf(): %s\n", program_name, strerror(errno));
-      return "";
-    }
-    return user;
+  pthread_mutex_lock(&stats_lock);
+  stats_total.entries += stats.entries;
+  stats_total.errors += stats.errors;
+  stats_total.nss_lookups += stats.nss_lookups;
+  stats_total.nss_hits += stats.nss_hits;
+  stats_total.mtime_hits += stats.mtime_hits;
+  stats_total.mtime_misses += stats.mtime_misses;
+  stats_total.dirs_read += stats.dirs_read;
+  stats_total.dirs_reused += stats.dirs_reused;
+  for (phase = 0; phase < PHASES; phase++) {
+    stats_total.calls[phase] += stats.calls[phase];
+    stats_total.samples[phase] += stats.samples[phase];
+    stats_total.sampled[phase] += stats.sampled[phase];
   }
+  pthread_mutex_unlock(&stats_lock);
 
-  cache_uid = pwd->pw_uid;
-  cache_pw_name = pwd->pw_name;
-
-  /* getpwuid manual: do not pass the returned pointer to free() */
+  memset(&stats, 0, sizeof(stats));
 
-  return pwd->pw_name;
+  return EXIT_SUCCESS;
 }
 
 /**
- * @brief converts the entry attributes to groupname or, if not found, gid
+ * @brief returns the share of hits in percent
  *
- * @param attr the entry attributes from lstat
+ * @param hits the hits
+ * @param misses the misses
  *
- * @returns the groupname if getgrgid() worked, otherwise gid, as a string
+ * @returns the percentage, 0 without any lookups
  */
-char *do_get_group(struct stat attr) {
-  struct group *grp;
+double do_stats_rate(unsigned long hits, unsigned long misses) {
 
-  static unsigned int cache_gid = UINT_MAX;
-  static char *cache_gr_name = NULL;
+  return hits + misses > 0 ? 100.0 * (double)hits / (double)(hits + misses) : 0;
+}
 
-  /* skip getgrgid if we have the record in cache */
-  if (cache_gid == attr.st_gid) {
-    return cache_gr_name;
-  }
+/**
+ * @brief prints the summed up counters to stderr
+ *
+ * @returns EXIT_SUCCESS, EXIT_FAILURE
+ */
+int do_print_stats(void) {
+#ifndef NO_STATS
+  static char *names[PHASES] = {"readdir", "stat", "nss", "match", "ls", "write", "content"};
+  double seconds = (double)(do_stats_clock() - stats_started) / 1e9;
+  int phase;
 
-  /* reset the cache */
-  cache_gid = UINT_MAX;
+  if (fprintf(stderr,
+              "%s: entries: %lu, directories read: %lu, reused: %lu, errors: %lu\n"
+              "%s: elapsed: %.3f s, throughput: %.0f entries/s\n"
+              "%s: nss lookups: %lu, cache hits: %lu (%.1f%%, users cached: %lu, groups cached: "
+              "%lu)\n"
+              "%s: mtime cache hits: %lu (%.1f%%)\n",
+              program_name, stats_total.entries, stats_total.dirs_read, stats_total.dirs_reused,
+              stats_total.errors, program_name, seconds,
+              seconds > 0 ? (double)stats_total.entries / seconds : 0, program_name,
+              stats_total.nss_lookups, stats_total.nss_hits,
+              do_stats_rate(stats_total.nss_hits, stats_total.nss_lookups),
+              (unsigned long)users.count, (unsigned long)groups.count, program_name,
+              stats_total.mtime_hits,
+              do_stats_rate(stats_total.mtime_hits, stats_total.mtime_misses)) < 0) {
+    return EXIT_FAILURE;
+  }
 
-  grp = getgrgid(attr.st_gid);
+  /* the time of all calls is extrapolated from the timed ones, summed up over all threads */
+  for (phase = 0; phase < PHASES; phase++) {
+    double estimated = stats_total.samples[phase] > 0
+                           ? (double)stats_total.sampled[phase] / 1e9 *
+                                 (double)stats_total.calls[phase] /
+                                 (double)stats_total.samples[phase]
+                           : 0;
 
-  if (!grp) {
-    /*
-     * the group is not found or getgrgid failed,
-     * return the gid as a string then;
-     * an unsigned int needs 10 chars
-     */
-    static char group[11];
-    if (snprintf(group, 11, "%u", attr.st_gid) < 0) {
-      fprintf(stderr, "%s: snprintf(): %s\n", program_name, strerror(errno));
-      return "";
+    if (stats_total.calls[phase] > 0 &&
+        fprintf(stderr, "%s: %-8s calls: %10lu, time: %8.3f s (%.0f ns/call)\n", program_name,
+                names[phase], stats_total.calls[phase], estimated,
+                estimated * 1e9 / (double)stats_total.calls[phase]) < 0) {
+      return EXIT_FAILURE;
     }
-    return group;
   }
+#else
+  if (fprintf(stderr, "%s: statistics are not compiled in\n", program_name) < 0) {
+    return EXIT_FAILURE;
+  }
+#endif
 
-  cache_gid = grp->gr_gid;
-  cache_gr_name = grp->gr_name;
-
-  /* getgrgid manual: do not pass the returned pointer to free() */
-
-  return grp->gr_name;
+  return EXIT_SUCCESS;
 }
 
 /**
- * @brief converts the entry attributes to a readable modification time
+ * @brief converts the entry attributes to a readable modification time;
+ * the rendered times are cached per minute (recent) or per day (older than 6 months),
+ * so most entries need neither localtime_r nor strftime
  *
  * @param attr the entry attributes from lstat
  *
  * @returns the entry modification time as a string
  */
 char *do_get_mtime(struct stat attr) {
-  static char mtime[16]; /* 12 length + 3 special + null */
+  static __thread mtime_t minutes[64];
+  static __thread mtime_t days[64];
+  mtime_t *slot;
   char *format;
-
-  time_t now = time(NULL);
+  time_t mtime = attr.st_mtime;
   time_t six_months = 31556952 / 2; /* 365.2425 * 60 * 60 * 24 */
-  struct tm *local_mtime = localtime(&attr.st_mtime);
+  time_t last;
+  int recent = (options.now - six_months) < mtime;
+  struct tm result;
+  struct tm edge;
+  struct tm *local_mtime;
+
+  slot = recent ? &minutes[(mtime / 60) & 63] : &days[(mtime / 86400) & 63];
 
-  if (!local_mtime) {
-    fprintf(stderr, "%s: localtime(): %s\n", program_name, strerror(errno));
+  if (slot->from <= mtime && mtime < slot->to) {
+    STATS_COUNT(mtime_hits);
+    return slot->text;
+  }
+
+  STATS_COUNT(mtime_misses);
+
+  if (!(local_mtime = localtime_r(&mtime, &result))) {
+    fprintf(stderr, "%s: localtime_r(): %s\n", program_name, strerror(errno));
     return "";
   }
 
-  if ((now - six_months) < attr.st_mtime) {
+  if (recent) {
     format = "%b %e %H:%M"; /* recent */
   } else {
     format = "%b %e  %Y"; /* older than 6 months */
   }
 
-  if (strftime(mtime, sizeof(mtime), format, local_mtime) == 0) {
+  slot->from = 0;
+  slot->to = 0;
+
+  if (strftime(slot->text, sizeof(slot->text), format, local_mtime) == 0) {
     fprintf(stderr, "%s: strftime(): %s\n", program_name, strerror(errno));
     return "";
   }
 
-  mtime[15] = '\0';
+  slot->text[15] = '\0';
+
+  /* the local minute or the local day around mtime */
+  if (recent) {
+    slot->from = mtime - local_mtime->tm_sec;
+    slot->to = slot->from + 60;
+  } else {
+    slot->from = mtime - (local_mtime->tm_hour * 3600 + local_mtime->tm_min * 60 + local_mtime->tm_sec);
+    slot->to = slot->from + 86400;
+  }
+
+  /* the range is only valid if the UTC offset doesn't change within it, e.g. because of DST */
+  last = slot->to - 1;
+
+  if (!localtime_r(&slot->from, &edge) || edge.tm_gmtoff != local_mtime->tm_gmtoff ||
+      !localtime_r(&last, &edge) || edge.tm_gmtoff != local_mtime->tm_gmtoff) {
+    slot->from = 0;
+    slot->to = 0;
+    return slot->text;
+  }
+
+  /* a local day usually spans two UTC days, it has to be found from both */
+  if (!recent) {
+    days[(slot->from / 86400) & 63] = *slot;
+    days[(last / 86400) & 63] = *slot;
+  }
 
-  return mtime;
+  return slot->text;
 }
 
 /**
@@ -895,6 +10688,7 @@ char *do_get_symlink(char *path, struct stat attr) {
 
     if (length < 0) {
       fprintf(stderr, "%s: readlink(%s): %s\n", program_name, path, strerror(errno));
+      STATS_COUNT(errors);
       free(symlink);
       return NULL;
     }